@@ -0,0 +1,531 @@
+// escr1bench -- end-to-end benchmark for ESCR1 extraction, on a synthetic corpus.
+//
+// Generates ESCR1_00 files with a realistic opcode mix, string lengths and half-width
+// kana density, writes them to a scratch directory, then runs each file through the
+// same phases the extractor does and times them:
+//
+//   load      read the file into memory
+//   decode    walk the code block with escr1_iterator
+//   lookup    resolve every ROP_STR to its string
+//   htoz      convert those strings to full-width
+//   format    format the listing (same layout as the extractor's print_opcode)
+//   write     write the listing out
+//
+// Results are printed to stdout as one JSON object per phase, so they can be collected
+// and compared across versions.
+//
+// Compile with:
+// $ g++ -O2 ./escr1bench.cpp ./libescr1.cpp -o escr1bench.exe -std=c++0x
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <string>
+
+#include "libescr1.h"
+#include "escr1rng.h"
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+const char * version = "v0.1";
+
+// SYNTHETIC CORPUS
+
+struct corpus_params {
+    uint64_t total_size;    // Approximate size of the whole corpus, in bytes.
+    uint file_size;         // Approximate size of each file.
+    double kana;            // Fraction of string characters that are half-width kana.
+    uint seed;
+};
+
+// Generated code is a sequence of statements, each shaped like what the script compiler
+// emits.  Weights are rough proportions taken from --stats over SENSUIBU.
+enum {
+    STMT_TEXT = 0,      // fileline; str; USR_MES
+    STMT_TALK,          // push; push; USR_TLK (variadic)
+    STMT_SETVAR,        // push id; push value; setvar
+    STMT_IF,            // push id; getflag; jumpz (over the next few statements)
+    STMT_EXPR,          // push id; getvar; push; add; push id; ...; setvar
+    STMT_CALL,          // call, to one of the subroutines after end
+    STMT_SOUND,         // push id; push 0 x4; USR_SEPLAY
+    STMT_JUMP,          // jump
+    STMT_COUNT
+};
+
+static const uint stmt_weights[STMT_COUNT] = { 40, 12, 10, 8, 6, 4, 12, 8 };
+
+// Each is a sound statement and a ret.
+static const uint SUBROUTINE_COUNT = 16;
+
+// SENSUIBU user op numbers used by the generator.
+static const uint OP_USR_MES = ROP_COUNT + 8;
+static const uint OP_USR_TLK = ROP_COUNT + 9;
+static const uint OP_USR_SEPLAY = ROP_COUNT + 28;
+
+struct byte_buffer {
+    std::vector<uchar> bytes;
+};
+
+static void emit_op(byte_buffer * b, uint op) {
+    b->bytes.push_back((uchar)op);
+}
+
+static void emit_op(byte_buffer * b, uint op, uint param) {
+    b->bytes.push_back((uchar)op);
+    uchar p[4];
+    memcpy(p, &param, 4);
+    b->bytes.insert(b->bytes.end(), p, p + 4);
+}
+
+// Branches only ever land on the start of a statement.  Targets that haven't been
+// generated yet are filled in once they are.
+struct branch_fixup {
+    uint at;            // Offset of the branch's param
+    uint stmt;          // Index of the statement it goes to
+};
+
+static void emit_branch(byte_buffer * b, uint op, uint stmt, const std::vector<uint> & starts, std::vector<branch_fixup> * fixups) {
+    if (stmt < starts.size()) {
+        emit_op(b, op, starts[stmt]);
+    }
+    else {
+        branch_fixup f = { (uint)b->bytes.size() + 1, stmt };
+        fixups->push_back(f);
+        emit_op(b, op, 0);
+    }
+}
+
+static void emit_sound(rng * r, byte_buffer * b) {
+    int params = SENSUIBU_OPS[OP_USR_SEPLAY - ROP_COUNT].param_count;
+    emit_op(b, ROP_PUSH, rng_range(r, 500));
+    for (int i = 1; i < params; ++i) {
+        emit_op(b, ROP_PUSH, 0);
+    }
+    emit_op(b, OP_USR_SEPLAY);
+}
+
+// One string: mostly two-byte kanji/hiragana, with half-width kana at the requested
+// density, a little ASCII punctuation and the occasional ESC.
+static void generate_string(rng * r, double kana, std::vector<uchar> * data) {
+    // Lengths cluster around a line of dialogue, with a long tail.
+    uint chars = 4 + rng_range(r, 24) + (rng_range(r, 8) == 0 ? rng_range(r, 200) : 0);
+    for (uint i = 0; i < chars; ++i) {
+        double u = rng_unit(r);
+        if (u < kana) {
+            data->push_back((uchar)(0xa6 + rng_range(r, 0xdd - 0xa6 + 1)));
+        }
+        else if (u < kana + 0.05) {
+            static const uchar punct[] = { '!', '?', '.', ' ' };
+            data->push_back(punct[rng_range(r, sizeof(punct))]);
+        }
+        else if (u < kana + 0.06) {
+            data->push_back(0x1b);
+            data->push_back((uchar)(0xa6 + rng_range(r, 0x10)));
+        }
+        else {
+            data->push_back((uchar)(0x88 + rng_range(r, 0x10)));
+            data->push_back((uchar)(0x40 + rng_range(r, 0x3f)));
+        }
+    }
+    data->push_back(0);
+}
+
+void generate_script(rng * r, const corpus_params * params, std::vector<uchar> * out) {
+    byte_buffer code;
+    std::vector<uint> index;
+    std::vector<uchar> data;
+
+    uint total_weight = 0;
+    for (uint i = 0; i < STMT_COUNT; ++i) total_weight += stmt_weights[i];
+
+    std::vector<uint> starts;           // Offset of each statement
+    std::vector<branch_fixup> fixups;
+    std::vector<branch_fixup> calls;    // stmt is the subroutine
+
+    uint line = 1;
+    while (code.bytes.size() + data.size() + index.size() * 4 < params->file_size) {
+        uint pick = rng_range(r, total_weight);
+        uint stmt = 0;
+        while (pick >= stmt_weights[stmt]) {
+            pick -= stmt_weights[stmt];
+            stmt++;
+        }
+
+        uint current = (uint)starts.size();
+        starts.push_back((uint)code.bytes.size());
+        switch (stmt) {
+            case STMT_TEXT:
+                emit_op(&code, ROP_FILELINE, line++);
+                index.push_back((uint)data.size());
+                generate_string(r, params->kana, &data);
+                emit_op(&code, ROP_STR, (uint)index.size() - 1);
+                emit_op(&code, OP_USR_MES);
+                break;
+            case STMT_TALK:
+                emit_op(&code, ROP_PUSH, rng_range(r, 40));
+                emit_op(&code, ROP_PUSH, rng_range(r, 400));
+                emit_op(&code, OP_USR_TLK, 2);
+                break;
+            case STMT_SETVAR:
+                emit_op(&code, ROP_PUSH, rng_range(r, 256));
+                emit_op(&code, ROP_PUSH, rng_range(r, 100));
+                emit_op(&code, ROP_SETVAR);
+                break;
+            case STMT_IF:
+                emit_op(&code, ROP_PUSH, rng_range(r, 1024));
+                emit_op(&code, ROP_GETFLAG);
+                emit_branch(&code, ROP_JUMPZ, current + 2 + rng_range(r, 4), starts, &fixups);
+                break;
+            case STMT_EXPR: {
+                uint id = rng_range(r, 256);
+                emit_op(&code, ROP_PUSH, id);
+                emit_op(&code, ROP_PUSH, id);
+                emit_op(&code, ROP_GETVAR);
+                emit_op(&code, ROP_PUSH, 1 + rng_range(r, 10));
+                emit_op(&code, ROP_ADD);
+                emit_op(&code, ROP_SETVAR);
+            } break;
+            case STMT_CALL: {
+                branch_fixup f = { (uint)code.bytes.size() + 1, rng_range(r, SUBROUTINE_COUNT) };
+                calls.push_back(f);
+                emit_op(&code, ROP_CALL, 0);
+            } break;
+            case STMT_SOUND:
+                emit_sound(r, &code);
+                break;
+            case STMT_JUMP:
+                emit_branch(&code, ROP_JUMP, rng_range(r, current + 8), starts, &fixups);
+                break;
+        }
+    }
+    // Branches past the last statement go to the end.
+    starts.push_back((uint)code.bytes.size());
+    emit_op(&code, ROP_END);
+    for (uint i = 0; i < fixups.size(); ++i) {
+        uint target = starts[std::min(fixups[i].stmt, (uint)starts.size() - 1)];
+        memcpy(&code.bytes[fixups[i].at], &target, 4);
+    }
+
+    std::vector<uint> subroutines;
+    for (uint i = 0; i < SUBROUTINE_COUNT; ++i) {
+        subroutines.push_back((uint)code.bytes.size());
+        emit_sound(r, &code);
+        emit_op(&code, ROP_RET);
+    }
+    for (uint i = 0; i < calls.size(); ++i) {
+        memcpy(&code.bytes[calls[i].at], &subroutines[calls[i].stmt], 4);
+    }
+
+    out->assign(magic, magic + 8);
+    append_uint(out, (uint)index.size());
+    for (uint i = 0; i < index.size(); ++i) {
+        append_uint(out, index[i]);
+    }
+    append_uint(out, (uint)code.bytes.size());
+    out->insert(out->end(), code.bytes.begin(), code.bytes.end());
+    append_uint(out, (uint)data.size());
+    out->insert(out->end(), data.begin(), data.end());
+}
+
+// Writes the corpus to dir as script_00000.bin, ...  Returns the file names.
+std::vector<std::string> generate_corpus(const char * dir, const corpus_params * params) {
+#ifdef _WIN32
+    _mkdir(dir);
+#else
+    mkdir(dir, 0755);
+#endif
+
+    rng r;
+    r.state = params->seed ? params->seed : 1;
+
+    std::vector<std::string> names;
+    std::vector<uchar> script;
+    uint64_t written = 0;
+    while (written < params->total_size) {
+        generate_script(&r, params, &script);
+
+        char name[1024];
+        snprintf(name, sizeof(name), "%s/script_%05u.bin", dir, (uint)names.size());
+        FILE * fp = fopen(name, "wb");
+        if (fp == NULL) {
+            fprintf(stderr, "Failed to open file: [%s]\n", name);
+            exit(1);
+        }
+        fwrite(&script[0], 1, script.size(), fp);
+        fclose(fp);
+
+        names.push_back(name);
+        written += script.size();
+    }
+    return names;
+}
+
+// PHASES
+
+enum {
+    PHASE_LOAD = 0,
+    PHASE_DECODE,
+    PHASE_LOOKUP,
+    PHASE_HTOZ,
+    PHASE_FORMAT,
+    PHASE_WRITE,
+    PHASE_COUNT
+};
+
+static const char * phase_names[PHASE_COUNT] = {
+    "load", "decode", "lookup", "htoz", "format", "write",
+};
+
+struct phase_result {
+    double seconds;
+    uint64_t bytes;     // Bytes consumed by the phase
+    uint64_t items;     // Files, instructions or strings, depending on the phase
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double seconds_since(bench_clock::time_point start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static uchar * read_whole_file(const char * filename, uint * size) {
+    FILE * fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open file: [%s]\n", filename);
+        exit(1);
+    }
+    fseek(fp, 0, SEEK_END);
+    long bytes = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uchar * data = (uchar *)malloc(bytes);
+    *size = (uint)fread(data, 1, bytes, fp);
+    fclose(fp);
+    return data;
+}
+
+void run_phases(const std::vector<std::string> & names, const char * listing_path, phase_result * results) {
+    memset(results, 0, sizeof(phase_result) * PHASE_COUNT);
+
+    escr1_opset opset;
+    escr1_opset_init(&opset, SENSUIBU_OPS, SENSUIBU_OP_COUNT);
+
+    FILE * listing = fopen(listing_path, "wb");
+    if (listing == NULL) {
+        fprintf(stderr, "Failed to open file: [%s]\n", listing_path);
+        exit(1);
+    }
+
+    std::vector<opcode> ops;
+    std::vector<const char *> strings;
+    std::vector<std::string> converted;
+    std::vector<char> text;
+    uchar convert_buffer[2048];
+
+    for (uint f = 0; f < names.size(); ++f) {
+        bench_clock::time_point t = bench_clock::now();
+        uint size;
+        uchar * data = read_whole_file(names[f].c_str(), &size);
+        results[PHASE_LOAD].seconds += seconds_since(t);
+        results[PHASE_LOAD].bytes += size;
+        results[PHASE_LOAD].items++;
+
+        script_file script;
+        if (escr1_open_memory(data, size, &script) != ESCR1_OK) {
+            fprintf(stderr, "Generated a bad script: [%s]\n", names[f].c_str());
+            exit(1);
+        }
+
+        t = bench_clock::now();
+        ops.clear();
+        escr1_iterator it;
+        escr1_iter_init(&it, &script, &opset);
+        opcode op;
+        while (escr1_iter_next(&it, &op)) {
+            ops.push_back(op);
+        }
+        results[PHASE_DECODE].seconds += seconds_since(t);
+        results[PHASE_DECODE].bytes += script.code_size;
+        results[PHASE_DECODE].items += ops.size();
+
+        t = bench_clock::now();
+        strings.clear();
+        uint64_t string_bytes = 0;
+        for (uint i = 0; i < ops.size(); ++i) {
+            const char * str;
+            if (ops[i].op == ROP_STR && escr1_lookup_string(&script, ops[i].param, &str)) {
+                strings.push_back(str);
+            }
+        }
+        results[PHASE_LOOKUP].seconds += seconds_since(t);
+        results[PHASE_LOOKUP].items += strings.size();
+
+        t = bench_clock::now();
+        converted.resize(strings.size());
+        for (uint i = 0; i < strings.size(); ++i) {
+            uint n = escr1_convert_htoz((const uchar *)strings[i], convert_buffer, sizeof(convert_buffer));
+            converted[i].assign((char *)convert_buffer, n);
+            string_bytes += n;
+        }
+        results[PHASE_HTOZ].seconds += seconds_since(t);
+        results[PHASE_HTOZ].bytes += string_bytes;
+        results[PHASE_HTOZ].items += strings.size();
+
+        t = bench_clock::now();
+        text.clear();
+        uint next_string = 0;
+        char line[128];
+        for (uint i = 0; i < ops.size(); ++i) {
+            const opcode * o = &ops[i];
+            int n;
+            if (opset.has_param[o->op]) {
+                n = snprintf(line, sizeof(line), "%08x:\t%-20s\t%08x\n", o->offset, opset.names[o->op], o->param);
+            }
+            else {
+                n = snprintf(line, sizeof(line), "%08x:\t%s\n", o->offset, opset.names[o->op]);
+            }
+            text.insert(text.end(), line, line + n);
+
+            if (o->op == ROP_STR && next_string < converted.size()) {
+                const std::string & s = converted[next_string++];
+                text.push_back('\t');
+                text.push_back('\t');
+                text.insert(text.end(), s.begin(), s.end());
+                text.push_back('\n');
+                text.push_back('\n');
+            }
+        }
+        results[PHASE_FORMAT].seconds += seconds_since(t);
+        results[PHASE_FORMAT].bytes += text.size();
+        results[PHASE_FORMAT].items += ops.size();
+
+        t = bench_clock::now();
+        if (!text.empty()) {
+            fwrite(&text[0], 1, text.size(), listing);
+        }
+        fflush(listing);
+        results[PHASE_WRITE].seconds += seconds_since(t);
+        results[PHASE_WRITE].bytes += text.size();
+        results[PHASE_WRITE].items++;
+
+        free(data);
+    }
+
+    fclose(listing);
+}
+
+// MAIN
+
+// Accepts plain bytes or a k/m/g suffix.
+static uint64_t parse_size(const char * s) {
+    char * end;
+    double v = strtod(s, &end);
+    switch (*end) {
+        case 'k': case 'K': v *= 1024.0; break;
+        case 'm': case 'M': v *= 1024.0 * 1024.0; break;
+        case 'g': case 'G': v *= 1024.0 * 1024.0 * 1024.0; break;
+    }
+    return (uint64_t)v;
+}
+
+void usage(const char * argv0) {
+    fprintf(stderr, "USAGE:  %s [options]\n\n", argv0);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "--help    | -h    Show this listing and exit.\n");
+    fprintf(stderr, "--size N          Total corpus size, e.g. 64k, 100m, 2g (default 16m).\n");
+    fprintf(stderr, "--file-size N     Approximate size of each script (default 256k).\n");
+    fprintf(stderr, "--kana F          Fraction of string characters that are half-width kana (default 0.3).\n");
+    fprintf(stderr, "--seed N          Generator seed (default 1).\n");
+    fprintf(stderr, "--dir DIR         Scratch directory for the corpus (default escr1bench.tmp).\n");
+    fprintf(stderr, "--keep            Leave the corpus and listing in DIR afterwards.\n");
+    fprintf(stderr, "--generate-only   Write the corpus to DIR and exit.\n");
+}
+
+int main(int argc, char ** argv) {
+    corpus_params params;
+    params.total_size = 16 << 20;
+    params.file_size = 256 << 10;
+    params.kana = 0.3;
+    params.seed = 1;
+    const char * dir = "escr1bench.tmp";
+    bool keep = false;
+    bool generate_only = false;
+
+    for (int i = 1; i < argc; ++i) {
+        bool has_arg = i + 1 < argc;
+        if (!strcmp(argv[i], "--size") && has_arg) {
+            params.total_size = parse_size(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--file-size") && has_arg) {
+            params.file_size = (uint)parse_size(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--kana") && has_arg) {
+            params.kana = atof(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--seed") && has_arg) {
+            params.seed = (uint)strtoul(argv[++i], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "--dir") && has_arg) {
+            dir = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--keep")) {
+            keep = true;
+        }
+        else if (!strcmp(argv[i], "--generate-only")) {
+            generate_only = true;
+            keep = true;
+        }
+        else {
+            usage(argv[0]);
+            exit(!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h") ? 0 : 1);
+        }
+    }
+
+    fprintf(stderr, "ESCR1 Benchmark %s\n\n", version);
+
+    bench_clock::time_point t = bench_clock::now();
+    std::vector<std::string> names = generate_corpus(dir, &params);
+    fprintf(stderr, "Generated %u files in %.2fs\n", (uint)names.size(), seconds_since(t));
+
+    if (!generate_only) {
+        char listing_path[1024];
+        snprintf(listing_path, sizeof(listing_path), "%s/listing.txt", dir);
+
+        phase_result results[PHASE_COUNT];
+        run_phases(names, listing_path, results);
+
+        for (uint p = 0; p < PHASE_COUNT; ++p) {
+            phase_result * r = &results[p];
+            printf("{\"version\":\"%s\",\"corpus_bytes\":%llu,\"files\":%u,\"kana\":%.3f,\"seed\":%u,"
+                   "\"phase\":\"%s\",\"seconds\":%.6f,\"bytes\":%llu,\"items\":%llu,\"mb_per_s\":%.2f}\n",
+                   version, (unsigned long long)params.total_size, (uint)names.size(), params.kana, params.seed,
+                   phase_names[p], r->seconds, (unsigned long long)r->bytes, (unsigned long long)r->items,
+                   r->seconds > 0 ? r->bytes / r->seconds / (1024.0 * 1024.0) : 0.0);
+        }
+
+        if (!keep) {
+            remove(listing_path);
+        }
+    }
+
+    if (!keep) {
+        for (uint i = 0; i < names.size(); ++i) {
+            remove(names[i].c_str());
+        }
+#ifdef _WIN32
+        _rmdir(dir);
+#else
+        rmdir(dir);
+#endif
+    }
+
+    return 0;
+}
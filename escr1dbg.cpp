@@ -0,0 +1,604 @@
+// escr1dbg -- interactive debugger for ESCR1_00 scripts, on the escr1vm interpreter.
+//
+// Reads commands from stdin, one per line, and prints results to stdout, so it can be
+// driven by hand or by another program over a pipe.  An empty line repeats the last
+// step or list command; a repeated list goes on from where the last one stopped.  Type
+// "help" for the commands.
+//
+// Breakpoints cost nothing until they are set, and only the instructions they're set on
+// pay for them:
+//   - A breakpoint at an offset points that one instruction at the debugger's trap slot.
+//   - Line breakpoints replace the ROP_FILELINE handler, so only fileline ops check them.
+//   - Watchpoints replace the ROP_SETVAR or ROP_SETFLAG handler while any are set, and
+//     stop after the write.
+// Ctrl-C stops a running script at its next branch.
+//
+// User ops come from --profile, and fileline params are split into file and line numbers
+// by --fileline, both as in the extractor.
+//
+// Compile with:
+// $ g++ -O2 ./escr1dbg.cpp ./escr1vm.cpp ./libescr1.cpp -o escr1dbg.exe -std=c++0x
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <csignal>
+#include <algorithm>
+#include <vector>
+#include <unordered_set>
+
+#include "libescr1.h"
+#include "escr1vm.h"
+
+const char * version = "v0.1";
+
+// DEBUGGER STATE
+
+static const uint DBG_SLOT_BREAK = VM_SLOT_TOOL;
+static const uint NO_PC = (uint)-1;
+
+enum breakpoint_kind {
+    BREAK_OFFSET,
+    BREAK_LINE,
+};
+
+struct breakpoint {
+    breakpoint_kind kind;
+    uint value;         // Instruction index, or fileline param
+    bool live;
+};
+
+struct debugger {
+    escr1_vm vm;
+    std::vector<breakpoint> breaks;     // Numbered from 1, in the order they were set
+    std::unordered_set<uint> lines;     // Fileline params with a live breakpoint
+    std::unordered_set<uint> watch_vars;
+    std::unordered_set<uint> watch_flags;
+    uint resume_pc;                     // Breakpoints here don't fire for one step
+    bool show_calls;
+    char reason[160];
+};
+
+static volatile sig_atomic_t interrupted = 0;
+
+escr1_fileline_format fileline_format = { 0, false };
+
+// PATCHED HANDLERS
+
+static bool dbg_break(escr1_vm * vm, const vm_insn * in) {
+    debugger * d = (debugger *)vm->tool;
+    if (vm->pc != d->resume_pc) {
+        snprintf(d->reason, sizeof(d->reason), "Breakpoint at %08x", in->offset);
+        return escr1_vm_stop(vm, VM_STOPPED, NULL);
+    }
+    return vm->table[in->op](vm, in);
+}
+
+static bool dbg_fileline(escr1_vm * vm, const vm_insn * in) {
+    debugger * d = (debugger *)vm->tool;
+    if (vm->pc != d->resume_pc && d->lines.count(in->param)) {
+        uint file, line;
+        escr1_split_fileline(&fileline_format, in->param, &file, &line);
+        snprintf(d->reason, sizeof(d->reason), "Breakpoint at line %u:%u (%08x)", file, line, in->offset);
+        return escr1_vm_stop(vm, VM_STOPPED, NULL);
+    }
+    return escr1_vm_base_handler(ROP_FILELINE)(vm, in);
+}
+
+static bool dbg_watch(escr1_vm * vm, const vm_insn * in, const std::unordered_set<uint> & watched,
+                      std::unordered_map<uint, int> & values, const char * kind) {
+    size_t n = vm->stack.size();
+    if (n < 2 || !watched.count((uint)vm->stack[n - 2])) {
+        return escr1_vm_base_handler(in->op)(vm, in);
+    }
+    uint id = (uint)vm->stack[n - 2];
+    std::unordered_map<uint, int>::const_iterator it = values.find(id);
+    int old = it == values.end() ? 0 : it->second;
+    if (!escr1_vm_base_handler(in->op)(vm, in)) return false;
+
+    debugger * d = (debugger *)vm->tool;
+    snprintf(d->reason, sizeof(d->reason), "%s %x: %d -> %d at %08x", kind, id, old, values[id], in->offset);
+    return escr1_vm_stop(vm, VM_STOPPED, NULL);
+}
+
+static bool dbg_setvar(escr1_vm * vm, const vm_insn * in) {
+    debugger * d = (debugger *)vm->tool;
+    return dbg_watch(vm, in, d->watch_vars, vm->vars, "var");
+}
+
+static bool dbg_setflag(escr1_vm * vm, const vm_insn * in) {
+    debugger * d = (debugger *)vm->tool;
+    return dbg_watch(vm, in, d->watch_flags, vm->flags, "flag");
+}
+
+// Only installed while continuing, so a script stuck in a loop can be stopped.
+static bool dbg_branch(escr1_vm * vm, const vm_insn * in) {
+    if (interrupted) {
+        interrupted = 0;
+        debugger * d = (debugger *)vm->tool;
+        snprintf(d->reason, sizeof(d->reason), "Interrupted at %08x", in->offset);
+        return escr1_vm_stop(vm, VM_STOPPED, NULL);
+    }
+    return escr1_vm_base_handler(in->op)(vm, in);
+}
+
+static void on_sigint(int) {
+    interrupted = 1;
+}
+
+// Puts the table and the instruction slots back in line with the breakpoint and watch
+// sets, so whatever isn't set runs on the plain handlers.
+static void update_patches(debugger * d) {
+    escr1_vm * vm = &d->vm;
+    vm->table[ROP_SETVAR] = d->watch_vars.empty() ? escr1_vm_base_handler(ROP_SETVAR) : dbg_setvar;
+    vm->table[ROP_SETFLAG] = d->watch_flags.empty() ? escr1_vm_base_handler(ROP_SETFLAG) : dbg_setflag;
+    vm->table[DBG_SLOT_BREAK] = dbg_break;
+
+    for (uint i = 0; i < vm->count; ++i) {
+        vm->insns[i].slot = vm->insns[i].op;
+    }
+    d->lines.clear();
+    for (uint i = 0; i < d->breaks.size(); ++i) {
+        const breakpoint & b = d->breaks[i];
+        if (!b.live) continue;
+        if (b.kind == BREAK_OFFSET) {
+            vm->insns[b.value].slot = (uint16_t)DBG_SLOT_BREAK;
+        }
+        else {
+            d->lines.insert(b.value);
+        }
+    }
+    vm->table[ROP_FILELINE] = d->lines.empty() ? escr1_vm_base_handler(ROP_FILELINE) : dbg_fileline;
+}
+
+// EXECUTION
+
+static void print_insn(const debugger * d, uint i) {
+    const escr1_vm * vm = &d->vm;
+    const vm_insn * in = &vm->insns[i];
+    const char * mark = i == vm->pc ? "=>" : "  ";
+    const char * trap = in->slot == DBG_SLOT_BREAK ? "*" : " ";
+    if (i >= vm->count) {
+        printf("%s%s%08x:\t(end of code)\n", mark, trap, in->offset);
+        return;
+    }
+    const char * name = vm->opset->names[in->op];
+    if (in->op == ROP_JUMP || in->op == ROP_JUMPZ || in->op == ROP_CALL) {
+        printf("%s%s%08x:\t%-20s\t%08x\n", mark, trap, in->offset, name, vm->insns[in->param].offset);
+    }
+    else if (in->param != (uint)-1) {
+        const char * str;
+        if (in->op == ROP_STR && escr1_lookup_string(vm->script, in->param, &str)) {
+            printf("%s%s%08x:\t%-20s\t%08x\t\"%s\"\n", mark, trap, in->offset, name, in->param, str);
+        }
+        else {
+            printf("%s%s%08x:\t%-20s\t%08x\n", mark, trap, in->offset, name, in->param);
+        }
+    }
+    else {
+        printf("%s%s%08x:\t%s\n", mark, trap, in->offset, name);
+    }
+}
+
+static void print_stop(debugger * d, vm_status status) {
+    escr1_vm * vm = &d->vm;
+    switch (status) {
+        case VM_HALTED:
+            printf("Script ended at %08x\n", vm->insns[vm->pc].offset);
+            return;
+        case VM_ERROR:
+            printf("Error at %08x: %s\n", vm->insns[vm->pc].offset, vm->error);
+            return;
+        case VM_STOPPED:
+            if (d->reason[0]) printf("%s\n", d->reason);
+            break;
+        default:
+            break;
+    }
+    print_insn(d, vm->pc);
+}
+
+// Runs the current instruction past any breakpoint on it.
+static vm_status step_over_break(debugger * d) {
+    d->reason[0] = 0;
+    d->resume_pc = d->vm.pc;
+    vm_status status = escr1_vm_step(&d->vm);
+    d->resume_pc = NO_PC;
+    return status;
+}
+
+static void do_step(debugger * d, uint n) {
+    vm_status status = d->vm.status;
+    for (uint i = 0; i < n; ++i) {
+        status = step_over_break(d);
+        if (status != VM_READY) break;
+    }
+    print_stop(d, status);
+}
+
+static void do_continue(debugger * d) {
+    escr1_vm * vm = &d->vm;
+    vm_status status = step_over_break(d);
+    if (status == VM_READY) {
+        static const uint branches[] = { ROP_JUMP, ROP_JUMPZ, ROP_CALL };
+        for (uint i = 0; i < 3; ++i) vm->table[branches[i]] = dbg_branch;
+        interrupted = 0;
+        status = escr1_vm_run(vm);
+        for (uint i = 0; i < 3; ++i) vm->table[branches[i]] = escr1_vm_base_handler(branches[i]);
+    }
+    print_stop(d, status);
+}
+
+// COMMANDS
+
+static bool parse_uint(const char * s, int base, uint * v) {
+    if (s == NULL || *s == 0) return false;
+    char * end;
+    *v = (uint)strtoul(s, &end, base);
+    return *end == 0;
+}
+
+static void add_break(debugger * d, const char * arg, const char * arg2) {
+    escr1_vm * vm = &d->vm;
+    breakpoint b;
+    b.live = true;
+    if (arg && !strcmp(arg, "line")) {
+        const char * colon = arg2 ? strchr(arg2, ':') : NULL;
+        uint file = 0, line;
+        if (colon) {
+            char head[32];
+            size_t n = colon - arg2 < 31 ? colon - arg2 : 31;
+            memcpy(head, arg2, n);
+            head[n] = 0;
+            if (!parse_uint(head, 10, &file) || !parse_uint(colon + 1, 10, &line)) {
+                printf("Bad line [%s], expected FILE:LINE\n", arg2);
+                return;
+            }
+        }
+        else if (!parse_uint(arg2, 10, &line)) {
+            printf("Usage: break line [FILE:]LINE\n");
+            return;
+        }
+        b.kind = BREAK_LINE;
+        b.value = escr1_join_fileline(&fileline_format, file, line);
+        d->breaks.push_back(b);
+        update_patches(d);
+        printf("Breakpoint %u at line %u:%u (fileline %08x)\n", (uint)d->breaks.size(), file, line, b.value);
+        return;
+    }
+
+    uint offset;
+    if (!parse_uint(arg, 16, &offset)) {
+        printf("Usage: break OFFSET | break line [FILE:]LINE\n");
+        return;
+    }
+    uint i = escr1_vm_find(vm, offset);
+    if (i >= vm->count) {
+        printf("No instruction at %08x\n", offset);
+        return;
+    }
+    b.kind = BREAK_OFFSET;
+    b.value = i;
+    d->breaks.push_back(b);
+    update_patches(d);
+    printf("Breakpoint %u at %08x\n", (uint)d->breaks.size(), vm->insns[i].offset);
+}
+
+static void delete_break(debugger * d, const char * arg) {
+    uint n;
+    if (arg == NULL) {
+        d->breaks.clear();
+        printf("Deleted all breakpoints\n");
+    }
+    else if (parse_uint(arg, 10, &n) && n >= 1 && n <= d->breaks.size() && d->breaks[n - 1].live) {
+        d->breaks[n - 1].live = false;
+        printf("Deleted breakpoint %u\n", n);
+    }
+    else {
+        printf("No breakpoint [%s]\n", arg);
+        return;
+    }
+    update_patches(d);
+}
+
+static void set_watch(debugger * d, const char * kind, const char * arg, bool on) {
+    std::unordered_set<uint> * set = NULL;
+    if (kind && !strcmp(kind, "var")) set = &d->watch_vars;
+    if (kind && !strcmp(kind, "flag")) set = &d->watch_flags;
+    uint id;
+    if (set == NULL || !parse_uint(arg, 16, &id)) {
+        printf("Usage: %s var|flag ID\n", on ? "watch" : "unwatch");
+        return;
+    }
+    if (on) set->insert(id);
+    else set->erase(id);
+    update_patches(d);
+    printf("%s %s %x\n", on ? "Watching" : "Stopped watching", kind, id);
+}
+
+static void print_info(const debugger * d) {
+    const escr1_vm * vm = &d->vm;
+    for (uint i = 0; i < d->breaks.size(); ++i) {
+        const breakpoint & b = d->breaks[i];
+        if (!b.live) continue;
+        if (b.kind == BREAK_OFFSET) {
+            printf("%u\tbreak at %08x\n", i + 1, vm->insns[b.value].offset);
+        }
+        else {
+            uint file, line;
+            escr1_split_fileline(&fileline_format, b.value, &file, &line);
+            printf("%u\tbreak at line %u:%u\n", i + 1, file, line);
+        }
+    }
+    for (std::unordered_set<uint>::const_iterator it = d->watch_vars.begin(); it != d->watch_vars.end(); ++it) {
+        printf("\twatch var %x\n", *it);
+    }
+    for (std::unordered_set<uint>::const_iterator it = d->watch_flags.begin(); it != d->watch_flags.end(); ++it) {
+        printf("\twatch flag %x\n", *it);
+    }
+}
+
+static void print_values(const std::unordered_map<uint, int> & values, const char * kind) {
+    std::vector<uint> ids;
+    for (std::unordered_map<uint, int>::const_iterator it = values.begin(); it != values.end(); ++it) {
+        ids.push_back(it->first);
+    }
+    std::sort(ids.begin(), ids.end());
+    if (ids.empty()) printf("No %ss set\n", kind);
+    for (uint i = 0; i < ids.size(); ++i) {
+        printf("%s %x = %d\n", kind, ids[i], values.find(ids[i])->second);
+    }
+}
+
+static void print_stack(const debugger * d) {
+    const escr1_vm * vm = &d->vm;
+    printf("Stack (%u, top first):\n", (uint)vm->stack.size());
+    for (size_t i = vm->stack.size(); i-- > 0;) {
+        printf("  %d\t(%08x)\n", vm->stack[i], (uint)vm->stack[i]);
+    }
+    printf("Calls (%u, innermost first):\n", (uint)vm->calls.size());
+    for (size_t i = vm->calls.size(); i-- > 0;) {
+        printf("  return to %08x\n", vm->insns[vm->calls[i]].offset);
+    }
+}
+
+static void print_where(const debugger * d) {
+    const escr1_vm * vm = &d->vm;
+    if (vm->has_fileline) {
+        uint file, line;
+        escr1_split_fileline(&fileline_format, vm->fileline, &file, &line);
+        printf("Line %u:%u, ", file, line);
+    }
+    printf("instruction %u of %u\n", vm->pc, vm->count);
+    print_insn(d, vm->pc);
+}
+
+static void print_list(const debugger * d, uint from, uint n) {
+    for (uint i = from; i <= d->vm.count && i < from + n; ++i) {
+        print_insn(d, i);
+    }
+}
+
+static void print_calls(escr1_vm * vm, uint op, const int * args, uint count, void * user) {
+    debugger * d = (debugger *)user;
+    if (!d->show_calls) return;
+    const char * name = vm->opset->names[op];
+    int len = (int)strlen(name);
+    while (len > 0 && name[len - 1] == ' ') len--;
+    printf("  %.*s(", len, name);
+    for (uint i = 0; i < count; ++i) {
+        printf(i ? ", %d" : "%d", args[i]);
+    }
+    printf(")\n");
+}
+
+static void help() {
+    printf("break OFFSET            | b    Break at the instruction containing hex OFFSET.\n");
+    printf("break line [FILE:]LINE         Break at the fileline op for that line.\n");
+    printf("delete [N]              | d    Delete breakpoint N, or all of them.\n");
+    printf("watch var|flag ID              Stop after writes to var or flag ID (hex).\n");
+    printf("unwatch var|flag ID\n");
+    printf("info                    | i    List breakpoints and watchpoints.\n");
+    printf("step [N]                | s    Run N instructions (default 1).\n");
+    printf("continue                | c    Run until a breakpoint, watchpoint, the end or an error.\n");
+    printf("stack                   | bt   Show the value stack and the call stack.\n");
+    printf("vars, flags                    Show every var or flag that has been set.\n");
+    printf("where                   | w    Show the current line and instruction.\n");
+    printf("list [OFFSET] [N]       | l    Show N instructions (default 10) from OFFSET or the current one.\n");
+    printf("calls on|off                   Print user op calls and their args as they run.\n");
+    printf("reset                          Start over from the first instruction.\n");
+    printf("quit                    | q\n");
+}
+
+// Returns false to quit.  repeat is set when an empty line is running line again.
+static bool run_command(debugger * d, char * line, uint * list_next, bool repeat) {
+    char * argv[4] = { NULL, NULL, NULL, NULL };
+    uint argc = 0;
+    for (char * tok = strtok(line, " \t\r\n"); tok && argc < 4; tok = strtok(NULL, " \t\r\n")) {
+        argv[argc++] = tok;
+    }
+    const char * cmd = argv[0];
+    escr1_vm * vm = &d->vm;
+    uint n;
+
+    if (!strcmp(cmd, "break") || !strcmp(cmd, "b")) {
+        if (argc == 1) print_info(d);
+        else add_break(d, argv[1], argv[2]);
+    }
+    else if (!strcmp(cmd, "delete") || !strcmp(cmd, "d")) {
+        delete_break(d, argv[1]);
+    }
+    else if (!strcmp(cmd, "watch")) {
+        set_watch(d, argv[1], argv[2], true);
+    }
+    else if (!strcmp(cmd, "unwatch")) {
+        set_watch(d, argv[1], argv[2], false);
+    }
+    else if (!strcmp(cmd, "info") || !strcmp(cmd, "i")) {
+        print_info(d);
+    }
+    else if (!strcmp(cmd, "step") || !strcmp(cmd, "s")) {
+        do_step(d, parse_uint(argv[1], 10, &n) ? n : 1);
+    }
+    else if (!strcmp(cmd, "continue") || !strcmp(cmd, "c")) {
+        do_continue(d);
+    }
+    else if (!strcmp(cmd, "stack") || !strcmp(cmd, "bt")) {
+        print_stack(d);
+    }
+    else if (!strcmp(cmd, "vars")) {
+        print_values(vm->vars, "var");
+    }
+    else if (!strcmp(cmd, "flags")) {
+        print_values(vm->flags, "flag");
+    }
+    else if (!strcmp(cmd, "where") || !strcmp(cmd, "w")) {
+        print_where(d);
+    }
+    else if (!strcmp(cmd, "list") || !strcmp(cmd, "l")) {
+        uint from = *list_next == NO_PC ? vm->pc : *list_next;
+        // Repeated, a list goes on from where the last one stopped, with the same N.
+        uint offset;
+        if (!repeat && parse_uint(argv[1], 16, &offset)) {
+            from = escr1_vm_find(vm, offset);
+        }
+        uint count = parse_uint(argv[2], 10, &n) ? n : 10;
+        print_list(d, from, count);
+        *list_next = from + count;
+        return true;
+    }
+    else if (!strcmp(cmd, "calls")) {
+        d->show_calls = argv[1] && !strcmp(argv[1], "on");
+    }
+    else if (!strcmp(cmd, "reset")) {
+        escr1_vm_reset(vm);
+        print_where(d);
+    }
+    else if (!strcmp(cmd, "quit") || !strcmp(cmd, "q")) {
+        return false;
+    }
+    else if (!strcmp(cmd, "help") || !strcmp(cmd, "h")) {
+        help();
+    }
+    else {
+        printf("Unknown command [%s], try help\n", cmd);
+    }
+    *list_next = NO_PC;
+    return true;
+}
+
+// Whether an empty line after line should run it again: only step and list.
+static bool repeats(const char * line) {
+    line += strspn(line, " \t");
+    size_t n = strcspn(line, " \t\r\n");
+    static const char * const words[] = { "step", "s", "list", "l" };
+    for (uint i = 0; i < sizeof(words) / sizeof(words[0]); ++i) {
+        if (strlen(words[i]) == n && !strncmp(line, words[i], n)) return true;
+    }
+    return false;
+}
+
+static void repl(debugger * d) {
+    char line[256];
+    char last[256] = "";
+    uint list_next = NO_PC;
+    for (;;) {
+        printf("(escr1dbg) ");
+        fflush(stdout);
+        if (fgets(line, sizeof(line), stdin) == NULL) break;
+
+        // An empty line repeats a step or list, like gdb.
+        bool repeat = strspn(line, " \t\r\n") == strlen(line);
+        if (repeat) {
+            if (last[0] == 0) continue;
+            strcpy(line, last);
+        }
+        else if (repeats(line)) {
+            strcpy(last, line);
+        }
+        else {
+            last[0] = 0;
+        }
+        if (!run_command(d, line, &list_next, repeat)) break;
+    }
+}
+
+// MAIN
+
+void usage(const char * argv0) {
+    fprintf(stderr, "escr1dbg %s\n", version);
+    fprintf(stderr, "USAGE:  %s SCRIPT [options]\n\n", argv0);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "--help    | -h        Show this listing and exit.\n");
+    fprintf(stderr, "--profile P           User opcode profile: sensuibu (the default), or a profile file.\n");
+    fprintf(stderr, "--fileline low:N|high:N\n");
+    fprintf(stderr, "                      How fileline params hold a file number: in their low or\n");
+    fprintf(stderr, "                      high N bits.  By default they are all line number.\n");
+}
+
+int main(int argc, char ** argv) {
+    const char * filename = NULL;
+    const char * profile_arg = "sensuibu";
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--profile") && i + 1 < argc) {
+            profile_arg = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--fileline") && i + 1 < argc) {
+            const char * arg = argv[++i];
+            if (!escr1_parse_fileline_format(arg, &fileline_format)) {
+                fprintf(stderr, "Bad --fileline [%s], expected low:N or high:N with N up to 32\n", arg);
+                exit(1);
+            }
+        }
+        else if (argv[i][0] == '-' || filename) {
+            usage(argv[0]);
+            exit(!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h") ? 0 : 1);
+        }
+        else {
+            filename = argv[i];
+        }
+    }
+    if (filename == NULL) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    mapped_file map;
+    script_file script;
+    escr1_status status = escr1_open_path(filename, &map, &script);
+    if (status != ESCR1_OK) {
+        fprintf(stderr, "%s: [%s]\n", escr1_status_string(status), filename);
+        exit(1);
+    }
+
+    static escr1_profile profile;
+    status = escr1_select_profile(profile_arg, &profile);
+    if (status != ESCR1_OK) {
+        fprintf(stderr, "%s: [%s]", escr1_status_string(status), profile_arg);
+        if (profile.error_line) fprintf(stderr, " line %u", profile.error_line);
+        fprintf(stderr, "\n");
+        exit(1);
+    }
+    static escr1_opset opset;
+    escr1_opset_init(&opset, profile.ops, profile.count);
+
+    static debugger d;
+    if (!escr1_vm_load(&d.vm, &script, &opset)) {
+        fprintf(stderr, "Warning: [%s] ends in a truncated instruction\n", filename);
+    }
+    d.vm.tool = &d;
+    d.vm.user_fn = print_calls;
+    d.vm.user = &d;
+    d.resume_pc = NO_PC;
+    d.show_calls = false;
+    d.reason[0] = 0;
+    update_patches(&d);
+    signal(SIGINT, on_sigint);
+
+    printf("%s: %u instructions, %u strings\n", filename, d.vm.count, script.index_count);
+    print_where(&d);
+    repl(&d);
+
+    escr1_unmap_file(&map);
+    return 0;
+}
@@ -1,511 +1,4372 @@
+// 64-bit off_t, for fseeko on 32-bit targets.
+#define _FILE_OFFSET_BITS 64
+
 #include <cstdlib>
 #include <cstdio>
 #include <cstdint>
 #include <cstring>
+#include <cstddef>
+#include <cstdarg>
 #include <cassert>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <unordered_map>
+#include <string>
+
+#include "libescr1.h"
+#include "sjis_table.h"
 
-typedef unsigned char uchar;
-typedef uint32_t uint;
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <sys/stat.h>
+#endif
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
-//  FORMAT NOTES:
+// Compile with:
+// $ g++ ./escr1extract.cpp ./libescr1.cpp -o escr1extract.exe -std=c++0x -pthread
 //
-// File magic is 'ESCR1_00' (0x45 0x53 0x43 0x52 0x31 0x5f 0x30 0x30).
+// Decoding and string handling live in libescr1 (see libescr1.h); this file is the
+// command line tool and the corpus-level passes built on top of it.
+
+bool show_strings = false;
+bool htoz = false;
+bool json = false;
+bool show_labels = false;
+uint jobs = 0;
+static const uint max_jobs = 256;
+opcode * opcode_list = NULL;
+uint opcode_count;
+
+const char * missing_string = "STRING_DATA_NOT_FOUND";
+
+// Set while a thread is one of several running items side by side, so the work inside
+// an item doesn't start another jobs-sized pool on top of the one it's already in.
+thread_local bool in_worker = false;
+
+// Runs fn(i, worker) for i in [0, count) on up to `threads` threads, the calling thread
+// included.  Items are handed out one at a time, so uneven item costs balance out.
+// `worker` is in [0, threads), for indexing per-thread state.
+template <class F>
+void parallel_for(uint count, uint threads, F fn) {
+    if (threads > count) threads = count;
+    if (threads == 0) threads = 1;
+
+    std::atomic<uint> next(0);
+    auto worker = [&](uint w) {
+        bool was_worker = in_worker;
+        in_worker = was_worker || threads > 1;
+        for (;;) {
+            uint i = next++;
+            if (i >= count) break;
+            fn(i, w);
+        }
+        in_worker = was_worker;
+    };
+
+    std::vector<std::thread> pool;
+    for (uint t = 1; t < threads; ++t) {
+        pool.push_back(std::thread(worker, t));
+    }
+    worker(0);
+    for (uint t = 0; t < pool.size(); ++t) {
+        pool[t].join();
+    }
+}
+
+// Bounded multi-producer multi-consumer queue (D. Vyukov's design).  Each cell carries a
+// sequence number saying whose turn it is, so producers and consumers only contend on
+// their own end's counter.  Capacity must be a power of two.
+template <class T>
+struct mpmc_queue {
+    struct cell {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    cell * cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+};
+
+template <class T>
+void queue_init(mpmc_queue<T> * q, size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+    q->cells = new typename mpmc_queue<T>::cell[size];
+    for (size_t i = 0; i < size; ++i) {
+        q->cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+    q->mask = size - 1;
+    q->head.store(0, std::memory_order_relaxed);
+    q->tail.store(0, std::memory_order_relaxed);
+}
+
+template <class T>
+void queue_free(mpmc_queue<T> * q) {
+    delete[] q->cells;
+    q->cells = NULL;
+}
+
+template <class T>
+bool queue_try_push(mpmc_queue<T> * q, T value) {
+    typename mpmc_queue<T>::cell * c;
+    size_t pos = q->tail.load(std::memory_order_relaxed);
+    for (;;) {
+        c = &q->cells[pos & q->mask];
+        size_t seq = c->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (q->tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        }
+        else if (diff < 0) {
+            return false;   // Full.
+        }
+        else {
+            pos = q->tail.load(std::memory_order_relaxed);
+        }
+    }
+    c->value = value;
+    c->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+template <class T>
+bool queue_try_pop(mpmc_queue<T> * q, T * out) {
+    typename mpmc_queue<T>::cell * c;
+    size_t pos = q->head.load(std::memory_order_relaxed);
+    for (;;) {
+        c = &q->cells[pos & q->mask];
+        size_t seq = c->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (q->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        }
+        else if (diff < 0) {
+            return false;   // Empty.
+        }
+        else {
+            pos = q->head.load(std::memory_order_relaxed);
+        }
+    }
+    *out = c->value;
+    c->seq.store(pos + q->mask + 1, std::memory_order_release);
+    return true;
+}
+
+// Waiting threads spin briefly, then yield, then sleep, so an idle thread doesn't steal a
+// core from a busy one.
+static void pipeline_backoff(uint * spins) {
+    uint n = (*spins)++;
+    if (n < 16) {
+        return;
+    }
+    else if (n < 64) {
+        std::this_thread::yield();
+    }
+    else {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+}
+
+template <class T>
+void queue_push(mpmc_queue<T> * q, T value) {
+    uint spins = 0;
+    while (!queue_try_push(q, value)) pipeline_backoff(&spins);
+}
+
+template <class T>
+T queue_pop(mpmc_queue<T> * q) {
+    T value;
+    uint spins = 0;
+    while (!queue_try_pop(q, &value)) pipeline_backoff(&spins);
+    return value;
+}
+
+// PERFORMANCE COUNTERS
 //
-// Multibyte integers are stored in little endian order.
+// --perf prints where a run spent its time.  Phases are timed with the TSC where there
+// is one (a few cycles per read) and steady_clock otherwise; ticks are converted to
+// seconds once, at exit, against steady_clock.  Phase times are summed over worker
+// threads, so in batch modes they can add up to more than the wall time.
 //
-// Files are split into three sections:
-// - An index table
-//   - Offsets into data section to the start of string literals.
-// - Bytecode
-// - Data (null-terminated Shift-JIS(?) encoded strings).
+// Timing is per file or per string, never per instruction, so it stays well under a
+// percent of the run.  With --perf off each probe is a single untaken branch; building
+// with -DESCR1_NO_PERF removes the probes entirely.
 
-// Compile with:
-// $ g++ ./escr1extract.cpp -o escr1extract.exe -std=c++0x
+enum perf_phase {
+    PERF_READ = 0,      // load_file
+    PERF_CACHE,         // Hashing inputs and reading/writing --cache entries
+    PERF_DECODE,        // Header parsing, profile detection and decoding
+    PERF_ANALYZE,       // Xref and stats passes
+    PERF_CONVERT,       // Half-width conversion (--convert)
+    PERF_FORMAT,        // Building the listing.  Includes stdio writes for text output.
+    PERF_WRITE,         // Writing JSON, dump and xref output
+    PERF_COMPRESS,      // Compressing the listing (--compress), on the compression threads
+    PERF_PHASE_COUNT
+};
+
+enum perf_counter {
+    PERF_BYTES_READ = 0,
+    PERF_INSTRUCTIONS,
+    PERF_STRINGS_CONVERTED,
+    PERF_BYTES_WRITTEN,
+    PERF_COUNTER_COUNT
+};
+
+const char * const perf_phase_names[PERF_PHASE_COUNT] = {
+    "read", "cache", "decode", "analyze", "convert", "format", "write", "compress",
+};
+
+const char * const perf_counter_names[PERF_COUNTER_COUNT] = {
+    "bytes_read", "instructions", "strings_converted", "bytes_written",
+};
+
+#ifdef ESCR1_NO_PERF
+static const bool perf_enabled = false;
+#else
+bool perf_enabled = false;
+#endif
+
+std::atomic<uint64_t> perf_ticks[PERF_PHASE_COUNT];
+std::atomic<uint64_t> perf_calls[PERF_PHASE_COUNT];
+std::atomic<uint64_t> perf_counters[PERF_COUNTER_COUNT];
+uint64_t perf_start_ticks;
+std::chrono::steady_clock::time_point perf_start_time;
+
+static inline uint64_t perf_now() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+static inline void perf_count(perf_counter c, uint64_t n) {
+    if (perf_enabled) {
+        perf_counters[c].fetch_add(n, std::memory_order_relaxed);
+    }
+}
+
+// Times the enclosing block as one call of `phase`.  Scopes nest: time spent in an inner
+// scope is charged to the inner phase only, so phases never count the same tick twice.
+struct perf_scope;
+static thread_local perf_scope * perf_current = NULL;
+
+struct perf_scope {
+    perf_phase phase;
+    uint64_t start;
+    uint64_t nested;
+    perf_scope * parent;
+
+    explicit perf_scope(perf_phase p) : phase(p), start(0), nested(0), parent(NULL) {
+        if (perf_enabled) {
+            parent = perf_current;
+            perf_current = this;
+            start = perf_now();
+        }
+    }
+    ~perf_scope() {
+        if (perf_enabled) {
+            uint64_t elapsed = perf_now() - start;
+            perf_ticks[phase].fetch_add(elapsed - nested, std::memory_order_relaxed);
+            perf_calls[phase].fetch_add(1, std::memory_order_relaxed);
+            if (parent) parent->nested += elapsed;
+            perf_current = parent;
+        }
+    }
+};
+
+// Wall time, and the TSC calibration, run from the last call.
+void perf_start() {
+    perf_start_time = std::chrono::steady_clock::now();
+    perf_start_ticks = perf_now();
+}
+
+// Printed to stderr, so it never mixes with the listing.  One JSON line with --json.
+void perf_report() {
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - perf_start_time).count();
+    uint64_t ticks = perf_now() - perf_start_ticks;
+    double seconds_per_tick = ticks ? wall / ticks : 0;
+
+    if (json) {
+        fprintf(stderr, "{\"wall_seconds\":%.6f", wall);
+        for (uint p = 0; p < PERF_PHASE_COUNT; ++p) {
+            fprintf(stderr, ",\"%s\":{\"calls\":%llu,\"seconds\":%.6f}", perf_phase_names[p],
+                    (unsigned long long)perf_calls[p].load(), perf_ticks[p].load() * seconds_per_tick);
+        }
+        for (uint c = 0; c < PERF_COUNTER_COUNT; ++c) {
+            fprintf(stderr, ",\"%s\":%llu", perf_counter_names[c], (unsigned long long)perf_counters[c].load());
+        }
+        fprintf(stderr, "}\n");
+        return;
+    }
+
+    fprintf(stderr, "\n%-20s %12s %12s %8s\n", "phase", "calls", "seconds", "% wall");
+    for (uint p = 0; p < PERF_PHASE_COUNT; ++p) {
+        double s = perf_ticks[p].load() * seconds_per_tick;
+        fprintf(stderr, "%-20s %12llu %12.6f %7.1f%%\n", perf_phase_names[p],
+                (unsigned long long)perf_calls[p].load(), s, wall > 0 ? 100 * s / wall : 0);
+    }
+    fprintf(stderr, "%-20s %12s %12.6f\n\n", "wall", "", wall);
+    for (uint c = 0; c < PERF_COUNTER_COUNT; ++c) {
+        fprintf(stderr, "%-20s %12llu\n", perf_counter_names[c], (unsigned long long)perf_counters[c].load());
+    }
+}
+
+// ARENAS
+//
+// Everything a script needs while it's being processed -- its contents, its opcode
+// table and its converted strings -- comes out of one arena, a bump allocator over a
+// list of chunks, and is released together by a single arena_reset.  Reset chunks go
+// back to a shared pool, so in batch mode the next script reuses them and a script's
+// whole lifetime costs a handful of allocations at most.
+//
+// An arena belongs to one thread at a time.  Only the pool is shared.
+
+static const size_t arena_chunk_size = 1 << 20;
+static const size_t arena_pool_max = 256 << 20;    // Bytes kept in the pool at most
+
+struct arena_chunk {
+    arena_chunk * next;
+    size_t size;        // Usable bytes after the header
+    size_t used;
+};
+
+struct arena {
+    arena_chunk * chunks;   // Current chunk first
+};
+
+std::mutex arena_pool_lock;
+arena_chunk * arena_pool = NULL;
+size_t arena_pool_bytes = 0;
+
+static inline uchar * arena_chunk_data(arena_chunk * c) {
+    return (uchar *)(c + 1);
+}
+
+void arena_init(arena * a) {
+    a->chunks = NULL;
+}
+
+static arena_chunk * arena_new_chunk(size_t min_size) {
+    {
+        std::lock_guard<std::mutex> guard(arena_pool_lock);
+        for (arena_chunk ** p = &arena_pool; *p; p = &(*p)->next) {
+            if ((*p)->size >= min_size) {
+                arena_chunk * c = *p;
+                *p = c->next;
+                arena_pool_bytes -= c->size;
+                c->used = 0;
+                return c;
+            }
+        }
+    }
+
+    size_t size = std::max(min_size, arena_chunk_size);
+    arena_chunk * c = (arena_chunk *)malloc(sizeof(arena_chunk) + size);
+    if (c == NULL) {
+        fprintf(stderr, "Out of memory (%llu bytes)\n", (unsigned long long)size);
+        exit(1);
+    }
+    c->size = size;
+    c->used = 0;
+    return c;
+}
+
+// 16-byte aligned.  Never returns NULL.
+void * arena_alloc(arena * a, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    arena_chunk * c = a->chunks;
+    if (c == NULL || c->size - c->used < size) {
+        c = arena_new_chunk(size);
+        c->next = a->chunks;
+        a->chunks = c;
+    }
+    void * p = arena_chunk_data(c) + c->used;
+    c->used += size;
+    return p;
+}
+
+// Releases everything allocated from a.  Chunks go back to the pool while it has room.
+void arena_reset(arena * a) {
+    arena_chunk * c = a->chunks;
+    a->chunks = NULL;
+    while (c) {
+        arena_chunk * next = c->next;
+        std::unique_lock<std::mutex> guard(arena_pool_lock);
+        if (arena_pool_bytes + c->size <= arena_pool_max) {
+            c->next = arena_pool;
+            arena_pool = c;
+            arena_pool_bytes += c->size;
+        }
+        else {
+            guard.unlock();
+            free(c);
+        }
+        c = next;
+    }
+}
+
+bool data_lookup_string(script_file * file, uint id, char ** out) {
+    if (id >= file->index_count) {
+        fprintf(stderr, "Reference to string not in file, id: %08x\n", id);
+        *out = (char *)missing_string;
+        return false;
+    }
+
+    const char * str;
+    if (escr1_lookup_string(file, id, &str)) {
+        *out = (char *)str;
+        return true;
+    }
+    else {
+        *out = (char *)missing_string;
+        return false;
+    }
+}
+
+// The converted string is allocated from mem and lives until it's reset.
+void convert_string_htoz(char ** str, arena * mem) {
+    perf_scope timer(PERF_CONVERT);
+    perf_count(PERF_STRINGS_CONVERTED, 1);
+    // Every byte converts to at most two, so this can't truncate.
+    uint size = 2 * strlen(*str) + 1;
+    char * newstr = (char *)arena_alloc(mem, size);
+    escr1_convert_htoz((uchar *)(*str), (uchar *)newstr, size);
+    *str = newstr;
+}
+
+// OPCODE PROFILES
+//
+// Each title defines its own user opcodes.  A profile is one title's user opcode table,
+// compiled into a 256-entry escr1_opset when it's loaded, so switching titles costs
+// nothing per instruction.  SENSUIBU is built in; others are loaded from text files with
+// escr1_load_profile (see libescr1.h for the format).
+
+struct opcode_profile {
+    const char * name;
+    escr1_opset opset;
+};
+
+std::vector<opcode_profile *> profiles;
+
+opcode_profile * add_profile(const char * name, const usr_op * ops, uint count) {
+    opcode_profile * profile = (opcode_profile *)calloc(1, sizeof(opcode_profile));
+    profile->name = name;
+    escr1_opset_init(&profile->opset, ops, count);
+    profiles.push_back(profile);
+    return profile;
+}
+
+void init_builtin_profiles() {
+    add_profile("sensuibu", SENSUIBU_OPS, SENSUIBU_OP_COUNT);
+}
+
+opcode_profile * find_profile(const char * name) {
+    for (uint i = 0; i < profiles.size(); ++i) {
+        if (!strcmp(profiles[i]->name, name)) {
+            return profiles[i];
+        }
+    }
+    return NULL;
+}
+
+// Profiles live until exit, so tables loaded here are never freed.
+opcode_profile * load_profile(const char * filename) {
+    escr1_profile * loaded = (escr1_profile *)calloc(1, sizeof(escr1_profile));
+    escr1_status status = escr1_load_profile(filename, loaded);
+    if (status == ESCR1_ERR_OPEN) {
+        fprintf(stderr, "Failed to open file: [%s]\n", filename);
+        exit(1);
+    }
+    else if (status != ESCR1_OK && loaded->count == ESCR1_MAX_USR_OPS) {
+        fprintf(stderr, "Too many opcodes in profile [%s], max is %u\n", filename, ESCR1_MAX_USR_OPS);
+        exit(1);
+    }
+    else if (status != ESCR1_OK) {
+        fprintf(stderr, "Bad line in profile [%s:%u]\n", filename, loaded->error_line);
+        exit(1);
+    }
+    return add_profile(loaded->title[0] ? loaded->title : filename, loaded->ops, loaded->count);
+}
+
+// A built-in profile name, or the path of a profile file.
+opcode_profile * select_profile(const char * arg) {
+    opcode_profile * profile = find_profile(arg);
+    if (profile == NULL) {
+        profile = load_profile(arg);
+    }
+    return profile;
+}
+
+// PROFILE DETECTION
+//
+// `--profile auto` decodes each input under every known profile and keeps the one that
+// decodes best.  A wrong user opcode table shows up quickly: a misjudged param shifts
+// every following instruction boundary, which produces undefined ops, branches into the
+// middle of instructions, string ids past the index table, and usually a decode that
+// doesn't end exactly at code_size.
+//
+// Each profile scores the fraction of instructions with none of those problems, or 0 if
+// the decode doesn't land on code_size.  Ties go to the profile registered first.
+
+struct profile_scorer : escr1_visitor<profile_scorer> {
+    const escr1_opset * opset;
+    uint index_count;
+    uint count;
+    uint bad;
+    bool truncated;
+    std::vector<uchar> starts;      // Bitset of instruction start offsets.
+    std::vector<uint> targets;
+
+    void on_op(const opcode & op) {
+        count++;
+        starts[op.offset >> 3] |= 1 << (op.offset & 7);
+    }
+
+    void on_user(const opcode & op) {
+        if (!opset->defined[op.op]) bad++;
+    }
+
+    void on_str(const opcode & op) {
+        if (op.param >= index_count) bad++;
+    }
+
+    void on_jump(const opcode & op) { targets.push_back(op.param); }
+    void on_jumpz(const opcode & op) { targets.push_back(op.param); }
+    void on_call(const opcode & op) { targets.push_back(op.param); }
+
+    void on_truncated(uint) { truncated = true; }
+};
+
+double score_profile(script_file * script, const escr1_opset * opset) {
+    uint code_size = script->code_size;
+
+    profile_scorer scorer;
+    scorer.opset = opset;
+    scorer.index_count = script->index_count;
+    scorer.count = 0;
+    scorer.bad = 0;
+    scorer.truncated = false;
+    scorer.starts.assign(code_size / 8 + 1, 0);
+    escr1_visit(script, opset, scorer);
+
+    if (scorer.truncated || scorer.count == 0) {
+        return 0.0;
+    }
+
+    for (uint i = 0; i < scorer.targets.size(); ++i) {
+        uint t = scorer.targets[i];
+        // A branch to code_size itself (falling off the end) is fine.
+        if (t > code_size || (t < code_size && !(scorer.starts[t >> 3] & (1 << (t & 7))))) {
+            scorer.bad++;
+        }
+    }
+
+    return 1.0 - (double)std::min(scorer.bad, scorer.count) / scorer.count;
+}
+
+const opcode_profile * detect_profile(script_file * script, double * best_score) {
+    const opcode_profile * best = profiles[0];
+    *best_score = -1.0;
+    for (uint i = 0; i < profiles.size(); ++i) {
+        double score = score_profile(script, &profiles[i]->opset);
+        if (score > *best_score) {
+            *best_score = score;
+            best = profiles[i];
+        }
+    }
+    return best;
+}
+
+// COMPRESSED OUTPUT
+//
+// With --compress the listing is compressed on its way to stdout, so a corpus listing
+// can be archived without writing it out uncompressed first.  The stream is cut into
+// 4MB blocks which are compressed independently on --jobs threads, while decoding and
+// formatting carry on, and written out in order.  A few blocks per thread can be in
+// flight; past that the writer waits for the oldest one.
+//
+// - lz4: one LZ4 frame with independent blocks, readable by `lz4 -d`.  The encoder is
+//   built in: greedy, one hash probe per position, which is roughly lz4's fastest level.
+// - zstd[:LEVEL]: each block is a zstd frame of its own, and the frames concatenate into
+//   one stream for `zstd -d`.  Needs libzstd: build with -DESCR1_HAVE_ZSTD and -lzstd.
+//
+// Every block starts from a clean state, so the output doesn't depend on --jobs.
+
+#ifdef ESCR1_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+enum output_codec {
+    CODEC_NONE = 0,
+    CODEC_LZ4,
+    CODEC_ZSTD,
+};
 
-const uchar magic[9] = "ESCR1_00";
+output_codec compress_codec = CODEC_NONE;
+int compress_level = 3;
 
-struct script_file {
-    uchar * contents;   // Raw contents of file.  All other pointers point into this buffer.
-    uint file_size;     // Size of entire file.
-    uint * index_ptr;   // Pointer to indices
-    uint index_count;   // Number of indices
-    uchar * code_ptr;   // Pointer to bytecode
-    uint code_size;     // Size of code block
-    uchar * data_ptr;   // Pointer to data
-    uint data_size;     // Size of data block
+static const uint COMPRESS_BLOCK_SIZE = 4 << 20;
+
+struct compress_block {
+    std::vector<char> in;
+    std::vector<char> out;      // Ready to write, block header included.
+    std::atomic<bool> done;
+};
+
+struct output_stream {
+    FILE * fp;
+    output_codec codec;
+    int level;
+    compress_block * blocks;    // Block n is blocks[n % window].
+    uint window;
+    uint64_t submitted;         // Blocks handed to the compression threads.
+    uint64_t written;
+    mpmc_queue<compress_block *> work;
+    std::vector<std::thread> threads;
 };
 
-// BYTECODE NOTES:
+static const uint LZ4_HASH_LOG = 16;
+static const uint LZ4_MIN_MATCH = 4;
+static const uint LZ4_LAST_LITERALS = 5;    // A block always ends in 5 literals,
+static const uint LZ4_MF_LIMIT = 12;        // and its last match starts 12 bytes before the end.
+
+static inline uint lz4_read32(const uchar * p) {
+    uint v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline void lz4_write32(char * p, uint v) {
+    p[0] = (char)v;
+    p[1] = (char)(v >> 8);
+    p[2] = (char)(v >> 16);
+    p[3] = (char)(v >> 24);
+}
+
+static inline uint lz4_hash(uint v) {
+    return (v * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+// Length bytes following a token nibble of 15.
+static uchar * lz4_length(uchar * op, uint n) {
+    for (n -= 15; n >= 255; n -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (uchar)n;
+    return op;
+}
+
+// LZ4 block format.  dst needs n + n / 255 + 16 bytes; table, 1 << LZ4_HASH_LOG entries.
+static uint lz4_compress_block(const uchar * src, uint n, uchar * dst, uint * table) {
+    memset(table, 0, sizeof(uint) << LZ4_HASH_LOG);
+    uchar * op = dst;
+    uint anchor = 0;
+
+    if (n > LZ4_MF_LIMIT) {
+        uint limit = n - LZ4_MF_LIMIT;
+        uint match_end = n - LZ4_LAST_LITERALS;
+        uint ip = 0;
+        while (ip < limit) {
+            uint seq = lz4_read32(src + ip);
+            uint h = lz4_hash(seq);
+            uint cand = table[h];
+            table[h] = ip;
+            if (cand >= ip || ip - cand > 65535 || lz4_read32(src + cand) != seq) {
+                // Step faster through data that isn't matching, as lz4 does.
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            while (ip > anchor && cand > 0 && src[ip - 1] == src[cand - 1]) {
+                ip--;
+                cand--;
+            }
+            // A word at a time up to the first differing word, then bytewise.
+            uint len = LZ4_MIN_MATCH;
+            while (ip + len + 8 <= match_end) {
+                uint64_t a, b;
+                memcpy(&a, src + ip + len, 8);
+                memcpy(&b, src + cand + len, 8);
+                if (a != b) break;
+                len += 8;
+            }
+            while (ip + len < match_end && src[ip + len] == src[cand + len]) {
+                len++;
+            }
+
+            uint lit = ip - anchor;
+            uint ml = len - LZ4_MIN_MATCH;
+            uchar * token = op++;
+            if (lit >= 15) op = lz4_length(op, lit);
+            memcpy(op, src + anchor, lit);
+            op += lit;
+            *op++ = (uchar)(ip - cand);
+            *op++ = (uchar)((ip - cand) >> 8);
+            if (ml >= 15) op = lz4_length(op, ml);
+            *token = (uchar)((std::min(lit, 15u) << 4) | std::min(ml, 15u));
+
+            ip += len;
+            anchor = ip;
+        }
+    }
+
+    uint lit = n - anchor;
+    *op++ = (uchar)(std::min(lit, 15u) << 4);
+    if (lit >= 15) op = lz4_length(op, lit);
+    memcpy(op, src + anchor, lit);
+    op += lit;
+    return (uint)(op - dst);
+}
+
+// XXH32 with seed 0, for inputs under 16 bytes: only the frame header checksum needs it.
+static uint xxh32_short(const uchar * p, uint len) {
+    const uint P1 = 2654435761u, P2 = 2246822519u, P3 = 3266489917u, P4 = 668265263u, P5 = 374761393u;
+    uint h = P5 + len;
+    for (; len >= 4; p += 4, len -= 4) {
+        h += lz4_read32(p) * P3;
+        h = ((h << 17) | (h >> 15)) * P4;
+    }
+    for (; len; p++, len--) {
+        h += *p * P5;
+        h = ((h << 11) | (h >> 21)) * P1;
+    }
+    h ^= h >> 15;
+    h *= P2;
+    h ^= h >> 13;
+    h *= P3;
+    h ^= h >> 16;
+    return h;
+}
+
+static void compress_one(output_stream * s, compress_block * b, uint * table, void * cctx) {
+    uint n = (uint)b->in.size();
+    if (s->codec == CODEC_LZ4) {
+        b->out.resize(4 + n + n / 255 + 16);
+        uint size = lz4_compress_block((const uchar *)&b->in[0], n, (uchar *)&b->out[4], table);
+        if (size >= n) {
+            // Stored, with the high bit of the size set.
+            memcpy(&b->out[4], &b->in[0], n);
+            size = n | 0x80000000u;
+        }
+        lz4_write32(&b->out[0], size);
+        b->out.resize(4 + (size & 0x7fffffffu));
+    }
+#ifdef ESCR1_HAVE_ZSTD
+    else {
+        b->out.resize(ZSTD_compressBound(n));
+        size_t size = ZSTD_compressCCtx((ZSTD_CCtx *)cctx, &b->out[0], b->out.size(), &b->in[0], n, s->level);
+        if (ZSTD_isError(size)) {
+            fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(size));
+            exit(1);
+        }
+        b->out.resize(size);
+    }
+#else
+    (void)cctx;
+#endif
+}
+
+static void compress_thread(output_stream * s) {
+    std::vector<uint> table(s->codec == CODEC_LZ4 ? 1u << LZ4_HASH_LOG : 0u);
+    void * cctx = NULL;
+#ifdef ESCR1_HAVE_ZSTD
+    if (s->codec == CODEC_ZSTD) cctx = ZSTD_createCCtx();
+#endif
+    for (;;) {
+        compress_block * b = queue_pop(&s->work);
+        if (b == NULL) break;
+        {
+            perf_scope timer(PERF_COMPRESS);
+            compress_one(s, b, table.empty() ? NULL : &table[0], cctx);
+        }
+        b->done.store(true, std::memory_order_release);
+    }
+#ifdef ESCR1_HAVE_ZSTD
+    ZSTD_freeCCtx((ZSTD_CCtx *)cctx);
+#endif
+}
+
+static void output_raw(output_stream * s, const void * data, size_t n) {
+    perf_scope timer(PERF_WRITE);
+    perf_count(PERF_BYTES_WRITTEN, n);
+    fwrite(data, 1, n, s->fp);
+}
+
+void output_open(output_stream * s, FILE * fp, output_codec codec, int level, uint threads) {
+    s->fp = fp;
+    s->codec = codec;
+    s->level = level;
+    s->blocks = NULL;
+    s->window = 0;
+    s->submitted = 0;
+    s->written = 0;
+    if (codec == CODEC_NONE) {
+        return;
+    }
+
+    threads = std::max(1u, threads);
+    s->window = 2 * threads + 1;
+    s->blocks = new compress_block[s->window];
+    for (uint i = 0; i < s->window; ++i) {
+        s->blocks[i].done.store(false, std::memory_order_relaxed);
+    }
+    queue_init(&s->work, s->window + threads);
+    for (uint t = 0; t < threads; ++t) {
+        s->threads.push_back(std::thread(compress_thread, s));
+    }
+
+    if (codec == CODEC_LZ4) {
+        // Frame descriptor: version 1, independent blocks, no checksums; 4MB blocks.
+        uchar header[7] = { 0x04, 0x22, 0x4d, 0x18, 0x60, 0x70, 0 };
+        header[6] = (uchar)(xxh32_short(header + 4, 2) >> 8);
+        output_raw(s, header, sizeof(header));
+    }
+}
+
+// Writes blocks out in order until at most max_pending are left in flight; past that,
+// only blocks that are already done.
+static void output_drain(output_stream * s, uint64_t max_pending) {
+    while (s->written < s->submitted) {
+        compress_block * b = &s->blocks[s->written % s->window];
+        if (s->submitted - s->written <= max_pending && !b->done.load(std::memory_order_acquire)) {
+            break;
+        }
+        uint spins = 0;
+        while (!b->done.load(std::memory_order_acquire)) pipeline_backoff(&spins);
+        output_raw(s, &b->out[0], b->out.size());
+        b->in.clear();
+        b->out.clear();
+        b->done.store(false, std::memory_order_relaxed);
+        s->written++;
+    }
+}
+
+static void output_submit(output_stream * s) {
+    queue_push(&s->work, &s->blocks[s->submitted % s->window]);
+    s->submitted++;
+    // Frees the slot of the next block to fill.
+    output_drain(s, s->window - 1);
+}
+
+void output_write(output_stream * s, const void * data, size_t n) {
+    if (s->codec == CODEC_NONE) {
+        output_raw(s, data, n);
+        return;
+    }
+    const char * p = (const char *)data;
+    while (n) {
+        compress_block * b = &s->blocks[s->submitted % s->window];
+        size_t take = std::min(n, (size_t)COMPRESS_BLOCK_SIZE - b->in.size());
+        b->in.insert(b->in.end(), p, p + take);
+        p += take;
+        n -= take;
+        if (b->in.size() == COMPRESS_BLOCK_SIZE) {
+            output_submit(s);
+        }
+    }
+}
+
+// Compresses and writes whatever is left, and ends the stream.
+void output_close(output_stream * s) {
+    if (s->codec != CODEC_NONE) {
+        if (!s->blocks[s->submitted % s->window].in.empty()) {
+            output_submit(s);
+        }
+        output_drain(s, 0);
+        for (uint t = 0; t < s->threads.size(); ++t) {
+            queue_push(&s->work, (compress_block *)NULL);
+        }
+        for (uint t = 0; t < s->threads.size(); ++t) {
+            s->threads[t].join();
+        }
+        s->threads.clear();
+        queue_free(&s->work);
+        delete[] s->blocks;
+        s->blocks = NULL;
+
+        if (s->codec == CODEC_LZ4) {
+            char end_mark[4] = { 0, 0, 0, 0 };
+            output_raw(s, end_mark, sizeof(end_mark));
+        }
+    }
+    fflush(s->fp);
+}
+
+// LISTING OUTPUT
+//
+// Both listing formats are built in a listing_writer: a fixed buffer which, when full,
+// is flushed either to the output stream or, for listings formatted off the main thread, appended
+// to a memory buffer for the ordered writer to pick up.  The listing pipeline instead
+// hands each full buffer over whole and gets an empty one back, so nothing is copied.
+
+static const uint WRITER_BUF = 1 << 16;
+
+struct listing_writer {
+    output_stream * out;        // Flush target, or NULL to append to mem, or with neither,
+    std::vector<char> * mem;    // to pass buf to hand_off, which points it at a new one.
+    void (*hand_off)(listing_writer * w);
+    void * owner;               // For hand_off.
+    arena * scratch;            // The current script's arena, for converted strings.
+    uint len;
+    char * buf;                 // WRITER_BUF bytes; storage unless hand_off has replaced it.
+    char storage[WRITER_BUF];
+};
+
+void writer_init(listing_writer * w, output_stream * out, std::vector<char> * mem) {
+    w->out = out;
+    w->mem = mem;
+    w->hand_off = NULL;
+    w->owner = NULL;
+    w->scratch = NULL;
+    w->len = 0;
+    w->buf = w->storage;
+}
+
+static void writer_flush(listing_writer * w) {
+    if (w->out) {
+        output_write(w->out, w->buf, w->len);
+    }
+    else if (w->mem) {
+        w->mem->insert(w->mem->end(), w->buf, w->buf + w->len);
+    }
+    else if (w->len) {
+        w->hand_off(w);
+    }
+    w->len = 0;
+}
+
+static inline void writer_reserve(listing_writer * w, uint n) {
+    if (w->len + n > WRITER_BUF) {
+        writer_flush(w);
+    }
+}
+
+static inline void writer_raw(listing_writer * w, const char * s, uint n) {
+    if (n > WRITER_BUF) {
+        // Only very long strings; bypass the buffer.
+        writer_flush(w);
+        if (w->out) {
+            output_write(w->out, s, n);
+        }
+        else if (w->mem) {
+            w->mem->insert(w->mem->end(), s, s + n);
+        }
+        else {
+            for (uint part; n; s += part, n -= part) {
+                part = std::min(n, WRITER_BUF);
+                memcpy(w->buf, s, part);
+                w->len = part;
+                writer_flush(w);
+            }
+        }
+        return;
+    }
+    writer_reserve(w, n);
+    memcpy(w->buf + w->len, s, n);
+    w->len += n;
+}
+
+static void writer_printf(listing_writer * w, const char * fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    uint room = WRITER_BUF - w->len;
+    int n = vsnprintf(w->buf + w->len, room, fmt, args);
+    va_end(args);
+    if (n < 0) {
+        return;
+    }
+    if ((uint)n < room) {
+        w->len += n;
+        return;
+    }
+
+    // Didn't fit; format into a scratch buffer instead.
+    char * tmp = (char *)malloc(n + 1);
+    va_start(args, fmt);
+    vsnprintf(tmp, n + 1, fmt, args);
+    va_end(args);
+    writer_raw(w, tmp, n);
+    free(tmp);
+}
+
+// BRANCH LABELS
+//
+// With --labels the text listing names branch targets instead of leaving them as hex:
+// an offset that a ROP_CALL goes to gets a `sub_xxxxxxxx:` line before its instruction,
+// any other ROP_JUMP/ROP_JUMPZ target an `L_xxxxxxxx:` line, and the branches print
+// the name as their param.  Labels are only made where an instruction starts; a branch
+// to anywhere else keeps its hex param, so every name in the listing is defined.
+//
+// Targets are collected in one pass over the opcode table, into bitsets over the code
+// offsets, so the listing pays a couple of bit tests per instruction for them.
+
+struct branch_labels {
+    uint size;              // Bits per set: one past the last instruction's offset.
+    uint64_t * starts;      // Offsets where an instruction starts
+    uint64_t * jumps;
+    uint64_t * calls;
+};
+
+static inline bool is_branch_op(uint op) {
+    return op == ROP_JUMP || op == ROP_JUMPZ || op == ROP_CALL;
+}
+
+static inline bool label_bit(const uint64_t * set, uint offset) {
+    return (set[offset >> 6] >> (offset & 63)) & 1;
+}
+
+// "sub_" or "L_" if there's a label at offset, else NULL.
+static inline const char * label_prefix(const branch_labels * labels, uint offset) {
+    if (offset >= labels->size || !label_bit(labels->starts, offset)) return NULL;
+    if (label_bit(labels->calls, offset)) return "sub_";
+    if (label_bit(labels->jumps, offset)) return "L_";
+    return NULL;
+}
+
+// labels is NULL for plain hex branch params.
+void print_opcode(listing_writer * w, const escr1_opset * opset, script_file * file, opcode * op, const branch_labels * labels) {
+    if (labels) {
+        const char * label = label_prefix(labels, op->offset);
+        if (label) writer_printf(w, "%s%08x:\n", label, op->offset);
+    }
+
+    if (opset->has_param[op->op]) { 
+        const char * target = (labels && is_branch_op(op->op)) ? label_prefix(labels, op->param) : NULL;
+        if (target) {
+            writer_printf(w, "%08x:\t%-20s\t%s%08x\n", op->offset, opset->names[op->op], target, op->param);
+        }
+        else {
+            writer_printf(w, "%08x:\t%-20s\t%08x\n", op->offset, opset->names[op->op], op->param);
+        }
+
+        if (show_strings && op->op == ROP_STR) {
+            char * str = NULL;
+            if (data_lookup_string(file, op->param, &str)) {
+                if (htoz) convert_string_htoz(&str, w->scratch);
+                writer_printf(w, "\t\t%s\n\n", str);
+            }
+        }
+    }
+    else {
+        writer_printf(w, "%08x:\t%s\n", op->offset, opset->names[op->op]);
+    }
+} 
+
+// Decoded instructions, stored as parallel arrays so passes that only care about one
+// column (e.g. scanning ops) don't drag the others through the cache.
+struct opcode_table {
+    uint count;
+    uint capacity;
+    uint * offsets;
+    uint * params;
+    uchar * ops;
+};
+
+static void opcode_table_reserve(opcode_table * table, uint capacity) {
+    table->offsets = (uint *)realloc(table->offsets, capacity * sizeof(uint));
+    table->params = (uint *)realloc(table->params, capacity * sizeof(uint));
+    table->ops = (uchar *)realloc(table->ops, capacity);
+    table->capacity = capacity;
+}
+
+// For tables that will never grow: the arrays come out of mem and go away with it, so
+// capacity should be the exact instruction count (see count_opcodes).
+static void opcode_table_alloc(opcode_table * table, uint capacity, arena * mem) {
+    memset(table, 0, sizeof(opcode_table));
+    table->offsets = (uint *)arena_alloc(mem, capacity * sizeof(uint));
+    table->params = (uint *)arena_alloc(mem, capacity * sizeof(uint));
+    table->ops = (uchar *)arena_alloc(mem, capacity);
+    table->capacity = capacity;
+}
+
+void free_opcode_table(opcode_table * table) {
+    free(table->offsets);
+    free(table->params);
+    free(table->ops);
+    memset(table, 0, sizeof(opcode_table));
+}
+
+// Instructions in the code block, from a scan of the op bytes alone.  Much cheaper than
+// decoding, and lets the table be allocated at its exact size.
+static uint count_opcodes(const script_file * file, const escr1_opset * opset) {
+    const uchar * code = file->code_ptr;
+    uint size = file->code_size;
+    uint offset = 0;
+    uint count = 0;
+    while (offset < size) {
+        uint len = opset->has_param[code[offset]] ? 5 : 1;
+        if (len > size - offset) break;     // Truncated; the decoder drops it too.
+        offset += len;
+        count++;
+    }
+    return count;
+}
+
+struct table_builder : escr1_visitor<table_builder> {
+    opcode_table * table;
+    uint code_size;
+
+    void on_op(const opcode & op) {
+        assert(table->count < table->capacity);
+        table->offsets[table->count] = op.offset;
+        table->params[table->count] = op.param;
+        table->ops[table->count] = (uchar)op.op;
+        table->count++;
+    }
+
+    void on_truncated(uint offset) {
+        fprintf(stderr, "Unexpected end of code block.  Size: %d; Current Offset: %d\n", code_size, offset);
+    }
+};
+
+// PARALLEL DECODING
+//
+// Instruction boundaries depend on every byte before them, but the encoding resyncs
+// quickly: an instruction is 1 or 5 bytes, so a decode started at the wrong offset lands
+// back on a real boundary within a few instructions.  Big code blocks are split into
+// chunks that are decoded speculatively in parallel:
+//
+// - Each chunk is decoded once from its first byte (the base path), recording which
+//   offsets it visits.
+// - The true first boundary in a chunk is one of its first 5 bytes, so the other 4
+//   candidate starts are decoded too, but only until they land on an offset the base
+//   path visited; from there on they are the base path.
+// - Stitching then walks the chunks in order, picks the candidate matching where the
+//   previous chunk left off, and concatenates.
+//
+// The result is identical to decoding sequentially.
+
+static const uint parallel_decode_min = 4 << 20;
+
+struct chunk_path {
+    std::vector<opcode> prefix;     // Instructions before joining the base path.
+    uint join;                      // Index into base where the path joins it.
+    uint next;                      // First boundary at or past the chunk end.
+    bool truncated;                 // Last instruction's param ran past the code block.
+};
+
+struct decode_chunk {
+    uint begin;
+    uint end;
+    opcode_table base;
+    std::vector<uchar> visited;     // Base path starts, one bit per chunk byte.
+    chunk_path paths[5];            // By start offset - begin.
+};
+
+static bool chunk_visited(decode_chunk * c, uint offset) {
+    uint rel = offset - c->begin;
+    return offset < c->end && (c->visited[rel >> 3] & (1 << (rel & 7)));
+}
+
+static void decode_chunk_paths(script_file * file, const escr1_opset * opset, decode_chunk * c) {
+    escr1_iterator it;
+    escr1_iter_init(&it, file, opset);
+    opcode op;
+
+    // Base path.
+    memset(&c->base, 0, sizeof(opcode_table));
+    opcode_table_reserve(&c->base, (c->end - c->begin) / 3 + 16);
+    c->visited.assign((c->end - c->begin) / 8 + 1, 0);
+
+    chunk_path * base = &c->paths[0];
+    base->join = 0;
+    base->truncated = false;
+    it.offset = c->begin;
+    while (it.offset < c->end) {
+        if (!escr1_iter_next(&it, &op)) {
+            base->truncated = true;
+            break;
+        }
+        opcode_table * t = &c->base;
+        if (t->count == t->capacity) {
+            opcode_table_reserve(t, t->capacity * 2);
+        }
+        t->offsets[t->count] = op.offset;
+        t->params[t->count] = op.param;
+        t->ops[t->count] = (uchar)op.op;
+        t->count++;
+
+        uint rel = op.offset - c->begin;
+        c->visited[rel >> 3] |= 1 << (rel & 7);
+    }
+    base->next = it.offset;
+
+    // Other candidate starts, until they merge into the base path.
+    for (uint d = 1; d < 5; ++d) {
+        chunk_path * path = &c->paths[d];
+        path->truncated = false;
+        it.offset = c->begin + d;
+        while (it.offset < c->end && !chunk_visited(c, it.offset)) {
+            if (!escr1_iter_next(&it, &op)) {
+                path->truncated = true;
+                break;
+            }
+            path->prefix.push_back(op);
+        }
+
+        if (!path->truncated && it.offset < c->end) {
+            // Merged; everything from here on is the base path.
+            uint * found = std::lower_bound(c->base.offsets, c->base.offsets + c->base.count, it.offset);
+            path->join = found - c->base.offsets;
+            path->next = base->next;
+            path->truncated = base->truncated;
+        }
+        else {
+            path->join = c->base.count;
+            path->next = it.offset;
+        }
+    }
+}
+
+void decode_opcodes_parallel(script_file * file, const escr1_opset * opset, opcode_table * table, arena * mem) {
+    uint code_size = file->code_size;
+    uint chunk_count = jobs * 4;
+    uint chunk_size = code_size / chunk_count + 1;
+
+    std::vector<decode_chunk> chunks(chunk_count);
+    for (uint k = 0; k < chunk_count; ++k) {
+        chunks[k].begin = std::min(code_size, k * chunk_size);
+        chunks[k].end = std::min(code_size, (k + 1) * chunk_size);
+    }
+
+    parallel_for(chunk_count, jobs, [&](uint k, uint) {
+        decode_chunk_paths(file, opset, &chunks[k]);
+    });
+
+    // Pick each chunk's path, then stitch them into a table of the exact size.
+    std::vector<chunk_path *> picked(chunk_count, (chunk_path *)NULL);
+    uint total = 0;
+    uint offset = 0;
+    bool truncated = false;
+    for (uint k = 0; k < chunk_count && offset < code_size && !truncated; ++k) {
+        decode_chunk * c = &chunks[k];
+        if (offset >= c->end) {
+            continue;
+        }
+        assert(offset >= c->begin && offset - c->begin < 5);
+        chunk_path * path = &c->paths[offset - c->begin];
+        picked[k] = path;
+        total += path->prefix.size() + (c->base.count - path->join);
+        offset = path->next;
+        truncated = path->truncated;
+    }
+
+    opcode_table_alloc(table, total, mem);
+    for (uint k = 0; k < chunk_count; ++k) {
+        decode_chunk * c = &chunks[k];
+        chunk_path * path = picked[k];
+        if (path == NULL) {
+            continue;
+        }
+        for (uint i = 0; i < path->prefix.size(); ++i) {
+            table->offsets[table->count] = path->prefix[i].offset;
+            table->params[table->count] = path->prefix[i].param;
+            table->ops[table->count] = (uchar)path->prefix[i].op;
+            table->count++;
+        }
+        uint rest = c->base.count - path->join;
+        memcpy(table->offsets + table->count, c->base.offsets + path->join, rest * sizeof(uint));
+        memcpy(table->params + table->count, c->base.params + path->join, rest * sizeof(uint));
+        memcpy(table->ops + table->count, c->base.ops + path->join, rest);
+        table->count += rest;
+    }
+
+    for (uint k = 0; k < chunk_count; ++k) {
+        free_opcode_table(&chunks[k].base);
+    }
+
+    if (truncated) {
+        fprintf(stderr, "Unexpected end of code block.  Size: %d; Current Offset: %d\n", code_size, offset);
+    }
+}
+
+// The table is allocated from mem.
+void decode_opcodes(script_file * file, const escr1_opset * opset, opcode_table * table, arena * mem) {
+    uint code_size = file->code_size;
+    assert(code_size > 0);
+
+    if (code_size >= parallel_decode_min && jobs > 1 && !in_worker) {
+        decode_opcodes_parallel(file, opset, table, mem);
+        return;
+    }
+
+    opcode_table_alloc(table, count_opcodes(file, opset), mem);
+
+    table_builder builder;
+    builder.table = table;
+    builder.code_size = code_size;
+    escr1_visit(file, opset, builder);
+}
+
+// The sets are allocated from mem.
+void collect_labels(const opcode_table * table, branch_labels * labels, arena * mem) {
+    labels->size = table->count ? table->offsets[table->count - 1] + 1 : 0;
+    size_t words = ((size_t)labels->size + 63) / 64;
+    uint64_t * bits = (uint64_t *)arena_alloc(mem, 3 * words * sizeof(uint64_t) + 1);
+    memset(bits, 0, 3 * words * sizeof(uint64_t));
+    labels->starts = bits;
+    labels->jumps = bits + words;
+    labels->calls = bits + 2 * words;
+
+    for (uint i = 0; i < table->count; ++i) {
+        uint offset = table->offsets[i];
+        labels->starts[offset >> 6] |= 1ULL << (offset & 63);
+        uint op = table->ops[i];
+        uint target = table->params[i];
+        if (is_branch_op(op) && target < labels->size) {
+            uint64_t * set = op == ROP_CALL ? labels->calls : labels->jumps;
+            set[target >> 6] |= 1ULL << (target & 63);
+        }
+    }
+}
+
+void print_opcodes(listing_writer * w, const escr1_opset * opset, script_file * file, opcode_table * table) {
+    perf_scope timer(PERF_FORMAT);
+    branch_labels labels;
+    if (show_labels) {
+        collect_labels(table, &labels, w->scratch);
+    }
+    for (uint i = 0; i < table->count; ++i) {
+        opcode op;
+        op.offset = table->offsets[i];
+        op.op = table->ops[i];
+        op.param = table->params[i];
+        print_opcode(w, opset, file, &op, show_labels ? &labels : NULL);
+    }
+}
+
+// JSON OUTPUT
+//
+// NDJSON, one object per line:
+//
+//   {"file":"a.bin"}                                       -- before each input
+//   {"offset":16,"op":"push","param":3}                     -- per instruction
+//   {"offset":33,"string":12,"text":"..."}                  -- per string, with --str
+//
+// Records are encoded straight into the listing_writer's buffer; nothing is allocated
+// per record.  String text is decoded from Shift-JIS to UTF-8 (after the half-width
+// conversion, with --convert).
+
+static void json_uint(listing_writer * w, uint v) {
+    char tmp[10];
+    uint n = 0;
+    do {
+        tmp[n++] = '0' + (v % 10);
+        v /= 10;
+    } while (v);
+
+    writer_reserve(w, n);
+    while (n) {
+        w->buf[w->len++] = tmp[--n];
+    }
+}
+
+// Appends one code point, escaping as needed.  Reserves its own space (at most 6 bytes).
+static inline void json_codepoint(listing_writer * w, uint c) {
+    static const char hex[] = "0123456789abcdef";
+    writer_reserve(w, 6);
+    char * out = w->buf + w->len;
+    if (c == '"' || c == '\\') {
+        out[0] = '\\';
+        out[1] = (char)c;
+        w->len += 2;
+    }
+    else if (c < 0x20) {
+        out[0] = '\\';
+        out[1] = 'u';
+        out[2] = '0';
+        out[3] = '0';
+        out[4] = hex[c >> 4];
+        out[5] = hex[c & 15];
+        w->len += 6;
+    }
+    else if (c < 0x80) {
+        out[0] = (char)c;
+        w->len += 1;
+    }
+    else if (c < 0x800) {
+        out[0] = (char)(0xc0 | (c >> 6));
+        out[1] = (char)(0x80 | (c & 0x3f));
+        w->len += 2;
+    }
+    else {
+        out[0] = (char)(0xe0 | (c >> 12));
+        out[1] = (char)(0x80 | ((c >> 6) & 0x3f));
+        out[2] = (char)(0x80 | (c & 0x3f));
+        w->len += 3;
+    }
+}
+
+static bool utf8_valid(const uchar * s) {
+    while (*s) {
+        uchar c = *s;
+        uint extra = c < 0x80 ? 0 : (c & 0xe0) == 0xc0 ? 1 : (c & 0xf0) == 0xe0 ? 2 : (c & 0xf8) == 0xf0 ? 3 : 4;
+        if (extra == 4 || (c & 0xfe) == 0xc0) return false;
+        for (uint i = 1; i <= extra; ++i) {
+            if ((s[i] & 0xc0) != 0x80) return false;
+        }
+        s += 1 + extra;
+    }
+    return true;
+}
+
+static inline int sjis_lead_index(uchar c) {
+    if (c >= 0x81 && c <= 0x9f) return c - 0x81;
+    if (c >= 0xe0 && c <= 0xef) return c - 0xe0 + 0x1f;
+    return -1;
+}
+
+static void json_sjis(listing_writer * w, const uchar * s) {
+    writer_raw(w, "\"", 1);
+    while (*s) {
+        uchar c = *s;
+        int lead = sjis_lead_index(c);
+        if (lead >= 0) {
+            uint trail = s[1];
+            if (trail == 0) {
+                json_codepoint(w, 0xfffd);
+                break;
+            }
+            uint cp = 0xfffd;
+            if (trail >= sjis_trail_first && trail - sjis_trail_first < sjis_trail_count) {
+                cp = sjis_table[lead][trail - sjis_trail_first];
+            }
+            json_codepoint(w, cp);
+            s += 2;
+        }
+        else if (c == 0xa0) {
+            // Engine's full-width space, see escr1_htoz_char().
+            json_codepoint(w, 0x3000);
+            s++;
+        }
+        else if (c >= 0xa1 && c <= 0xdf) {
+            // Half-width katakana map linearly onto U+FF61..U+FF9F.
+            json_codepoint(w, 0xff61 + (c - 0xa1));
+            s++;
+        }
+        else if (c < 0x80) {
+            json_codepoint(w, c);
+            s++;
+        }
+        else {
+            json_codepoint(w, 0xfffd);
+            s++;
+        }
+    }
+    writer_raw(w, "\"", 1);
+}
+
+// Used for filenames.  UTF-8 names are passed through, apart from escaping; anything
+// else is taken to be cp932, as Windows passes it, and decoded like script strings.
+static void json_bytes(listing_writer * w, const char * s) {
+    if (!utf8_valid((const uchar *)s)) {
+        json_sjis(w, (const uchar *)s);
+        return;
+    }
+    writer_raw(w, "\"", 1);
+    for (; *s; ++s) {
+        uchar c = (uchar)*s;
+        if (c < 0x80) {
+            json_codepoint(w, c);
+        }
+        else {
+            writer_raw(w, s, 1);
+        }
+    }
+    writer_raw(w, "\"", 1);
+}
+
+static void json_mnemonic(listing_writer * w, const char * name) {
+    // Names are padded with spaces for the text listing.
+    uint n = 0;
+    while (name[n] && name[n] != ' ') n++;
+    writer_raw(w, "\"", 1);
+    writer_raw(w, name, n);
+    writer_raw(w, "\"", 1);
+}
+
+#define JSON_LIT(w, s) writer_raw((w), (s), sizeof(s) - 1)
+
+void print_opcodes_json(listing_writer * w, const char * name, const escr1_opset * opset, script_file * file, opcode_table * table) {
+    perf_scope timer(PERF_FORMAT);
+    JSON_LIT(w, "{\"file\":");
+    json_bytes(w, name);
+    JSON_LIT(w, "}\n");
+
+    for (uint i = 0; i < table->count; ++i) {
+        uint op = table->ops[i];
+        JSON_LIT(w, "{\"offset\":");
+        json_uint(w, table->offsets[i]);
+        JSON_LIT(w, ",\"op\":");
+        json_mnemonic(w, opset->names[op]);
+        if (opset->has_param[op]) {
+            JSON_LIT(w, ",\"param\":");
+            json_uint(w, table->params[i]);
+        }
+        JSON_LIT(w, "}\n");
+
+        if (show_strings && op == ROP_STR) {
+            char * str = NULL;
+            if (data_lookup_string(file, table->params[i], &str)) {
+                if (htoz) convert_string_htoz(&str, w->scratch);
+                JSON_LIT(w, "{\"offset\":");
+                json_uint(w, table->offsets[i]);
+                JSON_LIT(w, ",\"string\":");
+                json_uint(w, table->params[i]);
+                JSON_LIT(w, ",\"text\":");
+                json_sjis(w, (const uchar *)str);
+                JSON_LIT(w, "}\n");
+            }
+        }
+    }
+}
+
+// VAR/FLAG CROSS REFERENCE
+
+// Var and flag ids are never immediates on the set/get opcodes themselves -- they are
+// popped off the stack.  To find out which ids a script touches we run a small abstract
+// stack alongside the decoder: ROP_PUSH pushes a known constant, arithmetic on two known
+// constants is folded, and anything else pushes an unknown slot.
+//
+// Order of operands is taken to be `push id; push value; setvar` (value on top), and
+// `push id; getvar` for reads.
+//
+// We don't track stack state across branches.  Any control flow op (or user op, which
+// may consume a variable number of params) resets the abstract stack.
+
+enum {
+    XREF_VAR = 0,
+    XREF_FLAG,
+};
+
+enum {
+    XREF_READ = 0,
+    XREF_WRITE,
+};
+
+struct xref_entry {
+    uint kind;      // XREF_VAR or XREF_FLAG
+    uint id;        // Var/flag id, or XREF_UNRESOLVED
+    uint file;      // Index into input file list
+    uint offset;    // Offset of the set/get opcode
+    uint access;    // XREF_READ or XREF_WRITE
+};
+
+static const uint XREF_UNRESOLVED = 0xffffffff;
+
+struct const_slot {
+    bool known;
+    uint value;
+};
+
+static const uint XREF_STACK_MAX = 64;
+
+struct const_stack {
+    const_slot slots[XREF_STACK_MAX];
+    uint depth;
+};
+
+static void const_push(const_stack * s, bool known, uint value) {
+    if (s->depth == XREF_STACK_MAX) {
+        // Drop the bottom slot; it's almost certainly stale by now.
+        memmove(&s->slots[0], &s->slots[1], sizeof(const_slot) * (XREF_STACK_MAX - 1));
+        s->depth--;
+    }
+    s->slots[s->depth].known = known;
+    s->slots[s->depth].value = value;
+    s->depth++;
+}
+
+static const_slot const_pop(const_stack * s) {
+    if (s->depth == 0) {
+        const_slot unknown = { false, 0 };
+        return unknown;
+    }
+    return s->slots[--s->depth];
+}
+
+static bool const_fold(uint op, uint a, uint b, uint * out) {
+    int sa = (int)a;
+    int sb = (int)b;
+    switch (op) {
+        case ROP_ADD:  *out = a + b; return true;
+        case ROP_SUB:  *out = a - b; return true;
+        case ROP_MUL:  *out = a * b; return true;
+        case ROP_DIV:  if (sb == 0) return false; *out = (uint)(sa / sb); return true;
+        case ROP_MOD:  if (sb == 0) return false; *out = (uint)(sa % sb); return true;
+        case ROP_AND:  *out = a & b; return true;
+        case ROP_OR:   *out = a | b; return true;
+        case ROP_SHR:  *out = (uint)(sa >> (b & 31)); return true;
+        case ROP_SHL:  *out = a << (b & 31); return true;
+        case ROP_EQ:   *out = (a == b); return true;
+        case ROP_NE:   *out = (a != b); return true;
+        case ROP_GT:   *out = (sa > sb); return true;
+        case ROP_GE:   *out = (sa >= sb); return true;
+        case ROP_LT:   *out = (sa < sb); return true;
+        case ROP_LE:   *out = (sa <= sb); return true;
+        case ROP_LAND: *out = (a && b); return true;
+        case ROP_LOR:  *out = (a || b); return true;
+    }
+    return false;
+}
+
+static void xref_record(std::vector<xref_entry> * out, uint kind, uint access, const_slot id, uint file, uint offset) {
+    xref_entry e;
+    e.kind = kind;
+    e.id = id.known ? id.value : XREF_UNRESOLVED;
+    e.file = file;
+    e.offset = offset;
+    e.access = access;
+    out->push_back(e);
+}
+
+struct xref_visitor : escr1_visitor<xref_visitor> {
+    const_stack stack;
+    uint file_index;
+    std::vector<xref_entry> * out;
+
+    void on_push(const opcode & op) { const_push(&stack, true, op.param); }
+    void on_str(const opcode &) { const_push(&stack, false, 0); }
+    void on_pop(const opcode &) { const_pop(&stack); }
+    void on_fileline(const opcode &) {}
+
+    void on_setvar(const opcode & op) { write(XREF_VAR, op); }
+    void on_setflag(const opcode & op) { write(XREF_FLAG, op); }
+    void on_getvar(const opcode & op) { read(XREF_VAR, op); }
+    void on_getflag(const opcode & op) { read(XREF_FLAG, op); }
+
+    void write(uint kind, const opcode & op) {
+        const_pop(&stack);  // value
+        const_slot id = const_pop(&stack);
+        xref_record(out, kind, XREF_WRITE, id, file_index, op.offset);
+    }
+
+    void read(uint kind, const opcode & op) {
+        const_slot id = const_pop(&stack);
+        xref_record(out, kind, XREF_READ, id, file_index, op.offset);
+        const_push(&stack, false, 0);
+    }
+
+    void on_unary(const opcode & op) {
+        const_slot a = const_pop(&stack);
+        uint v = (op.op == ROP_NEG) ? (uint)-(int)a.value : (op.op == ROP_NOT) ? ~a.value : !a.value;
+        const_push(&stack, a.known, v);
+    }
+
+    void on_binary(const opcode & op) {
+        const_slot b = const_pop(&stack);
+        const_slot a = const_pop(&stack);
+        uint v = 0;
+        bool known = a.known && b.known && const_fold(op.op, a.value, b.value, &v);
+        const_push(&stack, known, v);
+    }
+
+    // ROP_JUMP/JUMPZ/CALL/RET/END and user ops.
+    void on_default(const opcode &) { stack.depth = 0; }
+};
+
+void xref_script(opcode_table * table, uint file_index, std::vector<xref_entry> * out) {
+    xref_visitor v;
+    v.stack.depth = 0;
+    v.file_index = file_index;
+    v.out = out;
+
+    for (uint i = 0; i < table->count; ++i) {
+        opcode op;
+        op.offset = table->offsets[i];
+        op.op = table->ops[i];
+        op.param = table->params[i];
+        escr1_visit_op(v, op);
+    }
+}
+
+static bool xref_entry_less(const xref_entry & a, const xref_entry & b) {
+    if (a.kind != b.kind) return a.kind < b.kind;
+    if (a.id != b.id) return a.id < b.id;
+    if (a.file != b.file) return a.file < b.file;
+    return a.offset < b.offset;
+}
+
+int load_file(char * filename, uchar ** data) {
+    perf_scope timer(PERF_READ);
+    FILE * fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open file: [%s]\n", filename);
+        exit(1);
+    }
+
+    fseek(fp, 0, SEEK_END);
+    int bytes = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    uchar * contents = (uchar *)calloc(1, bytes);
+    int read = fread(contents, 1, bytes, fp);
+    if (read < bytes) {
+        if (ferror(fp)) {
+            fprintf(stderr, "Error while reading file [%s]\n", filename);
+            exit(1);
+        }
+        else if (feof(fp)) {
+#ifdef _DEBUG
+            fprintf(stderr, "Expected to read %d bytes, read %d\n", bytes, read);
+#endif 
+        }
+    }
+
+    fclose(fp);
+    *data = contents;
+    perf_count(PERF_BYTES_READ, read);
+
+    // Sanity check.  Overflow should be unlikely with reasonable files.
+    assert(read >= 0);
+    return read;
+}
+
+// Fills in section pointers for a script already loaded into memory.  On a bad script,
+// returns false with the message in *error, for workers that hand failures on.
+bool open_script(const char * filename, uchar * data, uint flen, script_file * script, std::string * error) {
+    escr1_status status = escr1_open_memory(data, flen, script);
+    if (status == ESCR1_ERR_MAGIC) {
+        *error = std::string("This is not an ESCR1_00 file: [") + filename + "]";
+        return false;
+    }
+    else if (status != ESCR1_OK) {
+        *error = std::string("Bad script file [") + filename + "]: " + escr1_status_string(status);
+        return false;
+    }
+    return true;
+}
+
+void parse_script(const char * filename, uchar * data, uint flen, script_file * script) {
+    std::string error;
+    if (!open_script(filename, data, flen, script, &error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        exit(1);
+    }
+}
+
+// PACK ARCHIVES
+//
+// Scripts ship inside the game's pack archives.  --archive FILE maps an archive once,
+// indexes it, and adds every script in it to the inputs as "FILE:NAME"; the scripts are
+// then read straight out of the mapping, with no extraction and no per-file open.  The
+// mapping stays open until exit.
+//
+// Archive formats are pluggable: a format is a probe on the first bytes of the file and
+// an indexer that lists (name, position, size) for each member.  Members that aren't
+// ESCR1_00 scripts (images, sound) are skipped.  The only format built in is a simple
+// stand-in container, written with --make-archive (little endian):
+//
+// - Magic 'ESCRPK00'
+// - uint entry_count
+// - pack_dir_entry[entry_count]
+// - names (null-terminated), then member contents, at the positions in the directory
+//
+// Members are 4-byte aligned, so the index tables inside them are too.
+
+struct pack_entry {
+    char * name;        // "archive:member", as shown in the listing
+    uchar * data;       // Into the archive mapping
+    uint size;
+};
+
+struct pack_format {
+    const char * name;
+    bool (*probe)(const uchar * data, size_t size);
+    // Appends the archive's members to out.  Returns false if the directory is damaged.
+    bool (*index)(const char * archive_name, mapped_file * map, std::vector<pack_entry> * out);
+};
+
+const uchar pack_magic[9] = "ESCRPK00";
+
+struct pack_dir_entry {
+    uint64_t data_pos;
+    uint data_size;
+    uint name_pos;
+};
+
+static char * pack_member_name(const char * archive_name, const char * member) {
+    uint len = strlen(archive_name) + 1 + strlen(member) + 1;
+    char * name = (char *)malloc(len);
+    snprintf(name, len, "%s:%s", archive_name, member);
+    return name;
+}
+
+static bool escrpk_probe(const uchar * data, size_t size) {
+    return size >= 8 && !memcmp(data, pack_magic, 8);
+}
+
+static bool escrpk_index(const char * archive_name, mapped_file * map, std::vector<pack_entry> * out) {
+    if (map->size < 12) return false;
+    uint count;
+    memcpy(&count, map->data + 8, sizeof(uint));
+    if ((uint64_t)count * sizeof(pack_dir_entry) > map->size - 12) return false;
+
+    for (uint i = 0; i < count; ++i) {
+        pack_dir_entry d;
+        memcpy(&d, map->data + 12 + (uint64_t)i * sizeof(pack_dir_entry), sizeof(d));
+        if (d.data_pos > map->size || d.data_size > map->size - d.data_pos || d.name_pos >= map->size ||
+            !memchr(map->data + d.name_pos, 0, map->size - d.name_pos)) {
+            return false;
+        }
+        pack_entry e;
+        e.name = pack_member_name(archive_name, (const char *)map->data + d.name_pos);
+        e.data = map->data + d.data_pos;
+        e.size = d.data_size;
+        out->push_back(e);
+    }
+    return true;
+}
+
+static const pack_format pack_formats[] = {
+    { "escrpk", escrpk_probe, escrpk_index },
+};
+
+struct pack_archive {
+    mapped_file map;
+    std::vector<pack_entry> entries;    // Scripts only
+};
+
+std::vector<pack_archive *> archives;
+std::map<std::string, const pack_entry *> pack_entries;    // By name, for analyze_file
+
+// Maps and indexes an archive, and appends the names of the scripts in it to names.
+void open_archive(const char * filename, std::vector<char *> * names) {
+    pack_archive * pack = new pack_archive;
+    if (!escr1_map_file(filename, &pack->map)) {
+        fprintf(stderr, "Failed to open file: [%s]\n", filename);
+        exit(1);
+    }
+
+    const pack_format * format = NULL;
+    for (uint i = 0; i < sizeof(pack_formats) / sizeof(pack_formats[0]); ++i) {
+        if (pack_formats[i].probe(pack->map.data, pack->map.size)) {
+            format = &pack_formats[i];
+            break;
+        }
+    }
+    if (format == NULL) {
+        fprintf(stderr, "Unknown archive format: [%s]\n", filename);
+        exit(1);
+    }
+
+    std::vector<pack_entry> members;
+    if (!format->index(filename, &pack->map, &members)) {
+        fprintf(stderr, "Damaged %s archive directory: [%s]\n", format->name, filename);
+        exit(1);
+    }
+    for (uint i = 0; i < members.size(); ++i) {
+        if (members[i].size >= 8 && !memcmp(members[i].data, magic, 8)) {
+            pack->entries.push_back(members[i]);
+        }
+        else {
+            free(members[i].name);
+        }
+    }
+
+    for (uint i = 0; i < pack->entries.size(); ++i) {
+        pack_entries[pack->entries[i].name] = &pack->entries[i];
+        names->push_back(pack->entries[i].name);
+    }
+    archives.push_back(pack);
+    fprintf(stderr, "Found %u scripts in [%s] (%s)\n", (uint)pack->entries.size(), filename, format->name);
+}
+
+const pack_entry * find_pack_entry(const char * name) {
+    if (pack_entries.empty()) return NULL;
+    std::map<std::string, const pack_entry *>::const_iterator it = pack_entries.find(name);
+    return it == pack_entries.end() ? NULL : it->second;
+}
+
+// Whether the file is in a known archive format.  Probes only see its first 16 bytes.
+bool is_archive(const char * filename) {
+    FILE * fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    uchar head[16];
+    size_t n = fread(head, 1, sizeof(head), fp);
+    fclose(fp);
+    for (uint i = 0; i < sizeof(pack_formats) / sizeof(pack_formats[0]); ++i) {
+        if (pack_formats[i].probe(head, n)) return true;
+    }
+    return false;
+}
+
+// fseek takes a long, which is 32 bits on Windows.
+static int seek_file(FILE * fp, uint64_t pos) {
+#ifdef _WIN32
+    return _fseeki64(fp, (__int64)pos, SEEK_SET);
+#else
+    return fseeko(fp, (off_t)pos, SEEK_SET);
+#endif
+}
+
+// Writes the inputs, as they are on disk, to a stand-in archive.
+void write_archive(const char * filename, char ** names, uint file_count) {
+    FILE * fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open file: [%s]\n", filename);
+        exit(1);
+    }
+
+    std::vector<pack_dir_entry> dir(file_count);
+    uint64_t pos = 12 + (uint64_t)file_count * sizeof(pack_dir_entry);
+    for (uint i = 0; i < file_count; ++i) {
+        dir[i].name_pos = (uint)pos;
+        pos += strlen(names[i]) + 1;
+    }
+    for (uint i = 0; i < file_count; ++i) {
+        uchar * data;
+        uint size = load_file(names[i], &data);
+        pos = (pos + 3) & ~(uint64_t)3;
+        dir[i].data_pos = pos;
+        dir[i].data_size = size;
+        seek_file(fp, pos);
+        fwrite(data, 1, size, fp);
+        pos += size;
+        free(data);
+    }
+
+    fseek(fp, 0, SEEK_SET);
+    fwrite(pack_magic, 1, 8, fp);
+    fwrite(&file_count, sizeof(uint), 1, fp);
+    if (file_count) {
+        fwrite(&dir[0], sizeof(pack_dir_entry), file_count, fp);
+    }
+    for (uint i = 0; i < file_count; ++i) {
+        fwrite(names[i], 1, strlen(names[i]) + 1, fp);
+    }
+
+    if (ferror(fp)) {
+        fprintf(stderr, "Error while writing file [%s]\n", filename);
+        exit(1);
+    }
+    fclose(fp);
+}
+
+// BATCH READER
+//
+// Batch modes over many small files on network storage spend most of their time waiting
+// on reads.  The batch reader keeps up to --io-depth reads in flight ahead of the
+// workers: file i is requested with read_batch_take(r, i), which normally finds it
+// already loaded.  Reads are issued in input order, and at most io-depth loaded files
+// wait to be taken at any time, so memory stays bounded.
+//
+// On Linux the reads go through io_uring (raw syscalls; liburing isn't required) from one
+// submitter thread.  Elsewhere, where io_uring is unavailable or blocked, or when built
+// with -DESCR1_NO_IO_URING, a small pool of reader threads does plain blocking reads
+// instead.  Archive members are already in memory and complete immediately.
+
+#if defined(__linux__) && defined(__has_include) && !defined(ESCR1_NO_IO_URING)
+#if __has_include(<linux/io_uring.h>)
+#define ESCR1_HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef ESCR1_HAVE_IO_URING
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+uint io_depth = 32;
+
+// One loaded input.  Files are read into a fresh arena, which becomes the script's
+// arena; archive members are read in place and start with an empty one.
+struct input_data {
+    uchar * data;
+    uint size;
+    arena mem;
+};
+
+// Blocking read of a whole file.  Unlike load_file, reports failure instead of exiting,
+// so reader threads can hand the error to the worker that asked for the file.
+static bool read_whole_file(const char * filename, input_data * out) {
+    FILE * fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long bytes = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    arena_init(&out->mem);
+    out->data = (uchar *)arena_alloc(&out->mem, bytes);
+    out->size = (uint)fread(out->data, 1, bytes, fp);
+    bool failed = ferror(fp) != 0;
+    fclose(fp);
+    if (failed) {
+        arena_reset(&out->mem);
+    }
+    return !failed;
+}
+
+static bool input_from_archive(const char * filename, input_data * out) {
+    const pack_entry * entry = find_pack_entry(filename);
+    if (entry == NULL) {
+        return false;
+    }
+    out->data = entry->data;
+    out->size = entry->size;
+    arena_init(&out->mem);
+    return true;
+}
+
+enum {
+    READ_PENDING = 0,
+    READ_DONE,
+    READ_FAILED,
+    READ_TAKEN,
+};
+
+struct read_batch {
+    char ** filenames;
+    uint count;
+    uint depth;
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::vector<uchar> state;           // READ_*, per input
+    std::vector<input_data> inputs;
+    uint issued;                        // Reads started, in input order
+    uint taken;                         // Inputs handed to workers
+    bool stopping;
+
+    std::vector<std::thread> threads;
+};
+
+// Called by the backends for each input they start.  Blocks while io-depth loaded inputs
+// are waiting to be taken.  Returns false when there is nothing left to start.
+static bool read_batch_claim(read_batch * r, uint * index) {
+    std::unique_lock<std::mutex> guard(r->lock);
+    while (!r->stopping && r->issued < r->count && r->issued >= r->taken + r->depth) {
+        r->changed.wait(guard);
+    }
+    if (r->stopping || r->issued >= r->count) {
+        return false;
+    }
+    *index = r->issued++;
+    return true;
+}
+
+// Non-blocking variant, for the io_uring submitter, which has completions to reap.
+static bool read_batch_try_claim(read_batch * r, uint * index) {
+    std::lock_guard<std::mutex> guard(r->lock);
+    if (r->stopping || r->issued >= r->count || r->issued >= r->taken + r->depth) {
+        return false;
+    }
+    *index = r->issued++;
+    return true;
+}
+
+static void read_batch_complete(read_batch * r, uint index, bool ok, const input_data * in) {
+    std::lock_guard<std::mutex> guard(r->lock);
+    if (ok) r->inputs[index] = *in;
+    r->state[index] = ok ? READ_DONE : READ_FAILED;
+    r->changed.notify_all();
+}
+
+static void read_batch_thread(read_batch * r) {
+    uint i;
+    while (read_batch_claim(r, &i)) {
+        input_data in;
+        bool ok = input_from_archive(r->filenames[i], &in) || read_whole_file(r->filenames[i], &in);
+        read_batch_complete(r, i, ok, &in);
+    }
+}
+
+#ifdef ESCR1_HAVE_IO_URING
+
+struct uring {
+    int fd;
+    uint * sq_head;
+    uint * sq_tail;
+    uint sq_mask;
+    uint * sq_array;
+    io_uring_sqe * sqes;
+    uint * cq_head;
+    uint * cq_tail;
+    uint cq_mask;
+    io_uring_cqe * cqes;
+    void * sq_ring;
+    size_t sq_ring_size;
+    void * cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+static void uring_close(uring * u) {
+    if (u->sqes) munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring && u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring) munmap(u->sq_ring, u->sq_ring_size);
+    close(u->fd);
+}
+
+static bool uring_open(uring * u, uint entries) {
+    memset(u, 0, sizeof(uring));
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0) {
+        return false;   // Old kernel, or blocked by a sandbox.
+    }
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+        u->sq_ring_size = u->cq_ring_size = std::max(u->sq_ring_size, u->cq_ring_size);
+    }
+
+    void * sq = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->sq_ring = sq == MAP_FAILED ? NULL : sq;
+    void * cq = single ? sq : mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->cq_ring = cq == MAP_FAILED ? NULL : cq;
+    u->sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    void * sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    u->sqes = sqes == MAP_FAILED ? NULL : (io_uring_sqe *)sqes;
+    if (!u->sq_ring || !u->cq_ring || !u->sqes) {
+        uring_close(u);
+        return false;
+    }
+
+    uchar * sqb = (uchar *)u->sq_ring;
+    u->sq_head = (uint *)(sqb + p.sq_off.head);
+    u->sq_tail = (uint *)(sqb + p.sq_off.tail);
+    u->sq_mask = *(uint *)(sqb + p.sq_off.ring_mask);
+    u->sq_array = (uint *)(sqb + p.sq_off.array);
+    uchar * cqb = (uchar *)u->cq_ring;
+    u->cq_head = (uint *)(cqb + p.cq_off.head);
+    u->cq_tail = (uint *)(cqb + p.cq_off.tail);
+    u->cq_mask = *(uint *)(cqb + p.cq_off.ring_mask);
+    u->cqes = (io_uring_cqe *)(cqb + p.cq_off.cqes);
+    return true;
+}
+
+// Queues a read; it's submitted by the next uring_enter.
+static void uring_queue_read(uring * u, int fd, void * buf, uint len, uint64_t offset, uint64_t user_data) {
+    uint tail = *u->sq_tail;
+    uint idx = tail & u->sq_mask;
+    io_uring_sqe * sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int uring_enter(uring * u, uint to_submit, uint min_complete) {
+    return (int)syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete,
+                        min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+struct uring_read {
+    int fd;
+    uint done;
+    input_data in;
+};
+
+static void uring_finish(read_batch * r, uint index, uring_read * rd, bool ok) {
+    close(rd->fd);
+    rd->fd = -1;
+    if (!ok) arena_reset(&rd->in.mem);
+    read_batch_complete(r, index, ok, &rd->in);
+}
+
+// Starts the read of input `index`.  Returns the number of sqes queued (0 or 1); inputs
+// that need no read are completed on the spot.
+static uint uring_start(uring * u, read_batch * r, uint index, std::vector<uring_read> * reads) {
+    input_data in;
+    if (input_from_archive(r->filenames[index], &in)) {
+        read_batch_complete(r, index, true, &in);
+        return 0;
+    }
+
+    uring_read * rd = &(*reads)[index];
+    rd->fd = open(r->filenames[index], O_RDONLY);
+    struct stat st;
+    if (rd->fd < 0 || fstat(rd->fd, &st) != 0) {
+        if (rd->fd >= 0) close(rd->fd);
+        read_batch_complete(r, index, false, NULL);
+        return 0;
+    }
+    rd->done = 0;
+    rd->in.size = (uint)st.st_size;
+    arena_init(&rd->in.mem);
+    rd->in.data = (uchar *)arena_alloc(&rd->in.mem, rd->in.size);
+    if (rd->in.size == 0) {
+        uring_finish(r, index, rd, true);
+        return 0;
+    }
+    uring_queue_read(u, rd->fd, rd->in.data, rd->in.size, 0, index);
+    return 1;
+}
+
+// For when io_uring_enter fails for good: reads the inputs still queued or in flight
+// directly.  The kernel may still own their buffers, so those are left allocated.
+static void uring_abandon(read_batch * r, std::vector<uring_read> * reads) {
+    for (uint i = 0; i < r->count; ++i) {
+        uring_read * rd = &(*reads)[i];
+        if (rd->fd < 0) continue;
+        close(rd->fd);
+        rd->fd = -1;
+        input_data in;
+        bool ok = read_whole_file(r->filenames[i], &in);
+        read_batch_complete(r, i, ok, &in);
+    }
+}
+
+static void uring_thread(read_batch * r, uring * u) {
+    std::vector<uring_read> reads(r->count);
+    for (uint i = 0; i < r->count; ++i) {
+        reads[i].fd = -1;
+    }
+    uint in_flight = 0;
+    uint queued = 0;
+    bool broken = false;
+
+    for (;;) {
+        uint index;
+        while (in_flight + queued < r->depth && read_batch_try_claim(r, &index)) {
+            queued += uring_start(u, r, index, &reads);
+        }
+        if (in_flight + queued == 0) {
+            // Window full or nothing left: wait for a take, or finish.
+            if (!read_batch_claim(r, &index)) break;
+            queued += uring_start(u, r, index, &reads);
+            continue;
+        }
+
+        int submitted = uring_enter(u, queued, 1);
+        if (submitted < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                uring_abandon(r, &reads);
+                broken = true;
+                break;
+            }
+            submitted = 0;  // The sqes stay queued; try again.
+        }
+        in_flight += submitted;
+        queued -= submitted;
+
+        uint head = *u->cq_head;
+        uint tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            io_uring_cqe * cqe = &u->cqes[head & u->cq_mask];
+            uint i = (uint)cqe->user_data;
+            uring_read * rd = &reads[i];
+            in_flight--;
+            if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+                // Kernel without IORING_OP_READ (before 5.6): read this one directly.
+                close(rd->fd);
+                rd->fd = -1;
+                arena_reset(&rd->in.mem);
+                input_data in;
+                bool ok = read_whole_file(r->filenames[i], &in);
+                read_batch_complete(r, i, ok, &in);
+            }
+            else if (cqe->res < 0) {
+                uring_finish(r, i, rd, false);
+            }
+            else if (cqe->res == 0 || rd->done + cqe->res >= rd->in.size) {
+                // A zero-length read means the file shrank; keep what we got.
+                rd->in.size = rd->done + cqe->res;
+                uring_finish(r, i, rd, true);
+            }
+            else {
+                // Short read: ask for the rest.
+                rd->done += cqe->res;
+                uring_queue_read(u, rd->fd, rd->in.data + rd->done, rd->in.size - rd->done, rd->done, i);
+                queued++;
+            }
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    uring_close(u);
+    delete u;
+    if (broken) {
+        // Load the rest with blocking reads.
+        read_batch_thread(r);
+    }
+}
+
+#endif // ESCR1_HAVE_IO_URING
+
+void read_batch_start(read_batch * r, char ** filenames, uint count, uint depth) {
+    r->filenames = filenames;
+    r->count = count;
+    r->depth = std::max(1u, depth);
+    r->state.assign(count, READ_PENDING);
+    r->inputs.resize(count);
+    r->issued = 0;
+    r->taken = 0;
+    r->stopping = false;
+
+#ifdef ESCR1_HAVE_IO_URING
+    uring * u = new uring;
+    if (uring_open(u, r->depth)) {
+        r->threads.push_back(std::thread(uring_thread, r, u));
+        return;
+    }
+    delete u;
+#endif
+
+    // Blocking reads only overlap if there are threads to block.
+    uint threads = std::min(r->depth, 8u);
+    for (uint t = 0; t < threads; ++t) {
+        r->threads.push_back(std::thread(read_batch_thread, r));
+    }
+}
+
+// Waits for input `index` to be loaded and hands it over.  Returns false if the file
+// couldn't be read.  It still counts as taken.
+bool read_batch_try_take(read_batch * r, uint index, input_data * out) {
+    perf_scope timer(PERF_READ);
+    std::unique_lock<std::mutex> guard(r->lock);
+    while (r->state[index] == READ_PENDING) {
+        r->changed.wait(guard);
+    }
+    bool ok = r->state[index] != READ_FAILED;
+    if (ok) {
+        *out = r->inputs[index];
+        perf_count(PERF_BYTES_READ, out->size);
+    }
+    r->state[index] = READ_TAKEN;
+    r->taken++;
+    r->changed.notify_all();
+    return ok;
+}
+
+// As read_batch_try_take, but exits if the file couldn't be read, as load_file does.
+void read_batch_take(read_batch * r, uint index, input_data * out) {
+    if (!read_batch_try_take(r, index, out)) {
+        fprintf(stderr, "Failed to read file: [%s]\n", r->filenames[index]);
+        exit(1);
+    }
+}
+
+// Joins the reader threads.  Frees anything read but never taken.
+void read_batch_stop(read_batch * r) {
+    {
+        std::lock_guard<std::mutex> guard(r->lock);
+        r->stopping = true;
+        r->changed.notify_all();
+    }
+    for (uint t = 0; t < r->threads.size(); ++t) {
+        r->threads[t].join();
+    }
+    r->threads.clear();
+    for (uint i = 0; i < r->count; ++i) {
+        if (r->state[i] == READ_DONE) {
+            arena_reset(&r->inputs[i].mem);
+        }
+    }
+}
+
+// CONTENT HASH
+//
+// XXH64 (https://github.com/Cyan4973/xxHash), reimplemented here so we don't pick up
+// a dependency for forty lines of code.
+
+static const uint64_t XXH_P1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t XXH_P2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t XXH_P3 = 0x165667B19E3779F9ULL;
+static const uint64_t XXH_P4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t XXH_P5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const uchar * p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t xxh_read32(const uchar * p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    acc = xxh_rotl(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+uint64_t hash64(const uchar * p, uint len, uint64_t seed) {
+    const uchar * end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_P1 + XXH_P2;
+        uint64_t v2 = seed + XXH_P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_P1;
+        const uchar * limit = end - 32;
+        do {
+            v1 = xxh_round(v1, xxh_read64(p));
+            v2 = xxh_round(v2, xxh_read64(p + 8));
+            v3 = xxh_round(v3, xxh_read64(p + 16));
+            v4 = xxh_round(v4, xxh_read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    }
+    else {
+        h = seed + XXH_P5;
+    }
+
+    h += (uint64_t)len;
+
+    while (p + 8 <= end) {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl(h, 27) * XXH_P1 + XXH_P4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)xxh_read32(p) * XXH_P1;
+        h = xxh_rotl(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * XXH_P5;
+        h = xxh_rotl(h, 11) * XXH_P1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// SCRIPT CACHE
+//
+// Decoded scripts are cached on disk, one file per script, named by the XXH64 of the
+// script contents (<cache dir>/<hash>.escc).  The opcode profile's param table seeds the
+// hash, since it decides where instruction boundaries fall.  A script whose contents haven't changed
+// since the last run is never decoded or analyzed again: the opcode table and xrefs are
+// mapped straight out of the cache entry.
+//
+// Entry layout (little endian, every array 4-byte aligned so it can be used in place):
+//
+// - Magic 'ESCRCC00'
+// - uint64 content hash
+// - uint file_size, code_offset, data_offset, index_count, op_count, xref_count
+// - uint string_offsets[index_count]   (copy of the script's index table)
+// - uint offsets[op_count]
+// - uint params[op_count]
+// - xref_entry xrefs[xref_count]       (file field is always 0)
+// - uchar ops[op_count]
+
+const uchar cache_magic[9] = "ESCRCC00";
+
+struct cache_header {
+    uchar magic[8];
+    uint64_t hash;
+    uint file_size;
+    uint code_offset;
+    uint data_offset;
+    uint index_count;
+    uint op_count;
+    uint xref_count;
+};
+
+char * cache_dir = NULL;
+
+// Everything we know about one input script.  The opcode table either owns its arrays
+// or, on a cache hit, points into the mapped cache entry.
+struct script_analysis {
+    const opcode_profile * profile;
+    const escr1_opset * opset;
+    script_file script;
+    opcode_table table;
+    std::vector<xref_entry> xrefs;
+    mapped_file cache;
+    arena mem;              // Contents (unless read from an archive), table and strings
+};
+
+static void cache_entry_path(uint64_t hash, char * out, uint out_size) {
+    snprintf(out, out_size, "%s/%016llx.escc", cache_dir, (unsigned long long)hash);
+}
+
+static bool cache_load(uint64_t hash, script_analysis * a, uint file_index) {
+    char path[1024];
+    cache_entry_path(hash, path, sizeof(path));
+    if (!escr1_map_file(path, &a->cache)) {
+        return false;
+    }
+
+    cache_header * h = (cache_header *)a->cache.data;
+    uint64_t expected = sizeof(cache_header);
+    if (a->cache.size >= sizeof(cache_header)) {
+        expected += ((uint64_t)h->index_count + 2 * (uint64_t)h->op_count) * sizeof(uint) +
+                    (uint64_t)h->xref_count * sizeof(xref_entry) + h->op_count;
+    }
+    if (a->cache.size < sizeof(cache_header) || memcmp(h->magic, cache_magic, 8) ||
+        h->hash != hash || h->file_size != a->script.file_size || expected != a->cache.size) {
+        // Stale or damaged.  It'll be overwritten below.
+        escr1_unmap_file(&a->cache);
+        return false;
+    }
+
+    // The sections are parsed from the script itself rather than taken from the entry,
+    // so a damaged entry can't point them outside the file.
+    script_file * s = &a->script;
+    if (escr1_open_memory(s->contents, s->file_size, s) != ESCR1_OK ||
+        h->index_count != s->index_count || h->code_offset != (uint)(s->code_ptr - s->contents) ||
+        h->data_offset != (uint)(s->data_ptr - s->contents)) {
+        escr1_unmap_file(&a->cache);
+        return false;
+    }
+
+    uint * p = (uint *)(h + 1);
+    p += h->index_count;
+    a->table.count = h->op_count;
+    a->table.capacity = 0;
+    a->table.offsets = p;
+    p += h->op_count;
+    a->table.params = p;
+    p += h->op_count;
+    xref_entry * xrefs = (xref_entry *)p;
+    a->table.ops = (uchar *)(xrefs + h->xref_count);
+
+    a->xrefs.assign(xrefs, xrefs + h->xref_count);
+    for (uint i = 0; i < a->xrefs.size(); ++i) {
+        a->xrefs[i].file = file_index;
+    }
+    return true;
+}
+
+static void cache_store(uint64_t hash, script_analysis * a, uint file_index) {
+    char path[1024];
+    char tmp_path[1040];
+    cache_entry_path(hash, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%u.tmp", path, file_index);
+
+    FILE * fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to write cache entry: [%s]\n", tmp_path);
+        return;
+    }
+
+    script_file * s = &a->script;
+    cache_header h;
+    memcpy(h.magic, cache_magic, 8);
+    h.hash = hash;
+    h.file_size = s->file_size;
+    h.code_offset = s->code_ptr - s->contents;
+    h.data_offset = s->data_ptr - s->contents;
+    h.index_count = s->index_count;
+    h.op_count = a->table.count;
+    h.xref_count = a->xrefs.size();
+
+    fwrite(&h, sizeof(h), 1, fp);
+    fwrite(s->index_ptr, sizeof(uint), s->index_count, fp);
+    fwrite(a->table.offsets, sizeof(uint), a->table.count, fp);
+    fwrite(a->table.params, sizeof(uint), a->table.count, fp);
+    for (uint i = 0; i < a->xrefs.size(); ++i) {
+        xref_entry e = a->xrefs[i];
+        e.file = 0;
+        fwrite(&e, sizeof(e), 1, fp);
+    }
+    fwrite(a->table.ops, 1, a->table.count, fp);
+
+    bool failed = ferror(fp) != 0;
+    fclose(fp);
+    if (failed || rename(tmp_path, path) != 0) {
+        // Another worker may have stored the same contents first, which is fine.
+        remove(tmp_path);
+    }
+}
+
+// Decodes and analyzes one loaded input, going through the cache when --cache is set.
+// Takes ownership of the input.  A NULL profile means --profile auto: the best fitting
+// one is picked per file.  Returns false on a bad script, with the message in *error;
+// release_analysis still applies.
+bool try_analyze_input(char * filename, input_data * in, const opcode_profile * profile, uint file_index, script_analysis * a, std::string * error) {
+    memset(&a->table, 0, sizeof(opcode_table));
+    memset(&a->cache, 0, sizeof(mapped_file));
+    a->xrefs.clear();
+
+    uchar * data = in->data;
+    uint flen = in->size;
+    a->mem = in->mem;
+    a->script.contents = data;
+    a->script.file_size = flen;
+
+    if (profile == NULL) {
+        perf_scope timer(PERF_DECODE);
+        double score;
+        if (!open_script(filename, data, flen, &a->script, error)) {
+            return false;
+        }
+        profile = detect_profile(&a->script, &score);
+    }
+    a->profile = profile;
+    a->opset = &profile->opset;
+    const escr1_opset * opset = a->opset;
+
+    uint64_t hash = 0;
+    if (cache_dir) {
+        perf_scope timer(PERF_CACHE);
+        hash = hash64(data, flen, hash64(opset->has_param, sizeof(opset->has_param), 0));
+        if (cache_load(hash, a, file_index)) {
+            return true;
+        }
+    }
+
+    {
+        perf_scope timer(PERF_DECODE);
+        if (!open_script(filename, data, flen, &a->script, error)) {
+            return false;
+        }
+        decode_opcodes(&a->script, opset, &a->table, &a->mem);
+        perf_count(PERF_INSTRUCTIONS, a->table.count);
+    }
+    {
+        perf_scope timer(PERF_ANALYZE);
+        xref_script(&a->table, file_index, &a->xrefs);
+    }
+
+    if (cache_dir) {
+        perf_scope timer(PERF_CACHE);
+        cache_store(hash, a, file_index);
+    }
+    return true;
+}
+
+void analyze_input(char * filename, input_data * in, const opcode_profile * profile, uint file_index, script_analysis * a) {
+    std::string error;
+    if (!try_analyze_input(filename, in, profile, file_index, a, &error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        exit(1);
+    }
+}
+
+void release_analysis(script_analysis * a) {
+    if (a->cache.data) {
+        escr1_unmap_file(&a->cache);
+    }
+    arena_reset(&a->mem);
+    a->xrefs.clear();
+}
+
+// BINARY DUMP
+//
+// An alternative to the text listing for tools that want the decoded instructions
+// without parsing hex back out of it.  All inputs go into one file, which can be mapped
+// and indexed directly.  Layout (little endian):
+//
+// - dump_header
+// - Per script, each array 4-byte aligned:
+//   - uint offsets[op_count]
+//   - uint params[op_count]
+//   - uint strings[string_count]   (the script's index table, verbatim)
+//   - uchar blob[blob_size]        (the script's data section, verbatim)
+//   - uchar ops[op_count]
+// - dump_script[script_count], at header.table_pos (8-byte aligned)
+// - names (null-terminated input filenames), at header.names_pos
+//
+// Positions are absolute file offsets.  Strings are stored as they appear in the script;
+// --convert is applied when reading, not when writing.  Ops are stored as raw bytes, so
+// --from-dump names them with whatever --profile it is given.
+
+const uchar dump_magic[9] = "ESCRBD00";
+
+struct dump_header {
+    uchar magic[8];
+    uint script_count;
+    uint names_size;
+    uint64_t table_pos;
+    uint64_t names_pos;
+};
+
+struct dump_script {
+    uint name;              // Offset into names
+    uint op_count;
+    uint string_count;
+    uint blob_size;
+    uint64_t offsets_pos;
+    uint64_t params_pos;
+    uint64_t ops_pos;
+    uint64_t strings_pos;
+    uint64_t blob_pos;
+};
+
+static uint64_t dump_write(FILE * fp, uint64_t pos, const void * data, uint64_t size) {
+    perf_scope timer(PERF_WRITE);
+    fwrite(data, 1, size, fp);
+    pos += size;
+
+    // Keep every array 4-byte aligned.
+    static const uchar zeros[4] = {0};
+    uint pad = (uint)(-pos & 3);
+    fwrite(zeros, 1, pad, fp);
+    perf_count(PERF_BYTES_WRITTEN, size + pad);
+    return pos + pad;
+}
+
+void write_dump(const char * filename, char ** names, const opcode_profile ** file_profiles, uint file_count) {
+    FILE * fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open file: [%s]\n", filename);
+        exit(1);
+    }
+
+    dump_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, dump_magic, 8);
+    header.script_count = file_count;
+    fwrite(&header, sizeof(header), 1, fp);
+    uint64_t pos = sizeof(header);
+
+    read_batch reader;
+    read_batch_start(&reader, names, file_count, io_depth);
+
+    std::vector<dump_script> table(file_count);
+    for (uint i = 0; i < file_count; ++i) {
+        input_data in;
+        read_batch_take(&reader, i, &in);
+        script_analysis a;
+        analyze_input(names[i], &in, file_profiles[i], i, &a);
+
+        dump_script * d = &table[i];
+        d->name = header.names_size;
+        header.names_size += strlen(names[i]) + 1;
+
+        d->op_count = a.table.count;
+        d->string_count = a.script.index_count;
+        d->blob_size = a.script.data_size;
+
+        d->offsets_pos = pos;
+        pos = dump_write(fp, pos, a.table.offsets, d->op_count * sizeof(uint));
+        d->params_pos = pos;
+        pos = dump_write(fp, pos, a.table.params, d->op_count * sizeof(uint));
+        d->strings_pos = pos;
+        pos = dump_write(fp, pos, a.script.index_ptr, d->string_count * sizeof(uint));
+        d->blob_pos = pos;
+        pos = dump_write(fp, pos, a.script.data_ptr, d->blob_size);
+        d->ops_pos = pos;
+        pos = dump_write(fp, pos, a.table.ops, d->op_count);
+
+        release_analysis(&a);
+    }
+    read_batch_stop(&reader);
+
+    // The table holds uint64_t fields, so it is mapped in place only if 8-byte aligned.
+    static const uchar zeros[8] = {0};
+    uint pad = (uint)(-pos & 7);
+    fwrite(zeros, 1, pad, fp);
+    perf_count(PERF_BYTES_WRITTEN, pad);
+    pos += pad;
+
+    header.table_pos = pos;
+    if (file_count) {
+        fwrite(&table[0], sizeof(dump_script), file_count, fp);
+    }
+    pos += file_count * sizeof(dump_script);
+
+    header.names_pos = pos;
+    for (uint i = 0; i < file_count; ++i) {
+        fwrite(names[i], 1, strlen(names[i]) + 1, fp);
+    }
+
+    fseek(fp, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, fp);
+    perf_count(PERF_BYTES_WRITTEN, sizeof(header) + file_count * sizeof(dump_script) + header.names_size);
+
+    if (ferror(fp)) {
+        fprintf(stderr, "Error while writing file [%s]\n", filename);
+        exit(1);
+    }
+    fclose(fp);
+}
+
+// A mapped dump.  Everything points into the mapping; nothing is copied.
+struct dump_file {
+    mapped_file map;
+    dump_header * header;
+    dump_script * scripts;
+    const char * names;
+};
+
+static bool dump_range_ok(dump_file * dump, uint64_t pos, uint64_t size) {
+    return pos <= dump->map.size && size <= dump->map.size - pos;
+}
+
+bool open_dump(const char * filename, dump_file * dump) {
+    if (!escr1_map_file(filename, &dump->map)) {
+        fprintf(stderr, "Failed to open file: [%s]\n", filename);
+        return false;
+    }
+
+    dump->header = (dump_header *)dump->map.data;
+    if (dump->map.size < sizeof(dump_header) || memcmp(dump->header->magic, dump_magic, 8)) {
+        fprintf(stderr, "This is not a binary dump file: [%s]\n", filename);
+        escr1_unmap_file(&dump->map);
+        return false;
+    }
+
+    dump_header * h = dump->header;
+    bool ok = (h->table_pos & 7) == 0 &&
+              dump_range_ok(dump, h->table_pos, (uint64_t)h->script_count * sizeof(dump_script)) &&
+              dump_range_ok(dump, h->names_pos, h->names_size);
+    dump->scripts = (dump_script *)(dump->map.data + h->table_pos);
+    dump->names = (const char *)(dump->map.data + h->names_pos);
+
+    // Names and string blobs must end in a terminator, so nothing reads past them.
+    ok = ok && (h->names_size == 0 || dump->names[h->names_size - 1] == 0);
+    for (uint i = 0; ok && i < h->script_count; ++i) {
+        dump_script * d = &dump->scripts[i];
+        ok = d->name < h->names_size &&
+             dump_range_ok(dump, d->offsets_pos, (uint64_t)d->op_count * sizeof(uint)) &&
+             dump_range_ok(dump, d->params_pos, (uint64_t)d->op_count * sizeof(uint)) &&
+             dump_range_ok(dump, d->ops_pos, d->op_count) &&
+             dump_range_ok(dump, d->strings_pos, (uint64_t)d->string_count * sizeof(uint)) &&
+             dump_range_ok(dump, d->blob_pos, d->blob_size) &&
+             d->blob_pos >= d->strings_pos && d->blob_pos - d->strings_pos + d->blob_size <= 0xffffffffu &&
+             (d->blob_size == 0 || dump->map.data[d->blob_pos + d->blob_size - 1] == 0);
+    }
+    if (!ok) {
+        fprintf(stderr, "Truncated binary dump file: [%s]\n", filename);
+        escr1_unmap_file(&dump->map);
+        return false;
+    }
+    return true;
+}
+
+void close_dump(dump_file * dump) {
+    escr1_unmap_file(&dump->map);
+}
+
+// Views script i of a dump as a script_file/opcode_table pair, so the usual printing
+// and string lookup code works on it unchanged.
+void dump_get_script(dump_file * dump, uint i, script_file * script, opcode_table * table) {
+    dump_script * d = &dump->scripts[i];
+
+    // contents covers this script's own strings and blob, so sizes fit a uint however
+    // big the dump is.
+    memset(script, 0, sizeof(script_file));
+    script->contents = dump->map.data + d->strings_pos;
+    script->file_size = (uint)(d->blob_pos - d->strings_pos + d->blob_size);
+    script->index_ptr = (uint *)(dump->map.data + d->strings_pos);
+    script->index_count = d->string_count;
+    script->data_ptr = dump->map.data + d->blob_pos;
+    script->data_size = d->blob_size;
+
+    memset(table, 0, sizeof(opcode_table));
+    table->count = d->op_count;
+    table->offsets = (uint *)(dump->map.data + d->offsets_pos);
+    table->params = (uint *)(dump->map.data + d->params_pos);
+    table->ops = dump->map.data + d->ops_pos;
+}
+
+// XREF INDEX FILE
+//
+// Built once over a corpus with --xref, then queried with --query without touching the
+// scripts again.  Layout (little endian, same as the scripts):
+//
+// - Magic 'ESCRXR00'
+// - uint file_count, uint entry_count, uint names_size
+// - xref_entry[entry_count], sorted by (kind, id, file, offset)
+// - uint name_offsets[file_count]  (into names)
+// - names (null-terminated input filenames)
+
+const uchar xref_magic[9] = "ESCRXR00";
+
+void build_xref(char ** filenames, const opcode_profile ** file_profiles, uint file_count, uint jobs, std::vector<xref_entry> * out) {
+    std::vector<std::vector<xref_entry> > results(file_count);
+
+    read_batch reader;
+    read_batch_start(&reader, filenames, file_count, io_depth);
+    parallel_for(file_count, jobs, [&](uint i, uint) {
+        input_data in;
+        read_batch_take(&reader, i, &in);
+        script_analysis a;
+        analyze_input(filenames[i], &in, file_profiles[i], i, &a);
+        results[i].swap(a.xrefs);
+        release_analysis(&a);
+    });
+    read_batch_stop(&reader);
+
+    for (uint i = 0; i < file_count; ++i) {
+        out->insert(out->end(), results[i].begin(), results[i].end());
+    }
+    std::sort(out->begin(), out->end(), xref_entry_less);
+}
+
+void write_xref(const char * filename, char ** names, uint file_count, std::vector<xref_entry> * entries) {
+    perf_scope timer(PERF_WRITE);
+    FILE * fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open file: [%s]\n", filename);
+        exit(1);
+    }
+
+    uint entry_count = entries->size();
+    uint names_size = 0;
+    for (uint i = 0; i < file_count; ++i) {
+        names_size += strlen(names[i]) + 1;
+    }
+
+    fwrite(xref_magic, 1, 8, fp);
+    fwrite(&file_count, sizeof(uint), 1, fp);
+    fwrite(&entry_count, sizeof(uint), 1, fp);
+    fwrite(&names_size, sizeof(uint), 1, fp);
+    if (entry_count) {
+        fwrite(&(*entries)[0], sizeof(xref_entry), entry_count, fp);
+    }
+
+    uint name_offset = 0;
+    for (uint i = 0; i < file_count; ++i) {
+        fwrite(&name_offset, sizeof(uint), 1, fp);
+        name_offset += strlen(names[i]) + 1;
+    }
+    for (uint i = 0; i < file_count; ++i) {
+        fwrite(names[i], 1, strlen(names[i]) + 1, fp);
+    }
+
+    if (ferror(fp)) {
+        fprintf(stderr, "Error while writing file [%s]\n", filename);
+        exit(1);
+    }
+    perf_count(PERF_BYTES_WRITTEN, ftell(fp));
+    fclose(fp);
+}
+
+void query_xref(char * filename, uint kind, uint id) {
+    uchar * data;
+    int flen = load_file(filename, &data);
+
+    uint header_size = 8 + 3 * sizeof(uint);
+    if ((uint)flen < header_size || memcmp(xref_magic, data, 8)) {
+        fprintf(stderr, "This is not an xref index file: [%s]\n", filename);
+        exit(1);
+    }
+
+    uint * header = (uint *)(data + 8);
+    uint file_count = header[0];
+    uint entry_count = header[1];
+    uint names_size = header[2];
+    if ((uint64_t)header_size + (uint64_t)entry_count * sizeof(xref_entry) +
+        (uint64_t)file_count * sizeof(uint) + names_size > (uint64_t)flen) {
+        fprintf(stderr, "Truncated xref index file: [%s]\n", filename);
+        exit(1);
+    }
+
+    xref_entry * entries = (xref_entry *)(data + header_size);
+    uint * name_offsets = (uint *)(entries + entry_count);
+    char * names = (char *)(name_offsets + file_count);
+
+    xref_entry key;
+    key.kind = kind;
+    key.id = id;
+    key.file = 0;
+    key.offset = 0;
+    xref_entry * it = std::lower_bound(entries, entries + entry_count, key, xref_entry_less);
+    for (; it != entries + entry_count && it->kind == kind && it->id == id; ++it) {
+        const char * name = (it->file < file_count) ? names + name_offsets[it->file] : "?";
+        printf("%s\t%s\t%08x\n", it->access == XREF_WRITE ? "write" : "read ", name, it->offset);
+    }
+
+    free(data);
+}
+
+// OPCODE STATISTICS
+//
+// --stats counts, over all inputs: opcodes, opcode bigrams and trigrams, the
+// distribution of each opcode's param (in power-of-two buckets), and string lengths
+// (every string in each index table, in bytes, same buckets).  N-grams run across
+// instruction boundaries only, never across files.  Each worker thread counts into its
+// own op_stats, and they are merged once at the end.
+
+static const uint STATS_BUCKETS = 33;       // 0, 1, 2-3, 4-7, ... 2^31-2^32-1
+static const uint STATS_TOP = 40;           // N-grams shown in the report
+
+static inline uint stats_bucket(uint v) {
+    uint b = 0;
+    while (v) {
+        b++;
+        v >>= 1;
+    }
+    return b;
+}
+
+// Trigrams are too sparse for a flat 2^24 table per thread, so they go in a small open
+// addressing hash map keyed by the three ops packed into 24 bits.
+struct trigram_map {
+    uint capacity;
+    uint used;
+    uint * keys;        // 0xffffffff when empty
+    uint64_t * counts;
+};
+
+static void trigram_init(trigram_map * m, uint capacity) {
+    m->capacity = capacity;
+    m->used = 0;
+    m->keys = (uint *)malloc(capacity * sizeof(uint));
+    m->counts = (uint64_t *)calloc(capacity, sizeof(uint64_t));
+    memset(m->keys, 0xff, capacity * sizeof(uint));
+}
+
+static void trigram_add(trigram_map * m, uint key, uint64_t count);
+
+static void trigram_grow(trigram_map * m) {
+    trigram_map old = *m;
+    trigram_init(m, old.capacity * 2);
+    for (uint i = 0; i < old.capacity; ++i) {
+        if (old.keys[i] != 0xffffffff) {
+            trigram_add(m, old.keys[i], old.counts[i]);
+        }
+    }
+    free(old.keys);
+    free(old.counts);
+}
+
+static void trigram_add(trigram_map * m, uint key, uint64_t count) {
+    uint mask = m->capacity - 1;
+    uint i = (key * 0x9E3779B1u) >> 8 & mask;
+    while (m->keys[i] != key) {
+        if (m->keys[i] == 0xffffffff) {
+            if (2 * (m->used + 1) > m->capacity) {
+                trigram_grow(m);
+                trigram_add(m, key, count);
+                return;
+            }
+            m->keys[i] = key;
+            m->used++;
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    m->counts[i] += count;
+}
+
+struct op_stats {
+    uint64_t files;
+    uint64_t instructions;
+    uint64_t strings;
+    uint64_t ops[256];
+    uint64_t bigrams[256 * 256];
+    trigram_map trigrams;
+    uint64_t params[256][STATS_BUCKETS];
+    uint64_t string_lengths[STATS_BUCKETS];
+};
+
+void init_stats(op_stats * st) {
+    memset(st, 0, sizeof(op_stats));
+    trigram_init(&st->trigrams, 4096);
+}
+
+void free_stats(op_stats * st) {
+    free(st->trigrams.keys);
+    free(st->trigrams.counts);
+}
+
+void collect_stats(op_stats * st, script_file * script, const escr1_opset * opset, opcode_table * table) {
+    perf_scope timer(PERF_ANALYZE);
+    st->files++;
+    st->instructions += table->count;
+
+    uint prev2 = 0;
+    uint prev1 = 0;
+    for (uint i = 0; i < table->count; ++i) {
+        uint op = table->ops[i];
+        st->ops[op]++;
+        if (opset->has_param[op]) {
+            st->params[op][stats_bucket(table->params[i])]++;
+        }
+        if (i >= 1) {
+            st->bigrams[prev1 << 8 | op]++;
+        }
+        if (i >= 2) {
+            trigram_add(&st->trigrams, prev2 << 16 | prev1 << 8 | op, 1);
+        }
+        prev2 = prev1;
+        prev1 = op;
+    }
+
+    for (uint id = 0; id < script->index_count; ++id) {
+        const char * str;
+        uint len = 0;
+        if (escr1_lookup_string(script, id, &str)) {
+            len = strnlen(str, script->data_size - script->index_ptr[id]);
+        }
+        st->strings++;
+        st->string_lengths[stats_bucket(len)]++;
+    }
+}
+
+void merge_stats(op_stats * into, op_stats * from) {
+    into->files += from->files;
+    into->instructions += from->instructions;
+    into->strings += from->strings;
+    for (uint i = 0; i < 256; ++i) {
+        into->ops[i] += from->ops[i];
+        for (uint b = 0; b < STATS_BUCKETS; ++b) {
+            into->params[i][b] += from->params[i][b];
+        }
+    }
+    for (uint i = 0; i < 256 * 256; ++i) {
+        into->bigrams[i] += from->bigrams[i];
+    }
+    for (uint i = 0; i < from->trigrams.capacity; ++i) {
+        if (from->trigrams.keys[i] != 0xffffffff) {
+            trigram_add(&into->trigrams, from->trigrams.keys[i], from->trigrams.counts[i]);
+        }
+    }
+    for (uint b = 0; b < STATS_BUCKETS; ++b) {
+        into->string_lengths[b] += from->string_lengths[b];
+    }
+}
+
+struct ngram_count {
+    uint key;
+    uint64_t count;
+};
+
+static bool ngram_count_greater(const ngram_count & a, const ngram_count & b) {
+    if (a.count != b.count) return a.count > b.count;
+    return a.key < b.key;
+}
+
+static void print_bucket_label(uint b) {
+    if (b <= 1) {
+        printf("%-24u", b);
+    }
+    else {
+        char label[32];
+        uint lo = 1u << (b - 1);
+        uint hi = (b == 32) ? 0xffffffff : (1u << b) - 1;
+        snprintf(label, sizeof(label), "%u-%u", lo, hi);
+        printf("%-24s", label);
+    }
+}
+
+static void print_ngrams(const escr1_opset * opset, std::vector<ngram_count> * grams, uint n, uint64_t total) {
+    uint shown = std::min((uint)grams->size(), STATS_TOP);
+    std::partial_sort(grams->begin(), grams->begin() + shown, grams->end(), ngram_count_greater);
+    for (uint i = 0; i < shown; ++i) {
+        ngram_count * g = &(*grams)[i];
+        printf("%12llu  %6.2f%%  ", (unsigned long long)g->count, total ? 100.0 * g->count / total : 0.0);
+        for (uint k = n; k-- > 0; ) {
+            printf(" %s", opset->names[(g->key >> (8 * k)) & 0xff]);
+        }
+        printf("\n");
+    }
+}
+
+void print_stats(op_stats * st, const escr1_opset * opset) {
+    printf("files         %llu\n", (unsigned long long)st->files);
+    printf("instructions  %llu\n", (unsigned long long)st->instructions);
+    printf("strings       %llu\n", (unsigned long long)st->strings);
+
+    printf("\n# opcodes\n");
+    for (uint op = 0; op < 256; ++op) {
+        if (st->ops[op]) {
+            printf("%02x  %-20s  %12llu  %6.2f%%\n", op, opset->names[op], (unsigned long long)st->ops[op],
+                   100.0 * st->ops[op] / st->instructions);
+        }
+    }
+
+    std::vector<ngram_count> grams;
+    for (uint i = 0; i < 256 * 256; ++i) {
+        if (st->bigrams[i]) {
+            ngram_count g = { i, st->bigrams[i] };
+            grams.push_back(g);
+        }
+    }
+    printf("\n# bigrams (top %u of %u)\n", std::min((uint)grams.size(), STATS_TOP), (uint)grams.size());
+    print_ngrams(opset, &grams, 2, st->instructions);
+
+    grams.clear();
+    for (uint i = 0; i < st->trigrams.capacity; ++i) {
+        if (st->trigrams.keys[i] != 0xffffffff) {
+            ngram_count g = { st->trigrams.keys[i], st->trigrams.counts[i] };
+            grams.push_back(g);
+        }
+    }
+    printf("\n# trigrams (top %u of %u)\n", std::min((uint)grams.size(), STATS_TOP), (uint)grams.size());
+    print_ngrams(opset, &grams, 3, st->instructions);
+
+    printf("\n# params\n");
+    for (uint op = 0; op < 256; ++op) {
+        if (!st->ops[op] || !opset->has_param[op]) {
+            continue;
+        }
+        printf("%s\n", opset->names[op]);
+        for (uint b = 0; b < STATS_BUCKETS; ++b) {
+            if (st->params[op][b]) {
+                printf("    ");
+                print_bucket_label(b);
+                printf("%12llu\n", (unsigned long long)st->params[op][b]);
+            }
+        }
+    }
+
+    printf("\n# string lengths (bytes)\n");
+    for (uint b = 0; b < STATS_BUCKETS; ++b) {
+        if (st->string_lengths[b]) {
+            printf("    ");
+            print_bucket_label(b);
+            printf("%12llu\n", (unsigned long long)st->string_lengths[b]);
+        }
+    }
+}
+
+void build_stats(char ** filenames, const opcode_profile ** file_profiles, uint file_count, uint jobs, op_stats * out) {
+    uint threads = std::max(1u, std::min(jobs, file_count));
+    std::vector<op_stats *> per_thread(threads);
+    for (uint t = 0; t < threads; ++t) {
+        per_thread[t] = (op_stats *)malloc(sizeof(op_stats));
+        init_stats(per_thread[t]);
+    }
+
+    read_batch reader;
+    read_batch_start(&reader, filenames, file_count, io_depth);
+    parallel_for(file_count, threads, [&](uint i, uint t) {
+        input_data in;
+        read_batch_take(&reader, i, &in);
+        script_analysis a;
+        analyze_input(filenames[i], &in, file_profiles[i], i, &a);
+        collect_stats(per_thread[t], &a.script, a.opset, &a.table);
+        release_analysis(&a);
+    });
+    read_batch_stop(&reader);
+
+    init_stats(out);
+    for (uint t = 0; t < threads; ++t) {
+        merge_stats(out, per_thread[t]);
+        free_stats(per_thread[t]);
+        free(per_thread[t]);
+    }
+}
+
+// STRUCTURAL DIFF
+//
+// --diff OLD NEW compares two versions of a script, or of a corpus when OLD and NEW are
+// archives, whose members are paired by name.  Diffing listings doesn't work well: one
+// inserted instruction shifts every offset after it, and every jump target and string id
+// with it.  Instead each script is cut into basic blocks -- at branch targets, after
+// control flow, and at every ROP_FILELINE -- and each instruction is hashed in a form
+// that doesn't depend on where it sits:
+//
+// - ROP_STR hashes the string's text rather than its id.
+// - ROP_JUMP, ROP_JUMPZ and ROP_CALL hash the contents of the block they go to rather
+//   than its offset.
+// - ROP_FILELINE hashes the op alone.  Its param moves with every source edit above it,
+//   so it serves only as an anchor, and to label hunks.
+//
+// Blocks are aligned by hash with patience diff: blocks that occur exactly once on each
+// side anchor the alignment, in order, and the stretches between anchors are aligned the
+// same way.  Matched blocks are skipped without looking inside them; only the unmatched
+// stretches are aligned again instruction by instruction.  Files whose contents are
+// identical are skipped before decoding.  Each run of changed instructions is one hunk:
+//
+//   --- old.pak:a.bin
+//   +++ new.pak:a.bin
+//   @@ -00000120 +00000124 @@ fileline 00010023
+//   -00000120:	push                	00000003
+//   +00000124:	push                	00000004
+
+typedef std::pair<uint, uint> diff_match;   // (old index, new index)
+
+// Longest chain of matches increasing on both sides, from matches sorted by new index.
+static void diff_lis(const std::vector<diff_match> & in, std::vector<diff_match> * out) {
+    std::vector<uint> tails;    // tails[k]: smallest last element of a chain of length k + 1
+    std::vector<uint> prev(in.size());
+    for (uint i = 0; i < in.size(); ++i) {
+        uint lo = 0, hi = (uint)tails.size();
+        while (lo < hi) {
+            uint mid = (lo + hi) / 2;
+            if (in[tails[mid]].first < in[i].first) lo = mid + 1;
+            else hi = mid;
+        }
+        prev[i] = lo ? tails[lo - 1] : 0;
+        if (lo == tails.size()) tails.push_back(i);
+        else tails[lo] = i;
+    }
+    out->resize(tails.size());
+    uint k = tails.empty() ? 0 : tails.back();
+    for (uint n = (uint)tails.size(); n-- > 0; ) {
+        (*out)[n] = in[k];
+        k = prev[k];
+    }
+}
+
+// Appends the matches between a[a0, a1) and b[b0, b1), in order.
+static void diff_align(const uint64_t * a, uint a0, uint a1, const uint64_t * b, uint b0, uint b1, std::vector<diff_match> * out) {
+    while (a0 < a1 && b0 < b1 && a[a0] == b[b0]) {
+        out->push_back(diff_match(a0++, b0++));
+    }
+    uint suffix = 0;
+    while (a1 > a0 && b1 > b0 && a[a1 - 1] == b[b1 - 1]) {
+        a1--;
+        b1--;
+        suffix++;
+    }
+
+    if (a0 < a1 && b0 < b1) {
+        struct occurrences {
+            uint a_count, a_index, b_count;
+        };
+        std::unordered_map<uint64_t, occurrences> seen;
+        for (uint i = a0; i < a1; ++i) {
+            occurrences & o = seen[a[i]];
+            o.a_count++;
+            o.a_index = i;
+        }
+        for (uint j = b0; j < b1; ++j) {
+            std::unordered_map<uint64_t, occurrences>::iterator it = seen.find(b[j]);
+            if (it != seen.end()) it->second.b_count++;
+        }
+        std::vector<diff_match> unique;
+        for (uint j = b0; j < b1; ++j) {
+            std::unordered_map<uint64_t, occurrences>::iterator it = seen.find(b[j]);
+            if (it != seen.end() && it->second.a_count == 1 && it->second.b_count == 1) {
+                unique.push_back(diff_match(it->second.a_index, j));
+            }
+        }
+
+        std::vector<diff_match> anchors;
+        diff_lis(unique, &anchors);
+        if (!anchors.empty()) {
+            for (uint k = 0; k < anchors.size(); ++k) {
+                diff_align(a, a0, anchors[k].first, b, b0, anchors[k].second, out);
+                out->push_back(anchors[k]);
+                a0 = anchors[k].first + 1;
+                b0 = anchors[k].second + 1;
+            }
+            diff_align(a, a0, a1, b, b0, b1, out);
+        }
+    }
+
+    for (uint k = 0; k < suffix; ++k) {
+        out->push_back(diff_match(a1 + k, b1 + k));
+    }
+}
+
+struct diff_script {
+    script_analysis a;
+    std::vector<uint> block_start;      // First instruction of each block, then op count
+    std::vector<uint> block_line;       // ROP_FILELINE param in effect at each block
+    std::vector<uint64_t> op_hash;
+    std::vector<uint64_t> block_hash;
+};
+
+static const uint DIFF_NO_LINE = 0xffffffff;
+
+// Index of the instruction at offset, or the op count if none starts there.
+static uint diff_find_op(const opcode_table * t, uint offset) {
+    const uint * it = std::lower_bound(t->offsets, t->offsets + t->count, offset);
+    return (it != t->offsets + t->count && *it == offset) ? (uint)(it - t->offsets) : t->count;
+}
+
+static uint diff_block_of(const diff_script * d, uint op_index) {
+    return (uint)(std::upper_bound(d->block_start.begin(), d->block_start.end() - 1, op_index) - d->block_start.begin()) - 1;
+}
+
+// Splits the script into blocks and computes the position independent hashes.  Branch
+// targets are left out here; they're compared once the blocks are aligned.
+static void diff_index(diff_script * d) {
+    const opcode_table * t = &d->a.table;
+    const escr1_opset * opset = d->a.opset;
+    uint n = t->count;
+
+    std::vector<uchar> leader(n + 1, 0);
+    leader[0] = 1;
+    for (uint i = 0; i < n; ++i) {
+        uint op = t->ops[i];
+        if (is_branch_op(op)) {
+            leader[diff_find_op(t, t->params[i])] = 1;
+            leader[i + 1] = 1;
+        }
+        else if (op == ROP_RET || op == ROP_END) {
+            leader[i + 1] = 1;
+        }
+        else if (op == ROP_FILELINE) {
+            leader[i] = 1;
+        }
+    }
+    uint line = DIFF_NO_LINE;
+    for (uint i = 0; i < n; ++i) {
+        if (leader[i]) {
+            if (t->ops[i] == ROP_FILELINE) line = t->params[i];
+            d->block_start.push_back(i);
+            d->block_line.push_back(line);
+        }
+    }
+    d->block_start.push_back(n);
+
+    d->op_hash.resize(n);
+    for (uint i = 0; i < n; ++i) {
+        uint op = t->ops[i];
+        uint64_t param = opset->has_param[op] ? t->params[i] : 0;
+        if (op == ROP_STR) {
+            // Missing and empty strings both fail the lookup, and both print as nothing.
+            const char * str = "";
+            escr1_lookup_string(&d->a.script, t->params[i], &str);
+            param = hash64((const uchar *)str, strlen(str), 0);
+        }
+        else if (op == ROP_FILELINE || is_branch_op(op)) {
+            param = 0;
+        }
+        d->op_hash[i] = xxh_round(op, param);
+    }
+
+    d->block_hash.resize(d->block_start.size() - 1);
+    for (uint k = 0; k + 1 < d->block_start.size(); ++k) {
+        uint64_t h = 0;
+        for (uint i = d->block_start[k]; i < d->block_start[k + 1]; ++i) {
+            h = xxh_round(h, d->op_hash[i]);
+        }
+        d->block_hash[k] = h;
+    }
+}
+
+static const uint DIFF_UNMATCHED = 0xffffffff;
+
+// Where branch i goes, as a block of the new version.  to_new maps old blocks to their
+// match; NULL for branches in the new version itself.
+static uint64_t diff_target(const diff_script * d, uint i, const std::vector<uint> * to_new) {
+    uint target = diff_find_op(&d->a.table, d->a.table.params[i]);
+    if (target >= d->a.table.count) {
+        return 2ULL << 32;      // Not an instruction boundary
+    }
+    uint k = diff_block_of(d, target);
+    if (to_new == NULL) {
+        return k;
+    }
+    return (*to_new)[k] != DIFF_UNMATCHED ? (*to_new)[k] : (1ULL << 32) | k;
+}
+
+struct diff_output {
+    listing_writer * w;
+    const char * old_name;
+    const char * new_name;
+    uint hunks;
+};
+
+static void diff_print_ops(listing_writer * w, char sign, diff_script * d, uint i0, uint i1) {
+    w->scratch = &d->a.mem;
+    for (uint i = i0; i < i1; ++i) {
+        opcode op;
+        op.offset = d->a.table.offsets[i];
+        op.op = d->a.table.ops[i];
+        op.param = d->a.table.params[i];
+        writer_raw(w, &sign, 1);
+        print_opcode(w, d->a.opset, &d->a.script, &op, NULL);
+    }
+}
+
+static void diff_print_hunk(diff_output * out, diff_script * a, uint a0, uint a1, diff_script * b, uint b0, uint b1) {
+    listing_writer * w = out->w;
+    if (out->hunks++ == 0) {
+        writer_printf(w, "--- %s\n+++ %s\n", out->old_name, out->new_name);
+    }
+    uint old_offset = a0 < a->a.table.count ? a->a.table.offsets[a0] : a->a.script.code_size;
+    uint new_offset = b0 < b->a.table.count ? b->a.table.offsets[b0] : b->a.script.code_size;
+    writer_printf(w, "@@ -%08x +%08x @@", old_offset, new_offset);
+    // Label with the line in effect where the hunk starts in the new version.
+    uint line = b0 < b->a.table.count ? b->block_line[diff_block_of(b, b0)] :
+                b->block_line.empty() ? DIFF_NO_LINE : b->block_line.back();
+    if (line != DIFF_NO_LINE) {
+        writer_printf(w, " fileline %08x", line);
+    }
+    writer_raw(w, "\n", 1);
+    diff_print_ops(w, '-', a, a0, a1);
+    diff_print_ops(w, '+', b, b0, b1);
+}
+
+// Instruction-level diff of a stretch of unmatched blocks.
+static void diff_ops(diff_output * out, diff_script * a, uint a0, uint a1, diff_script * b, uint b0, uint b1) {
+    std::vector<diff_match> matches;
+    diff_align(a->op_hash.data(), a0, a1, b->op_hash.data(), b0, b1, &matches);
+    matches.push_back(diff_match(a1, b1));
+    for (uint k = 0; k < matches.size(); ++k) {
+        if (matches[k].first > a0 || matches[k].second > b0) {
+            diff_print_hunk(out, a, a0, matches[k].first, b, b0, matches[k].second);
+        }
+        a0 = matches[k].first + 1;
+        b0 = matches[k].second + 1;
+    }
+}
+
+// Returns the number of hunks.
+uint diff_scripts(diff_output * out, diff_script * a, diff_script * b) {
+    uint na = (uint)a->block_hash.size();
+    uint nb = (uint)b->block_hash.size();
+    std::vector<diff_match> aligned;
+    diff_align(a->block_hash.data(), 0, na, b->block_hash.data(), 0, nb, &aligned);
+
+    // Branches match when they go to corresponding blocks: blocks aligned with each other,
+    // or failing that, at the same place in the same gap between aligned blocks (a block
+    // edited in place).  Aligned blocks with a branch that doesn't match are changed after all.
+    std::vector<uint> to_new(na, DIFF_UNMATCHED);
+    uint pa = 0, pb = 0;
+    for (uint k = 0; k <= aligned.size(); ++k) {
+        diff_match m = k < aligned.size() ? aligned[k] : diff_match(na, nb);
+        for (uint t = 0; pa + t < m.first && pb + t < m.second; ++t) {
+            to_new[pa + t] = pb + t;
+        }
+        if (k < aligned.size()) to_new[m.first] = m.second;
+        pa = m.first + 1;
+        pb = m.second + 1;
+    }
+    std::vector<diff_match> blocks;
+    for (uint k = 0; k < aligned.size(); ++k) {
+        uint i = a->block_start[aligned[k].first];
+        uint j = b->block_start[aligned[k].second];
+        bool same = true;
+        for (; i < a->block_start[aligned[k].first + 1]; ++i, ++j) {
+            if (is_branch_op(a->a.table.ops[i]) && diff_target(a, i, &to_new) != diff_target(b, j, NULL)) {
+                same = false;
+            }
+        }
+        if (same) blocks.push_back(aligned[k]);
+    }
+    for (uint i = 0; i < a->a.table.count; ++i) {
+        if (is_branch_op(a->a.table.ops[i])) a->op_hash[i] = xxh_round(a->a.table.ops[i], diff_target(a, i, &to_new));
+    }
+    for (uint j = 0; j < b->a.table.count; ++j) {
+        if (is_branch_op(b->a.table.ops[j])) b->op_hash[j] = xxh_round(b->a.table.ops[j], diff_target(b, j, NULL));
+    }
+
+    blocks.push_back(diff_match(na, nb));
+    pa = 0;
+    pb = 0;
+    for (uint k = 0; k < blocks.size(); ++k) {
+        if (blocks[k].first > pa || blocks[k].second > pb) {
+            diff_ops(out, a, a->block_start[pa], a->block_start[blocks[k].first],
+                     b, b->block_start[pb], b->block_start[blocks[k].second]);
+        }
+        pa = blocks[k].first + 1;
+        pb = blocks[k].second + 1;
+    }
+    return out->hunks;
+}
+
+enum {
+    DIFF_UNCHANGED = 0,     // Identical contents
+    DIFF_EQUIVALENT,        // Differs only in offsets, string ids or lines
+    DIFF_CHANGED,
+    DIFF_ADDED,
+    DIFF_REMOVED,
+    DIFF_RESULT_COUNT
+};
+
+// Member names of an archive with the "ARCHIVE:" prefix dropped, so versions pair up.
+static void diff_inputs(const char * path, std::vector<char *> * names, std::vector<std::string> * keys) {
+    if (is_archive(path)) {
+        open_archive(path, names);
+        for (uint i = 0; i < names->size(); ++i) {
+            keys->push_back((*names)[i] + strlen(path) + 1);
+        }
+    }
+    else {
+        names->push_back((char *)path);
+        keys->push_back(path);
+    }
+}
+
+void diff_corpus(const char * old_path, const char * new_path, const opcode_profile * profile, uint jobs, output_stream * stream) {
+    std::vector<char *> old_names, new_names;
+    std::vector<std::string> old_keys, new_keys;
+    bool single = !is_archive(old_path);
+    if (is_archive(new_path) == single) {
+        fprintf(stderr, "--diff needs two scripts or two archives\n");
+        exit(1);
+    }
+    diff_inputs(old_path, &old_names, &old_keys);
+    diff_inputs(new_path, &new_names, &new_keys);
+
+    // Pairs as (old, new) names, in new order; added and removed files are listed after.
+    std::vector<char *> pairs;
+    std::vector<char *> added, removed;
+    std::map<std::string, uint> old_index;
+    for (uint i = 0; i < old_keys.size(); ++i) {
+        old_index[old_keys[i]] = i;
+    }
+    std::vector<uchar> old_paired(old_names.size(), single ? 1 : 0);
+    if (single) {
+        pairs.push_back(old_names[0]);
+        pairs.push_back(new_names[0]);
+    }
+    else {
+        for (uint i = 0; i < new_keys.size(); ++i) {
+            std::map<std::string, uint>::iterator it = old_index.find(new_keys[i]);
+            if (it == old_index.end()) {
+                added.push_back(new_names[i]);
+            }
+            else {
+                old_paired[it->second] = 1;
+                pairs.push_back(old_names[it->second]);
+                pairs.push_back(new_names[i]);
+            }
+        }
+    }
+    for (uint i = 0; i < old_names.size(); ++i) {
+        if (!old_paired[i]) removed.push_back(old_names[i]);
+    }
+
+    uint pair_count = (uint)pairs.size() / 2;
+    uint threads = std::max(1u, std::min(jobs, pair_count));
+    std::vector<std::vector<char> > text(pair_count);
+    std::vector<uchar> result(pair_count);
+
+    read_batch reader;
+    read_batch_start(&reader, pairs.empty() ? NULL : &pairs[0], (uint)pairs.size(), io_depth);
+    parallel_for(pair_count, threads, [&](uint i, uint) {
+        input_data in[2];
+        read_batch_take(&reader, 2 * i, &in[0]);
+        read_batch_take(&reader, 2 * i + 1, &in[1]);
+        if (in[0].size == in[1].size && hash64(in[0].data, in[0].size, 0) == hash64(in[1].data, in[1].size, 0)) {
+            arena_reset(&in[0].mem);
+            arena_reset(&in[1].mem);
+            result[i] = DIFF_UNCHANGED;
+            return;
+        }
+
+        diff_script d[2];
+        for (uint s = 0; s < 2; ++s) {
+            analyze_input(pairs[2 * i + s], &in[s], profile, i, &d[s].a);
+            perf_scope timer(PERF_ANALYZE);
+            diff_index(&d[s]);
+        }
+        static thread_local listing_writer w;
+        writer_init(&w, NULL, &text[i]);
+        diff_output out;
+        out.w = &w;
+        out.old_name = pairs[2 * i];
+        out.new_name = pairs[2 * i + 1];
+        out.hunks = 0;
+        {
+            perf_scope timer(PERF_FORMAT);
+            result[i] = diff_scripts(&out, &d[0], &d[1]) ? DIFF_CHANGED : DIFF_EQUIVALENT;
+        }
+        writer_flush(&w);
+        release_analysis(&d[0].a);
+        release_analysis(&d[1].a);
+    });
+    read_batch_stop(&reader);
+
+    uint counts[DIFF_RESULT_COUNT] = { 0 };
+    for (uint i = 0; i < pair_count; ++i) {
+        counts[result[i]]++;
+        if (!text[i].empty()) output_write(stream, &text[i][0], text[i].size());
+    }
+    static listing_writer w;
+    writer_init(&w, stream, NULL);
+    for (uint i = 0; i < added.size(); ++i) {
+        writer_printf(&w, "Only in %s: %s\n", new_path, added[i] + strlen(new_path) + 1);
+    }
+    for (uint i = 0; i < removed.size(); ++i) {
+        writer_printf(&w, "Only in %s: %s\n", old_path, removed[i] + strlen(old_path) + 1);
+    }
+    writer_flush(&w);
+    counts[DIFF_ADDED] = (uint)added.size();
+    counts[DIFF_REMOVED] = (uint)removed.size();
+
+    fprintf(stderr, "%u unchanged, %u moved only, %u changed, %u added, %u removed\n",
+            counts[DIFF_UNCHANGED], counts[DIFF_EQUIVALENT], counts[DIFF_CHANGED],
+            counts[DIFF_ADDED], counts[DIFF_REMOVED]);
+}
 
-// VM is largely stack based, but also provides globally-scoped variables and flags.
+// SEEK INDEX
 //
-// Opcodes are one byte.  Parameters are 4 bytes (one uint).
-// The VM declares 33 'reserved' opcodes.  The rest (up to 255) are left open, and the
-// client code can declare an opcode by providing a function pointer.
+// Editors ask for the code around an offset, and in a big script decoding from the start
+// each time is too slow.  --seek-index N writes FILE.esi next to each input, holding the
+// script's checkpoints (see escr1_build_checkpoints): one every N instructions plus one
+// at every ROP_FILELINE.  --around OFFSET[:COUNT] uses them to print COUNT instructions
+// (16 by default) either side of the one containing OFFSET (hex).  It reads FILE.esi if
+// it matches the script, and otherwise builds the checkpoints on the spot, which costs
+// one full decode.  Archive members have no FILE.esi and always build them.
 //
-// Parameters for client-defined opcodes are pushed to the stack prior to the call.  The 
-// VM pops the params off the stack and passes them through a param array (maximum of 32 
-// params).
+// Layout (little endian):
 //
-// Several reserved opcodes (and, optionally, any user-defined opcode) take an immediate
-// param -- i.e., the next 4 byte integer in the code. 
-// UPDATE (2014-11-21):  Immediate param for user-defined opcodes is *not* a parameter for
-// the function call, but rather a parameter *count* for opcodes that can accept a variable
-// argument count.  (This doesn't effect parsing, but is important for execution.)
+// - Magic 'ESCRSI00'
+// - uint64 content hash (as for --cache: the script, seeded with the profile's param table)
+// - uint interval, uint count
+// - uint checkpoints[count], ascending
 
-// RESERVED OPCODES
-enum {
-    ROP_END = 0,
-    ROP_JUMP,       // param
-    ROP_JUMPZ,      // param
-    ROP_CALL,       // param
-    ROP_RET,
-    ROP_PUSH,       // param
-    ROP_POP,
-    ROP_STR,        // param
-    ROP_SETVAR,
-    ROP_GETVAR,
-    ROP_SETFLAG,
-    ROP_GETFLAG,
-    ROP_NEG,
-    ROP_ADD,
-    ROP_SUB,
-    ROP_MUL,
-    ROP_DIV,
-    ROP_MOD,
-    ROP_AND,
-    ROP_OR,
-    ROP_NOT,
-    ROP_SHR,
-    ROP_SHL,
-    ROP_EQ,
-    ROP_NE,
-    ROP_GT,
-    ROP_GE,
-    ROP_LT,
-    ROP_LE,
-    ROP_LNOT,
-    ROP_LAND,
-    ROP_LOR,
-    ROP_FILELINE,   // param
-
-    ROP_COUNT
-};
-
-const char * ROP_NAMES[ROP_COUNT] = {
-    "end     ",
-    "jump    ",
-    "jumpz   ",
-    "call    ",
-    "ret     ",
-    "push    ",
-    "pop     ",
-    "str     ",
-    "setvar  ",
-    "getvar  ",
-    "setflag ",
-    "getflag ",
-    "neg     ",
-    "add     ",
-    "sub     ",
-    "mul     ",
-    "div     ",
-    "mod     ",
-    "and     ",
-    "or      ",
-    "not     ",
-    "shr     ",
-    "shl     ",
-    "eq      ",
-    "ne      ",
-    "gt      ",
-    "ge      ",
-    "lt      ",
-    "le      ",
-    "lnot    ",
-    "land    ",
-    "lor     ",
-    "fileline",
-};
-
-struct opcode {
-    uint offset;
-    uint op;
-    uint param;
-};
-
-struct usr_op {
-    const char * name;
-    int param_count;
-};
-
-// USER DEFINED OPCODES
-
-// SENSUIBU
-usr_op USR_OPS[] = {
-    { "USR_END      ", 1 },     // Ends current script, ???saves game state???
-    { "USR_JUMP     ", 1 },     // Jump into a different script
-    { "USR_CALL     ", 1 },     // Call into a different script
-    { "USR_AUTOPLAY ", 1 },     // Enable/disable auto mode
-    { "USR_FRAME    ", 1 },     // Update text frame (?what does this actually mean?)
-    { "USR_TEXT     ", 2 },     // Show or hide text frame, with optional time
-    { "USR_CLEAR    ", 1 },     // Clear message window
-    { "USR_GAP      ", 2 },     // Message windo whitespace??
-    { "USR_MES      ", 1 },     // Display text/name in message window.
-    { "USR_TLK      ", -1 },    // Sets character name/face in message window, setup for voice playback??
-    { "USR_MENU     ", 3 },     // Sets a menu option.  Params: menu id, option string, option enabled flag
-    { "USR_SELECT   ", 1 },     // Runs the actual selection task for a menu.
-    { "USR_LSF_INIT ", 1 },     // Initialize a sprite layer
-    { "USR_LSF_SET  ", -1 },    // Set flags for sprite layer (??)
-    { "USR_CG       ", -1 },    // Set up CG (sprites *AND* BG/EV)
-    { "USR_EM       ", 5 },     // Set character sprite expression (?)
-    { "USR_CLR      ", 1 },     // Clear flagged sprite layer(s)
-    { "USR_DISP     ", 3 },     // Screen transition
-    { "USR_PATH     ", -1 },    // Sets up interpolation for sprites (???)
-    { "USR_TRANS    ", 0 },     // Fade out layer (?)  TRANSITION, duh.
-    { "USR_BGMPLAY  ", 3 },     // Start BGM.  Params: id, fade time (for previous BGM?), start time
-    { "USR_BGMSTOP  ", 1 },     // Stop BGM.  Param: fade time
-    { "USR_BGMVOLUME", 2 },     // Set BGM volume, with optional fade
-    { "USR_BGMFX    ", 1 },     // Apply effect to BGM
-    { "USR_AMBPLAY  ", 3 },     //
-    { "USR_AMBSTOP  ", 1 },
-    { "USR_AMBVOLUME", 2 },
-    { "USR_AMBFX    ", 1 },
-    { "USR_SEPLAY   ", 5 },
-    { "USR_SESTOP   ", 2 },
-    { "USR_SEWAIT   ", 1 },
-    { "USR_SEVOLUME ", 3 },
-    { "USR_SEFX     ", 1 },
-    { "USR_VOCPLAY  ", 4 },
-    { "USR_VOCSTOP  ", 2 },
-    { "USR_VOCWAIT  ", 1 },
-    { "USR_VOCVOLUME", 3 },
-    { "USR_VOCFX    ", 1 },
-    { "USR_QUAKE    ", 4 },     // Screenshake effect
-    { "USR_FLASH    ", 2 },     // Flash effect
-    { "USR_FILTER   ", 2 },     // Image filter
-    { "USR_EFFECT   ", 1 },     // Particle effect
-    { "USR_SYNC     ", 2 },     // Wait for / cancel screen effects (disolve, quake, flash, trans).
-    { "USR_WAIT     ", 1 },     // Pause text ???
-    { "USR_MOVIE    ", 1 },     // Stop ADV mode, play movie (returns to ADV afterwards).
-    { "USR_CREDIT   ", 1 },     // Stop ADV mode, play credits
-    { "USR_EVENT    ", 1 },     // Unlock event CG
-    { "USR_SCENE    ", 1 },     // Unlock event scene
-    { "USR_TITLE    ", 1 },     // Display scene title
-    { "USR_NOTICE   ", 3 },     // Popup notices (?)
-    { "USR_SET_PASS ", 2 },     // Record progress???
-    { "USR_IS_PASS  ", 1 },
-    { "USR_AUTO_SAVE", 0 },     // Autosave
-    { "USR_PLACE    ", 1 },     // Display place name
-    { "USR_OPEN_NAME", 1 },
-    { "USR_NAME     ", 2 },
-    { "USR_DATE     ", 0 },     // Display (in-game) date
-    { "USR_HELP     ", -1 },    // Enable/disable help items
-
-    { "USR_PLATY_GAME", 1 },    // Run mini-game mode
-    { "USR_TRAINING", 0 },      // Run training mode
-    { "USR_SPECIAL_TRAINING", 0 },  // Run special training mode
-
-    { "USR_SET_GAME", 3 },
-    { "USR_WHATDAY", 0 },
-    { "USR_SET_UNIT", 4 },
-    { "USR_GET_UNIT", 3 },
-    { "USR_BTS_RESULT", 0 },
-    { "USR_GAME_SETTING", 1 },
-    { "USR_WATCH_ENEMY", 1 },
-    { "USR_RND_RT", 1 },
-};
+const uchar seek_magic[] = "ESCRSI00";
 
+struct seek_header {
+    uchar magic[8];
+    uint64_t hash;
+    uint interval;
+    uint count;
+};
 
-bool show_strings = false;
-bool htoz = false;
-opcode * opcode_list = NULL;
-uint opcode_count;
+static uint64_t seek_hash(const script_file * script, const escr1_opset * opset) {
+    return hash64(script->contents, script->file_size, hash64(opset->has_param, sizeof(opset->has_param), 0));
+}
 
-const char * missing_string = "STRING_DATA_NOT_FOUND";
+static void build_checkpoints(const script_file * script, const escr1_opset * opset, uint interval, std::vector<uint> * out) {
+    perf_scope timer(PERF_DECODE);
+    out->resize(escr1_build_checkpoints(script, opset, interval, NULL, 0));
+    escr1_build_checkpoints(script, opset, interval, out->data(), (uint)out->size());
+}
 
-bool data_lookup_string(script_file * file, uint id, char ** out) {
-    if (id >= file->index_count) {
-        fprintf(stderr, "Reference to string not in file, id: %08x\n", id);
-        *out = (char *)missing_string;
+static bool load_seek_index(const char * filename, const script_file * script, uint64_t hash, std::vector<uint> * out) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s.esi", filename);
+    mapped_file map;
+    if (!escr1_map_file(path, &map)) {
         return false;
     }
-    uint offset = file->index_ptr[id];
-
-    assert(((file->data_ptr + offset) - file->contents) < file->file_size);
-
-    char * str = (char *)(file->data_ptr + offset);
-    if (*str) {
-        *out = str;
-        return true;
-    }
-    else {
-        *out = (char *)missing_string;
-        return false;
+    const seek_header * h = (const seek_header *)map.data;
+    bool ok = map.size >= sizeof(seek_header) && !memcmp(h->magic, seek_magic, 8) && h->hash == hash &&
+              map.size == sizeof(seek_header) + (uint64_t)h->count * sizeof(uint);
+    if (ok) {
+        const uint * p = (const uint *)(h + 1);
+        for (uint i = 0; i < h->count && ok; ++i) {
+            ok = p[i] < script->code_size && (i == 0 || p[i] > p[i - 1]);
+        }
+        if (ok) out->assign(p, p + h->count);
     }
+    escr1_unmap_file(&map);
+    return ok;
 }
 
-struct htoz_table_entry {
-    uchar hankaku;
-    uchar zenkaku[2];
-};
-
-static uint htoz_table_size = 64;
-
-static htoz_table_entry htoz_table[htoz_table_size] = {
-    { 0xa0, { 0x81, 0x40 } },
-    { 0x21, { 0x81, 0x49 } },
-    { 0x3f, { 0x81, 0x48 } },
-    { 0xa5, { 0x81, 0x63 } },
-    { 0xa1, { 0x81, 0x42 } },
-    { 0xa2, { 0x81, 0x75 } },
-    { 0xa3, { 0x81, 0x76 } },
-    { 0xa4, { 0x81, 0x41 } },
-    { 0xa6, { 0x82, 0xf0 } },
-    { 0xa7, { 0x82, 0x9f } },
-    { 0xa8, { 0x82, 0xa1 } },
-    { 0xa9, { 0x82, 0xa3 } },
-    { 0xaa, { 0x82, 0xa5 } },
-    { 0xab, { 0x82, 0xa7 } },
-    { 0xac, { 0x82, 0xe1 } },
-    { 0xad, { 0x82, 0xe3 } },
-    { 0xae, { 0x82, 0xe5 } },
-    { 0xaf, { 0x82, 0xc1 } },
-    { 0xb0, { 0x81, 0x5b } },
-    { 0xb1, { 0x82, 0xa0 } },
-    { 0xb2, { 0x82, 0xa2 } },
-    { 0xb3, { 0x82, 0xa4 } },
-    { 0xb4, { 0x82, 0xa6 } },
-    { 0xb5, { 0x82, 0xa8 } },
-    { 0xb6, { 0x82, 0xa9 } },
-    { 0xb7, { 0x82, 0xab } },
-    { 0xb8, { 0x82, 0xad } },
-    { 0xb9, { 0x82, 0xaf } },
-    { 0xba, { 0x82, 0xb1 } },
-    { 0xbb, { 0x82, 0xb3 } },
-    { 0xbc, { 0x82, 0xb5 } },
-    { 0xbd, { 0x82, 0xb7 } },
-    { 0xbe, { 0x82, 0xb9 } },
-    { 0xbf, { 0x82, 0xbb } },
-    { 0xc0, { 0x82, 0xbd } },
-    { 0xc1, { 0x82, 0xbf } },
-    { 0xc2, { 0x82, 0xc2 } },
-    { 0xc3, { 0x82, 0xc4 } },
-    { 0xc4, { 0x82, 0xc6 } },
-    { 0xc5, { 0x82, 0xc8 } },
-    { 0xc6, { 0x82, 0xc9 } },
-    { 0xc7, { 0x82, 0xca } },
-    { 0xc8, { 0x82, 0xcb } },
-    { 0xc9, { 0x82, 0xcc } },
-    { 0xca, { 0x82, 0xcd } },
-    { 0xcb, { 0x82, 0xd0 } },
-    { 0xcc, { 0x82, 0xd3 } },
-    { 0xcd, { 0x82, 0xd6 } },
-    { 0xce, { 0x82, 0xd9 } },
-    { 0xcf, { 0x82, 0xdc } },
-    { 0xd0, { 0x82, 0xdd } },
-    { 0xd1, { 0x82, 0xde } },
-    { 0xd2, { 0x82, 0xdf } },
-    { 0xd3, { 0x82, 0xe0 } },
-    { 0xd4, { 0x82, 0xe2 } },
-    { 0xd5, { 0x82, 0xe4 } },
-    { 0xd6, { 0x82, 0xe6 } },
-    { 0xd7, { 0x82, 0xe7 } },
-    { 0xd8, { 0x82, 0xe8 } },
-    { 0xd9, { 0x82, 0xe9 } },
-    { 0xda, { 0x82, 0xea } },
-    { 0xdb, { 0x82, 0xeb } },
-    { 0xdc, { 0x82, 0xed } },
-    { 0xdd, { 0x82, 0xf1 } },
-};
-
-uint htoz_table_lookup(uchar hk) {
-    for (uint i = 0; i < htoz_table_size; ++i) {
-        htoz_table_entry * e = &htoz_table[i];
-        if (e->hankaku == hk) {
-            return i;
-        } 
+static bool write_seek_index(const char * filename, uint64_t hash, uint interval, const std::vector<uint> & checkpoints) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s.esi", filename);
+    FILE * fp = fopen(path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to write seek index: [%s]\n", path);
+        return false;
     }
-    return -1;
-}
-
-static bool is_half_kana(uchar c) {
-    // 0xa0 is an invalid lead byte, but is used by the engine to encode a full-width space.
-    //return c >= 0xa0 && c <= 0xdd;
-    return htoz_table_lookup(c) != -1;
+    seek_header h;
+    memcpy(h.magic, seek_magic, 8);
+    h.hash = hash;
+    h.interval = interval;
+    h.count = (uint)checkpoints.size();
+    fwrite(&h, sizeof(h), 1, fp);
+    if (!checkpoints.empty()) fwrite(&checkpoints[0], sizeof(uint), checkpoints.size(), fp);
+    bool failed = ferror(fp) != 0;
+    fclose(fp);
+    if (failed) {
+        fprintf(stderr, "Failed to write seek index: [%s]\n", path);
+        remove(path);
+    }
+    return !failed;
 }
 
-void convert_string_htoz(char ** str) {
-    uchar buffer[2048] = {0};  // We'll assume this is large enough.
-    assert(strlen(*str) < 1024);
-
-    uchar *src = (uchar *)(*str);
-    uchar *dest = &buffer[0];
-    while (*src) {
-        if ((*src >= 0x81 && *src <= 0x9f) || (*src >= 0xe0 && *src <= 0xef)) {
-            // Two byte character.
-            *dest++ = *src++;
-            *dest++ = *src++;
+void build_seek_indexes(char ** filenames, const opcode_profile ** file_profiles, uint file_count, uint interval, uint jobs) {
+    std::atomic<uint> written(0);
+    read_batch reader;
+    read_batch_start(&reader, filenames, file_count, io_depth);
+    parallel_for(file_count, std::max(1u, std::min(jobs, file_count)), [&](uint i, uint) {
+        input_data in;
+        read_batch_take(&reader, i, &in);
+        if (find_pack_entry(filenames[i])) {
+            fprintf(stderr, "Can't write a seek index for archive member [%s]\n", filenames[i]);
+            return;
         }
-        else if (*src == 0x1b) {
-            // ESC, used to excape following character.
-            src++;
-            *dest++ = *src++;
+        script_file script;
+        parse_script(filenames[i], in.data, in.size, &script);
+        const opcode_profile * profile = file_profiles[i];
+        if (profile == NULL) {
+            double score;
+            profile = detect_profile(&script, &score);
         }
-        else if (is_half_kana(*src)) {
-            uint idx = htoz_table_lookup(*src);
-            assert(idx >= 0 && idx < htoz_table_size);
-            *dest++ = htoz_table[idx].zenkaku[0];
-            *dest++ = htoz_table[idx].zenkaku[1];
-            src++;
+        std::vector<uint> checkpoints;
+        build_checkpoints(&script, &profile->opset, interval, &checkpoints);
+        if (write_seek_index(filenames[i], seek_hash(&script, &profile->opset), interval, checkpoints)) {
+            written++;
         }
-        else {
-            // Single byte character.
-            *dest++ = *src++;
+        arena_reset(&in.mem);
+    });
+    read_batch_stop(&reader);
+    fprintf(stderr, "Wrote %u seek indexes\n", written.load());
+}
+
+// Prints count instructions either side of the one containing offset.
+void print_around(listing_writer * w, char * filename, const opcode_profile * profile, uint offset, uint count) {
+    input_data in;
+    if (!input_from_archive(filename, &in) && !read_whole_file(filename, &in)) {
+        fprintf(stderr, "Failed to open file: [%s]\n", filename);
+        exit(1);
+    }
+    script_file script;
+    parse_script(filename, in.data, in.size, &script);
+    if (profile == NULL) {
+        double score;
+        profile = detect_profile(&script, &score);
+    }
+    const escr1_opset * opset = &profile->opset;
+
+    std::vector<uint> checkpoints;
+    if (find_pack_entry(filename) || !load_seek_index(filename, &script, seek_hash(&script, opset), &checkpoints)) {
+        build_checkpoints(&script, opset, 256, &checkpoints);
+    }
+
+    escr1_iterator it;
+    escr1_iter_init(&it, &script, opset);
+    if (!escr1_iter_seek(&it, checkpoints.data(), (uint)checkpoints.size(), offset)) {
+        fprintf(stderr, "No instruction at %08x in [%s]\n", offset, filename);
+        arena_reset(&in.mem);
+        return;
+    }
+    uint target = it.offset;
+
+    // Instructions before the target, from as many checkpoints back as it takes.
+    uint c = (uint)(std::upper_bound(checkpoints.begin(), checkpoints.end(), target) - checkpoints.begin());
+    std::vector<opcode> before;
+    for (;;) {
+        uint start = c ? checkpoints[c - 1] : 0;
+        before.clear();
+        it.offset = start;
+        opcode op;
+        while (it.offset < target && escr1_iter_next(&it, &op)) {
+            before.push_back(op);
         }
+        if (before.size() >= count || start == 0) break;
+        c--;
     }
-    *dest = '\0';
-    uint size = (dest - buffer);
-    assert(size > 0);
 
-    char * newstr = (char *)calloc(1, size + 1);
-    strncpy(newstr, (char *)buffer, size);
-    *str = newstr;
+    writer_printf(w, "; %s @ %08x\n", filename, target);
+    w->scratch = &in.mem;
+    for (uint i = before.size() > count ? (uint)before.size() - count : 0; i < before.size(); ++i) {
+        print_opcode(w, opset, &script, &before[i], NULL);
+    }
+    it.offset = target;
+    opcode op;
+    for (uint i = 0; i <= count && escr1_iter_next(&it, &op); ++i) {
+        print_opcode(w, opset, &script, &op, NULL);
+    }
+    writer_flush(w);
+    arena_reset(&in.mem);
 }
 
-bool opcode_has_param(uint op) {
+// SOURCE MAP
+//
+// --source-map lists, for each input, the code range each source line compiled to,
+// taken from the ROP_FILELINE marks (see escr1_build_line_map).  --resolve OFFSET,...
+// looks up offsets instead, e.g. the PCs in an engine crash log, with a binary search
+// each.  Both print text, or NDJSON with --json:
+//
+//   00000120-00000164	3:41       {"file":"a.bin","start":288,"end":356,"source":3,"line":41}
+//   a.bin	00000130	3:41       {"file":"a.bin","offset":304,"source":3,"line":41}
+//
+// An offset before the first mark, or outside the code block, resolves to "?" (null
+// source and line in JSON).
+//
+// How file and line are packed into the param varies by title.  --fileline low:N puts
+// the file number in the low N bits and the line above them; high:N, in the high N bits.
+// By default the whole param is the line, in file 0.
+
+escr1_fileline_format fileline_format = { 0, false };
 
-    // Reserved opcodes
-    if (op < ROP_COUNT) {
-        return op == ROP_JUMP  ||
-               op == ROP_JUMPZ ||
-               op == ROP_CALL  ||
-               op == ROP_PUSH  ||
-               op == ROP_STR   ||
-               op == ROP_FILELINE;
+static void print_source_range(listing_writer * w, const char * name, uint start, uint end, uint param) {
+    uint file, line;
+    escr1_split_fileline(&fileline_format, param, &file, &line);
+    if (json) {
+        JSON_LIT(w, "{\"file\":");
+        json_bytes(w, name);
+        JSON_LIT(w, ",\"start\":");
+        json_uint(w, start);
+        JSON_LIT(w, ",\"end\":");
+        json_uint(w, end);
+        JSON_LIT(w, ",\"source\":");
+        json_uint(w, file);
+        JSON_LIT(w, ",\"line\":");
+        json_uint(w, line);
+        JSON_LIT(w, "}\n");
     }
     else {
-        // User opcodes take an immediate param if param_count is negative.
-        return USR_OPS[op - ROP_COUNT].param_count < 0;
+        writer_printf(w, "%08x-%08x\t%u:%u\n", start, end, file, line);
     }
 }
 
-int next_opcode(script_file * file, uint offset, opcode * op) {
-    if (offset >= file->code_size) {
-        return -1;
+static void print_resolved(listing_writer * w, const char * name, uint offset, const escr1_line_range * range) {
+    if (json) {
+        JSON_LIT(w, "{\"file\":");
+        json_bytes(w, name);
+        JSON_LIT(w, ",\"offset\":");
+        json_uint(w, offset);
+        if (range) {
+            uint file, line;
+            escr1_split_fileline(&fileline_format, range->param, &file, &line);
+            JSON_LIT(w, ",\"source\":");
+            json_uint(w, file);
+            JSON_LIT(w, ",\"line\":");
+            json_uint(w, line);
+            JSON_LIT(w, "}\n");
+        }
+        else {
+            JSON_LIT(w, ",\"source\":null,\"line\":null}\n");
+        }
     }
+    else if (range) {
+        uint file, line;
+        escr1_split_fileline(&fileline_format, range->param, &file, &line);
+        writer_printf(w, "%s\t%08x\t%u:%u\n", name, offset, file, line);
+    }
+    else {
+        writer_printf(w, "%s\t%08x\t?\n", name, offset);
+    }
+}
 
-    uint bytes_read = 0;
-    opcode opc;
-    opc.offset = offset;
-    opc.op = (uint)file->code_ptr[offset];
-    bytes_read++;
-    if (opcode_has_param(opc.op)) {
-        if (offset + bytes_read >= file->code_size) {
-            return -1;
+// Prints the source map of every input, or with offsets, resolves them in every input.
+void print_source_maps(char ** filenames, const opcode_profile ** file_profiles, uint file_count, const std::vector<uint> * offsets, uint jobs, output_stream * out) {
+    std::vector<std::vector<char> > text(file_count);
+    read_batch reader;
+    read_batch_start(&reader, filenames, file_count, io_depth);
+    parallel_for(file_count, std::max(1u, std::min(jobs, file_count)), [&](uint i, uint) {
+        input_data in;
+        read_batch_take(&reader, i, &in);
+        script_file script;
+        parse_script(filenames[i], in.data, in.size, &script);
+        const opcode_profile * profile = file_profiles[i];
+        if (profile == NULL) {
+            double score;
+            profile = detect_profile(&script, &score);
         }
 
-        uchar * param_ptr = file->code_ptr + (offset + bytes_read);
-        opc.param = *((uint *)param_ptr);
-        bytes_read += sizeof(uint);
-    }
-    else {
-        opc.param = -1;
+        std::vector<escr1_line_range> ranges;
+        {
+            perf_scope timer(PERF_DECODE);
+            ranges.resize(escr1_build_line_map(&script, &profile->opset, NULL, 0));
+            escr1_build_line_map(&script, &profile->opset, ranges.data(), (uint)ranges.size());
+        }
+
+        perf_scope timer(PERF_FORMAT);
+        static thread_local listing_writer w;
+        writer_init(&w, NULL, &text[i]);
+        if (offsets) {
+            for (uint k = 0; k < offsets->size(); ++k) {
+                uint offset = (*offsets)[k];
+                const escr1_line_range * range = offset < script.code_size ?
+                    escr1_find_line(ranges.data(), (uint)ranges.size(), offset) : NULL;
+                print_resolved(&w, filenames[i], offset, range);
+            }
+        }
+        else {
+            if (file_count > 1 && !json) {
+                writer_printf(&w, "; %s\n", filenames[i]);
+            }
+            for (uint k = 0; k < ranges.size(); ++k) {
+                uint end = k + 1 < ranges.size() ? ranges[k + 1].offset : script.code_size;
+                print_source_range(&w, filenames[i], ranges[k].offset, end, ranges[k].param);
+            }
+        }
+        writer_flush(&w);
+        arena_reset(&in.mem);
+    });
+    read_batch_stop(&reader);
+
+    for (uint i = 0; i < file_count; ++i) {
+        if (!text[i].empty()) output_write(out, &text[i][0], text[i].size());
     }
+}
+
+// LISTING PIPELINE
+//
+// The listing over input files runs as a pipeline, so reading, decoding, formatting and
+// writing overlap and throughput is set by the slowest stage rather than their sum:
+//
+//   read_batch -> decoders (jobs) -> [decoded] -> formatters (jobs) -> [formatted] -> writer
+//
+// The queues between stages are bounded lock-free MPMC queues.  Decoders take inputs in
+// order and hand them on in order, though they finish out of order; a decoder won't start
+// input i until input i - window has been written, so at most `window` scripts are loaded
+// at once and [decoded] can never fill.
+//
+// Formatters stream each listing to the writer (the calling thread) as chunks of one
+// listing_writer buffer.  The writer writes the chunks of the input at the head of the
+// order as they come, and holds the others until it gets to them.  Chunks come from a
+// pool of a fixed byte budget, so a big listing formatted out of turn waits for room
+// instead of piling up in memory.  The head input can always take a new chunk: it goes
+// straight out, so it can't hold the pool up, and formatters take inputs in order, so the
+// head is never stuck behind them.
+//
+// A bad input doesn't exit from a worker.  Its error travels with it, and the writer
+// stops there: everything before it is written, nothing after it, whatever --jobs is.
+
+static const uint PIPELINE_CHUNKS_PER_JOB = 64;     // 4MB of listing text
+
+struct listing_item;
+
+// Part of one input's listing, on its way from a formatter to the writer.
+struct listing_chunk {
+    listing_item * item;
+    listing_chunk * next;       // While the writer holds it
+    uint len;
+    bool last;                  // The item's final chunk
+    char data[WRITER_BUF];
+};
+
+// One input, from decoding until its last chunk is written.
+struct listing_item {
+    uint index;
+    const opcode_profile * profile;
+    script_analysis a;
+    bool analyzed;              // Otherwise skipped: an earlier input failed
+    std::string error;          // Set if the input couldn't be read or decoded
+};
 
-    *op = opc;
+struct listing_pipeline {
+    mpmc_queue<listing_item *> decoded;
+    mpmc_queue<listing_chunk *> formatted;
+    mpmc_queue<listing_chunk *> free_chunks;
+    std::atomic<uint> chunks;           // Allocated into the pool so far
+    uint max_chunks;
+    std::atomic<uint> written;          // Items written; the head item's index
+    std::atomic<bool> failed;           // The writer reached a failed item
+};
 
-    return bytes_read;
+// The head item can always have a chunk: it's written right away, so it can't hold the
+// pool up.  Others wait for room in the budget.
+static listing_chunk * pipeline_take_chunk(listing_pipeline * p, listing_item * item) {
+    listing_chunk * c;
+    uint spins = 0;
+    while (!queue_try_pop(&p->free_chunks, &c)) {
+        if (p->chunks.load(std::memory_order_relaxed) < p->max_chunks || item->index == p->written.load(std::memory_order_acquire)) {
+            p->chunks++;
+            c = new listing_chunk;
+            break;
+        }
+        pipeline_backoff(&spins);
+    }
+    c->item = item;
+    c->next = NULL;
+    c->len = 0;
+    c->last = false;
+    return c;
 }
 
-const char * opcode_string(uint op) {
-    if (op >= ROP_COUNT) {
-        uint uop = op - ROP_COUNT;
-        return USR_OPS[uop].name;
+// Chunks the head took past the budget are freed as they come back.
+static void pipeline_return_chunk(listing_pipeline * p, listing_chunk * c) {
+    if (p->chunks.load(std::memory_order_relaxed) > p->max_chunks || !queue_try_push(&p->free_chunks, c)) {
+        p->chunks--;
+        delete c;
     }
-    return ROP_NAMES[op];
 }
 
-void print_opcode(script_file * file, opcode * op) {
-    if (opcode_has_param(op->op)) { 
-        printf("%08x:\t%-20s\t%08x\n", op->offset, opcode_string(op->op), op->param);
+// listing_writer::hand_off for formatters: sends the full buffer's chunk and starts the
+// writer on a new one.
+static void pipeline_hand_off(listing_writer * w) {
+    listing_pipeline * p = (listing_pipeline *)w->owner;
+    listing_chunk * c = (listing_chunk *)(w->buf - offsetof(listing_chunk, data));
+    c->len = w->len;
+    listing_chunk * next = pipeline_take_chunk(p, c->item);
+    queue_push(&p->formatted, c);
+    w->buf = next->data;
+}
 
-        if (show_strings && op->op == ROP_STR) {
-            char * str = NULL;
-            if (data_lookup_string(file, op->param, &str)) {
-                if (htoz) convert_string_htoz(&str);
-                printf("\t\t%s\n\n", str);
-                if (htoz) free(str);
-            }
-        }
+// Formats one script's listing, with the "; name" header the text format puts between
+// multiple inputs.
+void format_listing(listing_writer * w, const char * name, bool multiple, const escr1_opset * opset, script_file * script, opcode_table * table) {
+    if (json) {
+        print_opcodes_json(w, name, opset, script, table);
     }
     else {
-        printf("%08x:\t%s\n", op->offset, opcode_string(op->op));
+        if (multiple) {
+            writer_printf(w, "; %s\n", name);
+        }
+        print_opcodes(w, opset, script, table);
     }
-} 
+}
 
-void parse_opcodes(script_file * file) {
-    uint code_size = file->code_size;
-    assert(code_size > 0);
+// Writes out what the listing pipeline has formatted, in input order.  Returns false if it
+// stopped at an input that failed.
+static bool pipeline_write(listing_pipeline * p, char ** filenames, const opcode_profile ** file_profiles, uint file_count, uint window, output_stream * out) {
+    // Chunks of item i wait in held[i % window] until everything before it is out.
+    std::vector<listing_chunk *> held(window, (listing_chunk *)NULL);
+    std::vector<listing_chunk *> held_tail(window, (listing_chunk *)NULL);
+    bool failed = false;
 
-    uint current_offset = 0;
-    while (current_offset < code_size) {
-        opcode op;
-        int bytes_read = next_opcode(file, current_offset, &op);
-        if (bytes_read < 0) {
-            fprintf(stderr, "Unexpected end of code block.  Size: %d; Current Offset: %d\n", code_size, current_offset);
-            break;
+    for (uint next = 0; next < file_count; ) {
+        listing_chunk * c = queue_pop(&p->formatted);
+        if (c->item->index != next) {
+            uint slot = c->item->index % window;
+            if (held[slot]) held_tail[slot]->next = c;
+            else held[slot] = c;
+            held_tail[slot] = c;
+            continue;
         }
 
-        print_opcode(file, &op);
-        current_offset += bytes_read;
+        // Write c, and each time an item ends, whatever is held for the one after it.
+        while (c) {
+            listing_chunk * after = c->next;
+            listing_item * item = c->item;
+            if (c->len && !failed) {
+                output_write(out, c->data, c->len);
+            }
+            bool last = c->last;
+            pipeline_return_chunk(p, c);
+            c = after;
+            if (!last) {
+                continue;
+            }
+
+            if (!failed && !item->error.empty()) {
+                fprintf(stderr, "%s\n", item->error.c_str());
+                failed = true;
+                p->failed.store(true, std::memory_order_release);
+            }
+            if (!failed && file_profiles[next] == NULL) {
+                fprintf(stderr, "Using profile [%s] for [%s]\n", item->profile->name, filenames[next]);
+            }
+            delete item;
+            next++;
+            p->written.store(next, std::memory_order_release);
+
+            if (next < file_count) {
+                c = held[next % window];
+                held[next % window] = NULL;
+            }
+        }
     }
+    return !failed;
 }
 
-int load_file(char * filename, uchar ** data) {
-    FILE * fp = fopen(filename, "rb");
-    if (fp == NULL) {
-        fprintf(stderr, "Failed to open file: [%s]\n", filename);
-        exit(1);
-    }
+// Lists every input through the pipeline.  Returns false if an input couldn't be read or
+// decoded; the listing stops at it.
+bool print_listing_pipeline(char ** filenames, const opcode_profile ** file_profiles, uint file_count, uint jobs, output_stream * out) {
+    uint threads = std::max(1u, std::min(jobs, file_count));
+    uint window = std::max(4u, 4 * threads);
 
-    fseek(fp, 0, SEEK_END);
-    int bytes = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+    read_batch reader;
+    read_batch_start(&reader, filenames, file_count, std::max(io_depth, window));
 
-    uchar * contents = (uchar *)calloc(1, bytes);
-    int read = fread(contents, 1, bytes, fp);
-    if (read < bytes) {
-        if (ferror(fp)) {
-            fprintf(stderr, "Error while reading file [%s]\n", filename);
-            exit(1);
+    listing_pipeline p;
+    p.max_chunks = PIPELINE_CHUNKS_PER_JOB * threads;
+    p.chunks.store(0);
+    p.written.store(0);
+    p.failed.store(false);
+    queue_init(&p.decoded, window);
+    queue_init(&p.formatted, p.max_chunks + threads);
+    queue_init(&p.free_chunks, p.max_chunks);
+
+    std::atomic<uint> next_decode(0);
+    std::atomic<uint> next_hand_on(0);
+    std::atomic<uint> next_format(0);
+
+    auto decoder = [&]() {
+        in_worker = threads > 1;
+        for (;;) {
+            uint i = next_decode++;
+            if (i >= file_count) break;
+            uint spins = 0;
+            while (i >= p.written.load(std::memory_order_acquire) + window) pipeline_backoff(&spins);
+
+            listing_item * item = new listing_item;
+            item->index = i;
+            item->profile = NULL;
+            item->analyzed = false;
+            input_data in;
+            if (!read_batch_try_take(&reader, i, &in)) {
+                item->error = std::string("Failed to read file: [") + filenames[i] + "]";
+            }
+            else if (p.failed.load(std::memory_order_acquire)) {
+                arena_reset(&in.mem);
+            }
+            else {
+                item->analyzed = true;
+                if (try_analyze_input(filenames[i], &in, file_profiles[i], i, &item->a, &item->error)) {
+                    item->profile = item->a.profile;
+                }
+            }
+
+            // In order, so formatters take items in order too.
+            spins = 0;
+            while (next_hand_on.load(std::memory_order_acquire) != i) pipeline_backoff(&spins);
+            queue_push(&p.decoded, item);
+            next_hand_on.store(i + 1, std::memory_order_release);
         }
-        else if (feof(fp)) {
-#ifdef _DEBUG
-            fprintf(stderr, "Expected to read %d bytes, read %d\n", bytes, read);
-#endif 
+    };
+
+    auto formatter = [&]() {
+        // Each formatter claims an item count before popping, so exactly file_count pops
+        // happen in total and nobody waits on an item that will never come.
+        static thread_local listing_writer w;
+        while (next_format++ < file_count) {
+            listing_item * item = queue_pop(&p.decoded);
+            listing_chunk * c = pipeline_take_chunk(&p, item);
+            if (item->analyzed && item->error.empty() && !p.failed.load(std::memory_order_acquire)) {
+                writer_init(&w, NULL, NULL);
+                w.hand_off = pipeline_hand_off;
+                w.owner = &p;
+                w.buf = c->data;
+                w.scratch = &item->a.mem;
+                format_listing(&w, filenames[item->index], file_count > 1, item->a.opset, &item->a.script, &item->a.table);
+                c = (listing_chunk *)(w.buf - offsetof(listing_chunk, data));
+                c->len = w.len;
+            }
+            if (item->analyzed) {
+                release_analysis(&item->a);
+            }
+            c->last = true;
+            queue_push(&p.formatted, c);
         }
+    };
+
+    std::vector<std::thread> pool;
+    for (uint t = 0; t < threads; ++t) {
+        pool.push_back(std::thread(decoder));
+        pool.push_back(std::thread(formatter));
     }
 
-    fclose(fp);
-    *data = contents;
+    bool ok = pipeline_write(&p, filenames, file_profiles, file_count, window, out);
 
-    // Sanity check.  Overflow should be unlikely with reasonable files.
-    assert(read >= 0);
-    return read;
+    for (uint t = 0; t < pool.size(); ++t) {
+        pool[t].join();
+    }
+    read_batch_stop(&reader);
+    listing_chunk * c;
+    while (queue_try_pop(&p.free_chunks, &c)) {
+        delete c;
+    }
+    queue_free(&p.decoded);
+    queue_free(&p.formatted);
+    queue_free(&p.free_chunks);
+    return ok;
 }
 
 const char * version = "v0.1";
 
-char * input_filename;
+std::vector<char *> input_filenames;
+std::vector<const opcode_profile *> input_profiles;  // Per input, from the --profile before it.
+opcode_profile * current_profile = NULL;            // NULL for auto.
+char * xref_filename = NULL;
+char * xref_query = NULL;
+char * dump_filename = NULL;
+char * from_dump_filename = NULL;
+bool stats = false;
+char * make_archive_filename = NULL;
+char * diff_old_filename = NULL;
+char * diff_new_filename = NULL;
+uint seek_interval = 0;
+bool source_map = false;
+char * resolve_offsets = NULL;
+char * around = NULL;
 
 void usage(const char * argv0) {
-    fprintf(stderr, "USAGE:  %s <INPUT FILE> [options]\n\n", argv0);
+    fprintf(stderr, "USAGE:  %s <INPUT FILE>... [options]\n\n", argv0);
     fprintf(stderr, "Options\n");
     fprintf(stderr, "--help    | -h    Show this listing and exit.\n");
     fprintf(stderr, "--str     | -s    Print string literals inline.\n");
     fprintf(stderr, "--convert | -c    Convert half-width katakana to full-width hiragana.\n");
+    fprintf(stderr, "--labels  | -L    Name branch targets in the text listing (L_xxxxxxxx, sub_xxxxxxxx).\n");
+    fprintf(stderr, "--json    | -J    Print the listing as NDJSON (one object per instruction/string).\n");
+    fprintf(stderr, "--profile P       Decode the inputs after this with opcode profile P, either a\n");
+    fprintf(stderr, "                  built-in name (sensuibu, the default), a profile file, or 'auto'\n");
+    fprintf(stderr, "                  to pick the best fitting known profile for each input.\n");
+    fprintf(stderr, "--add-profile F   Load profile file F as a candidate for --profile auto.\n");
+    fprintf(stderr, "--jobs N  | -j N  Number of worker threads for batch modes (at most 256).\n");
+    fprintf(stderr, "--io-depth N      Number of input files to read ahead of the workers (default 32).\n");
+    fprintf(stderr, "--xref FILE       Build a var/flag usage index over all inputs and write it to FILE.\n");
+    fprintf(stderr, "                  With no inputs, FILE is read back for --query instead.\n");
+    fprintf(stderr, "--dump FILE       Write decoded instructions and strings of all inputs to a binary FILE.\n");
+    fprintf(stderr, "--from-dump FILE  Print the listing from a binary dump instead of input scripts.\n");
+    fprintf(stderr, "--archive FILE    Add every script in archive FILE to the inputs, read in place.\n");
+    fprintf(stderr, "--make-archive F  Pack the input files into a stand-in archive F for --archive.\n");
+    fprintf(stderr, "--diff OLD NEW    Print what changed between two versions of a script, or of every\n");
+    fprintf(stderr, "                  script in two archives, aligned by content rather than offset.\n");
+    fprintf(stderr, "--seek-index N    Write FILE.esi for each input, with a checkpoint every N instructions.\n");
+    fprintf(stderr, "--around OFF[:N]  Print N instructions (default 16) either side of hex offset OFF.\n");
+    fprintf(stderr, "--source-map      Print the code range of each source line (from fileline ops).\n");
+    fprintf(stderr, "--resolve OFF,... Print the source line of each hex offset, e.g. crash PCs.\n");
+    fprintf(stderr, "--fileline low:N  The low N bits of fileline params are the file number, the rest\n");
+    fprintf(stderr, "                  the line; high:N for the high N bits.  Default: all line.\n");
+    fprintf(stderr, "--stats           Print opcode, n-gram, param and string length statistics for all inputs.\n");
+    fprintf(stderr, "--cache DIR       Reuse decoded scripts from DIR when their contents are unchanged.\n");
+    fprintf(stderr, "--compress C      Compress the listing with C: lz4, or zstd[:LEVEL] (level 3 by default).\n");
+    fprintf(stderr, "--perf            Print time per phase and I/O counters to stderr at exit.\n");
+    fprintf(stderr, "--query KIND:ID   Print readers/writers of a var or flag, e.g. var:1a, flag:3.\n");
+    fprintf(stderr, "                  ID is hex, as in the listing.  Use 'var:?' for unresolved ids.\n");
+}
+
+// Returns the argument following option i, or exits if there isn't one.
+char * option_arg(int argc, char ** argv, int * i) {
+    if (*i + 1 >= argc) {
+        fprintf(stderr, "Missing argument for %s\n", argv[*i]);
+        usage(argv[0]);
+        exit(1);
+    }
+    return argv[++(*i)];
+}
+
+void parse_compress(const char * arg) {
+    const char * level = strchr(arg, ':');
+    size_t len = level ? (size_t)(level - arg) : strlen(arg);
+    if (len == 3 && !strncmp(arg, "lz4", 3) && !level) {
+        compress_codec = CODEC_LZ4;
+    }
+    else if (len == 4 && !strncmp(arg, "zstd", 4)) {
+#ifdef ESCR1_HAVE_ZSTD
+        compress_codec = CODEC_ZSTD;
+        if (level) {
+            char * end;
+            long n = strtol(level + 1, &end, 10);
+            if (level[1] == '\0' || *end != '\0' || n < ZSTD_minCLevel() || n > ZSTD_maxCLevel()) {
+                fprintf(stderr, "Bad --compress [%s], expected a zstd level from %d to %d\n", arg, ZSTD_minCLevel(), ZSTD_maxCLevel());
+                exit(1);
+            }
+            compress_level = (int)n;
+        }
+#else
+        fprintf(stderr, "zstd is not available in this build (build with -DESCR1_HAVE_ZSTD and -lzstd)\n");
+        exit(1);
+#endif
+    }
+    else {
+        fprintf(stderr, "Bad --compress [%s], expected lz4 or zstd[:LEVEL]\n", arg);
+        exit(1);
+    }
+}
+
+void parse_fileline(const char * arg) {
+    if (escr1_parse_fileline_format(arg, &fileline_format)) {
+        return;
+    }
+    fprintf(stderr, "Bad --fileline [%s], expected low:N or high:N with N up to 32\n", arg);
+    exit(1);
 }
 
 void parse_argv(int argc, char ** argv) {
@@ -517,15 +4378,121 @@ void parse_argv(int argc, char ** argv) {
             else if (!strcmp(argv[i], "--convert") || !strcmp(argv[i], "-c")) {
                 htoz = true;
             }
+            else if (!strcmp(argv[i], "--labels") || !strcmp(argv[i], "-L")) {
+                show_labels = true;
+            }
+            else if (!strcmp(argv[i], "--json") || !strcmp(argv[i], "-J")) {
+                json = true;
+            }
+            else if (!strcmp(argv[i], "--jobs") || !strcmp(argv[i], "-j")) {
+                jobs = (uint)std::max(0, atoi(option_arg(argc, argv, &i)));
+            }
+            else if (!strcmp(argv[i], "--io-depth")) {
+                io_depth = atoi(option_arg(argc, argv, &i));
+            }
+            else if (!strcmp(argv[i], "--profile")) {
+                char * arg = option_arg(argc, argv, &i);
+                current_profile = !strcmp(arg, "auto") ? NULL : select_profile(arg);
+            }
+            else if (!strcmp(argv[i], "--add-profile")) {
+                load_profile(option_arg(argc, argv, &i));
+            }
+            else if (!strcmp(argv[i], "--xref")) {
+                xref_filename = option_arg(argc, argv, &i);
+            }
+            else if (!strcmp(argv[i], "--dump")) {
+                dump_filename = option_arg(argc, argv, &i);
+            }
+            else if (!strcmp(argv[i], "--from-dump")) {
+                from_dump_filename = option_arg(argc, argv, &i);
+            }
+            else if (!strcmp(argv[i], "--archive")) {
+                open_archive(option_arg(argc, argv, &i), &input_filenames);
+                input_profiles.resize(input_filenames.size(), current_profile);
+            }
+            else if (!strcmp(argv[i], "--make-archive")) {
+                make_archive_filename = option_arg(argc, argv, &i);
+            }
+            else if (!strcmp(argv[i], "--diff")) {
+                diff_old_filename = option_arg(argc, argv, &i);
+                diff_new_filename = option_arg(argc, argv, &i);
+            }
+            else if (!strcmp(argv[i], "--seek-index")) {
+                seek_interval = atoi(option_arg(argc, argv, &i));
+                if (seek_interval == 0) {
+                    fprintf(stderr, "--seek-index needs an interval of at least 1\n");
+                    exit(1);
+                }
+            }
+            else if (!strcmp(argv[i], "--around")) {
+                around = option_arg(argc, argv, &i);
+            }
+            else if (!strcmp(argv[i], "--source-map")) {
+                source_map = true;
+            }
+            else if (!strcmp(argv[i], "--resolve")) {
+                resolve_offsets = option_arg(argc, argv, &i);
+            }
+            else if (!strcmp(argv[i], "--fileline")) {
+                parse_fileline(option_arg(argc, argv, &i));
+            }
+            else if (!strcmp(argv[i], "--stats")) {
+                stats = true;
+            }
+            else if (!strcmp(argv[i], "--cache")) {
+                cache_dir = option_arg(argc, argv, &i);
+            }
+            else if (!strcmp(argv[i], "--compress")) {
+                parse_compress(option_arg(argc, argv, &i));
+            }
+            else if (!strcmp(argv[i], "--perf")) {
+#ifdef ESCR1_NO_PERF
+                fprintf(stderr, "--perf is not available in this build (ESCR1_NO_PERF)\n");
+#else
+                perf_enabled = true;
+#endif
+            }
+            else if (!strcmp(argv[i], "--query")) {
+                xref_query = option_arg(argc, argv, &i);
+            }
             else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h")) {
                 usage(argv[0]);
                 exit(0);
             }
             else {
-                input_filename = argv[i];
+                input_filenames.push_back(argv[i]);
+                input_profiles.push_back(current_profile);
             }
         }
     }
+
+    if (jobs == 0) {
+        jobs = std::thread::hardware_concurrency();
+        if (jobs == 0) jobs = 1;
+    }
+    jobs = std::min(jobs, max_jobs);
+}
+
+void parse_query(const char * query, uint * kind, uint * id) {
+    if (!strncmp(query, "var:", 4)) {
+        *kind = XREF_VAR;
+        query += 4;
+    }
+    else if (!strncmp(query, "flag:", 5)) {
+        *kind = XREF_FLAG;
+        query += 5;
+    }
+    else {
+        fprintf(stderr, "Bad query [%s], expected var:ID or flag:ID\n", query);
+        exit(1);
+    }
+
+    if (!strcmp(query, "?")) {
+        *id = XREF_UNRESOLVED;
+    }
+    else {
+        *id = strtoul(query, NULL, 16);
+    }
 }
 
 int main(int argc, char ** argv) {
@@ -537,46 +4504,182 @@ int main(int argc, char ** argv) {
         exit(1);
     }
 
+    init_builtin_profiles();
+    current_profile = profiles[0];
     parse_argv(argc, argv);
+    if (perf_enabled) {
+        perf_start();
+        atexit(perf_report);
+    }
 
-    fprintf(stderr, "WARNING: This program outputs directly to stdout.  Redirect to a file.\n");
-    fprintf(stderr, "Continue? [Y/N]\n");
-    char yn = fgetc(stdin);
-    if (yn != 'Y' && yn != 'y') {
-        exit(0);
+    if (cache_dir) {
+        // Fails harmlessly if it already exists.
+#ifdef _WIN32
+        _mkdir(cache_dir);
+#else
+        mkdir(cache_dir, 0755);
+#endif
     }
 
-    script_file script;
-    uchar * data;
-    int flen = load_file(input_filename, &data);
+    if (xref_query && !xref_filename) {
+        fprintf(stderr, "--query requires --xref FILE\n");
+        exit(1);
+    }
+
+    if (xref_filename) {
+        if (input_filenames.size()) {
+            std::vector<xref_entry> entries;
+            build_xref(&input_filenames[0], &input_profiles[0], input_filenames.size(), jobs, &entries);
+            write_xref(xref_filename, &input_filenames[0], input_filenames.size(), &entries);
+            fprintf(stderr, "Wrote %u references from %u files to [%s]\n",
+                    (uint)entries.size(), (uint)input_filenames.size(), xref_filename);
+        }
+        if (xref_query) {
+            uint kind, id;
+            parse_query(xref_query, &kind, &id);
+            query_xref(xref_filename, kind, id);
+        }
+        return 0;
+    }
 
-    script.contents = data;
-    script.file_size = flen;
+    if (diff_old_filename) {
+        output_stream out;
+        output_open(&out, stdout, compress_codec, compress_level, jobs);
+        diff_corpus(diff_old_filename, diff_new_filename, current_profile, jobs, &out);
+        output_close(&out);
+        return 0;
+    }
 
-    if (memcmp(magic, data, 8)) {
-        fprintf(stderr, "This is not an ESCR1_00 file.\n");
-        exit(1);
+    if (source_map || resolve_offsets) {
+        if (input_filenames.empty()) {
+            usage(argv[0]);
+            exit(1);
+        }
+        std::vector<uint> offsets;
+        for (char * p = resolve_offsets; p && *p; ) {
+            char * end;
+            offsets.push_back(strtoul(p, &end, 16));
+            if (end == p) {
+                fprintf(stderr, "Bad --resolve offset list [%s]\n", resolve_offsets);
+                exit(1);
+            }
+            p = *end == ',' ? end + 1 : end;
+        }
+        output_stream out;
+        output_open(&out, stdout, compress_codec, compress_level, jobs);
+        print_source_maps(&input_filenames[0], &input_profiles[0], input_filenames.size(),
+                          resolve_offsets ? &offsets : NULL, jobs, &out);
+        output_close(&out);
+        return 0;
     }
 
-    uchar * p = data + 8;
-    script.index_count = *((uint *)p);
+    if (seek_interval || around) {
+        if (input_filenames.empty()) {
+            usage(argv[0]);
+            exit(1);
+        }
+        if (seek_interval) {
+            build_seek_indexes(&input_filenames[0], &input_profiles[0], input_filenames.size(), seek_interval, jobs);
+        }
+        if (around) {
+            char * end;
+            uint offset = strtoul(around, &end, 16);
+            uint count = *end == ':' ? atoi(end + 1) : 16;
+            output_stream out;
+            output_open(&out, stdout, compress_codec, compress_level, jobs);
+            static listing_writer w;
+            writer_init(&w, &out, NULL);
+            for (uint i = 0; i < input_filenames.size(); ++i) {
+                print_around(&w, input_filenames[i], input_profiles[i], offset, count);
+            }
+            output_close(&out);
+        }
+        return 0;
+    }
+
+    if (stats) {
+        if (input_filenames.empty()) {
+            usage(argv[0]);
+            exit(1);
+        }
+        op_stats * st = (op_stats *)malloc(sizeof(op_stats));
+        build_stats(&input_filenames[0], &input_profiles[0], input_filenames.size(), jobs, st);
+        // Mixed profiles name user ops after the first input's.
+        const opcode_profile * names = input_profiles[0] ? input_profiles[0] : profiles[0];
+        print_stats(st, &names->opset);
+        free_stats(st);
+        free(st);
+        return 0;
+    }
 
-    p += sizeof(uint);
-    script.index_ptr = (uint *)p;
+    if (make_archive_filename) {
+        if (input_filenames.empty()) {
+            usage(argv[0]);
+            exit(1);
+        }
+        write_archive(make_archive_filename, &input_filenames[0], input_filenames.size());
+        return 0;
+    }
 
-    p += script.index_count * sizeof(uint);
-    script.code_size = *((uint *)p);
+    if (dump_filename) {
+        if (input_filenames.empty()) {
+            usage(argv[0]);
+            exit(1);
+        }
+        write_dump(dump_filename, &input_filenames[0], &input_profiles[0], input_filenames.size());
+        return 0;
+    }
 
-    p += sizeof(uint);
-    script.code_ptr = p;
+    if (input_filenames.empty() && !from_dump_filename) {
+        usage(argv[0]);
+        exit(1);
+    }
 
-    p += script.code_size;
-    script.data_size = *((uint *)p);
+    fprintf(stderr, "WARNING: This program outputs directly to stdout.  Redirect to a file.\n");
+    fprintf(stderr, "Continue? [Y/N]\n");
+    char yn = fgetc(stdin);
+    if (yn != 'Y' && yn != 'y') {
+        exit(0);
+    }
+    if (perf_enabled) {
+        perf_start();   // Don't count the time spent at the prompt.
+    }
 
-    p += sizeof(uint);
-    script.data_ptr = p;
+#ifdef _WIN32
+    if (compress_codec != CODEC_NONE) {
+        _setmode(_fileno(stdout), _O_BINARY);
+    }
+#endif
+    output_stream out;
+    output_open(&out, stdout, compress_codec, compress_level, jobs);
 
-    parse_opcodes(&script);
+    if (from_dump_filename) {
+        static listing_writer w;
+        writer_init(&w, &out, NULL);
+        arena strings;
+        arena_init(&strings);
+        w.scratch = &strings;
+        const escr1_opset * opset = current_profile ? &current_profile->opset : &profiles[0]->opset;
+        dump_file dump;
+        if (!open_dump(from_dump_filename, &dump)) {
+            exit(1);
+        }
+        uint script_count = dump.header->script_count;
+        for (uint i = 0; i < script_count; ++i) {
+            const char * name = dump.names + dump.scripts[i].name;
+            script_file script;
+            opcode_table table;
+            dump_get_script(&dump, i, &script, &table);
+            format_listing(&w, name, script_count > 1, opset, &script, &table);
+            arena_reset(&strings);
+        }
+        writer_flush(&w);
+        output_close(&out);
+        close_dump(&dump);
+        return 0;
+    }
 
-    return 0;
-}
\ No newline at end of file
+    bool ok = print_listing_pipeline(&input_filenames[0], &input_profiles[0], input_filenames.size(), jobs, &out);
+    output_close(&out);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,291 @@
+// escr1fuzz -- fuzz target for the libescr1 loader, decoder and string functions.
+//
+// Each input is treated as a whole script file.  It is opened with escr1_open_memory and,
+// if the header parses, decoded with every opset we ship plus one where every user op
+// takes a param, with every string looked up and converted.  Decoding is also checked
+// against the checked tail decoder run over the whole block, so the unchecked fast path
+// in escr1_iter_next has to agree with it instruction for instruction.
+//
+// Inputs are copied into an exact-size heap buffer first, so an address sanitizer
+// catches any read past the end of the file.
+//
+// With libFuzzer:
+// $ clang++ -g -O1 -fsanitize=fuzzer,address,undefined -DESCR1_LIBFUZZER ./escr1fuzz.cpp ./libescr1.cpp -o escr1fuzz
+//
+// Standalone, without libFuzzer.  Runs the given files, then mutates a generated seed
+// script for --runs iterations:
+// $ g++ -g -O1 -fsanitize=address,undefined ./escr1fuzz.cpp ./libescr1.cpp -o escr1fuzz.exe -std=c++0x
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "libescr1.h"
+#include "escr1rng.h"
+
+// TARGET
+
+static escr1_opset fuzz_opsets[2];
+
+static void init_opsets() {
+    static bool done = false;
+    if (done) return;
+    done = true;
+
+    escr1_opset_init(&fuzz_opsets[0], SENSUIBU_OPS, SENSUIBU_OP_COUNT);
+
+    // Every user op with a param, so params are read at as many offsets as possible.
+    // User ops only take an immediate when param_count is negative.
+    static usr_op all_params[256 - ROP_COUNT];
+    for (uint i = 0; i < 256 - ROP_COUNT; ++i) {
+        all_params[i].name = "USR_FUZZ";
+        all_params[i].param_count = -1;
+    }
+    escr1_opset_init(&fuzz_opsets[1], all_params, 256 - ROP_COUNT);
+    if (!fuzz_opsets[1].has_param[ROP_COUNT] || !fuzz_opsets[1].has_param[255]) {
+        fprintf(stderr, "The all-params opset has user ops without a param\n");
+        abort();
+    }
+}
+
+struct fuzz_visitor : escr1_visitor<fuzz_visitor> {
+    const script_file * script;
+    std::vector<opcode> ops;
+    uint64_t sink;
+    bool truncated;
+
+    void on_op(const opcode & op) {
+        ops.push_back(op);
+    }
+
+    void on_str(const opcode & op) {
+        const char * str;
+        if (escr1_lookup_string(script, op.param, &str)) {
+            sink += strlen(str);
+        }
+    }
+
+    void on_truncated(uint) {
+        truncated = true;
+    }
+};
+
+static void fuzz_script(const script_file * script, const escr1_opset * opset) {
+    fuzz_visitor v;
+    v.script = script;
+    v.sink = 0;
+    v.truncated = false;
+    escr1_visit(script, opset, v);
+
+    // Same block through the checked decoder only.
+    escr1_iterator it;
+    escr1_iter_init(&it, script, opset);
+    opcode op;
+    uint i = 0;
+    while (escr1_iter_next_tail(&it, &op)) {
+        if (i >= v.ops.size() || v.ops[i].offset != op.offset || v.ops[i].op != op.op ||
+            v.ops[i].param != op.param) {
+            fprintf(stderr, "Fast and checked decoders disagree at instruction %u\n", i);
+            abort();
+        }
+        i++;
+    }
+    if (i != v.ops.size() || escr1_iter_truncated(&it) != v.truncated) {
+        fprintf(stderr, "Fast and checked decoders disagree at the end of the block\n");
+        abort();
+    }
+
+    // Seeking to any byte of an instruction has to land on its start.
+    std::vector<uint> checkpoints(escr1_build_checkpoints(script, opset, 3, NULL, 0));
+    escr1_build_checkpoints(script, opset, 3, checkpoints.data(), (uint)checkpoints.size());
+    for (i = 0; i < v.ops.size(); ++i) {
+        uint last = v.ops[i].offset + (opset->has_param[v.ops[i].op] ? 4 : 0);
+        for (uint offset = v.ops[i].offset; offset <= last; ++offset) {
+            escr1_iter_init(&it, script, opset);
+            if (!escr1_iter_seek(&it, checkpoints.data(), (uint)checkpoints.size(), offset) || it.offset != v.ops[i].offset) {
+                fprintf(stderr, "Seek to %08x missed instruction %u\n", offset, i);
+                abort();
+            }
+        }
+    }
+}
+
+static void fuzz_strings(const script_file * script) {
+    uchar converted[512];
+    for (uint id = 0; id < script->index_count + 1; ++id) {
+        const char * str;
+        if (escr1_lookup_string(script, id, &str)) {
+            escr1_convert_htoz((const uchar *)str, converted, sizeof(converted));
+            escr1_convert_htoz((const uchar *)str, converted, 1 + id % 8);
+        }
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size) {
+    init_opsets();
+
+    uchar * copy = (uchar *)malloc(size ? size : 1);
+    if (size) memcpy(copy, data, size);
+
+    script_file script;
+    if (escr1_open_memory(copy, size, &script) == ESCR1_OK) {
+        for (uint i = 0; i < sizeof(fuzz_opsets) / sizeof(fuzz_opsets[0]); ++i) {
+            fuzz_script(&script, &fuzz_opsets[i]);
+        }
+        fuzz_strings(&script);
+    }
+
+    free(copy);
+    return 0;
+}
+
+#ifndef ESCR1_LIBFUZZER
+
+// STANDALONE DRIVER
+
+// A small well-formed script to mutate: a few strings and a mix of ops with and
+// without params, including user ops.
+static void seed_script(std::vector<uchar> * out) {
+    static const char * strings[] = { "\x88\x9f\xb1\xb2", "abc!?", "\x1b\xb1\xa0", "" };
+    std::vector<uchar> code;
+    std::vector<uchar> data;
+    std::vector<uint> index;
+    for (uint i = 0; i < 4; ++i) {
+        index.push_back((uint)data.size());
+        data.insert(data.end(), strings[i], strings[i] + strlen(strings[i]) + 1);
+
+        code.push_back(ROP_FILELINE);
+        append_uint(&code, i + 1);
+        code.push_back(ROP_STR);
+        append_uint(&code, i);
+        code.push_back((uchar)(ROP_COUNT + 8));
+        code.push_back(ROP_PUSH);
+        append_uint(&code, 7);
+        code.push_back(ROP_ADD);
+    }
+    code.push_back(ROP_END);
+
+    out->assign(magic, magic + 8);
+    append_uint(out, (uint)index.size());
+    for (uint i = 0; i < index.size(); ++i) append_uint(out, index[i]);
+    append_uint(out, (uint)code.size());
+    out->insert(out->end(), code.begin(), code.end());
+    append_uint(out, (uint)data.size());
+    out->insert(out->end(), data.begin(), data.end());
+}
+
+// Section sizes and offsets are where the bugs would be, so header words are
+// overwritten with boundary values as often as random bytes are flipped.
+static void mutate(rng * r, std::vector<uchar> * buf) {
+    static const uint interesting[] = { 0, 1, 3, 4, 5, 0x7f, 0xff, 0xffff, 0x7fffffff, 0xfffffffb, 0xffffffff };
+    uint count = 1 + rng_next(r) % 4;
+    for (uint i = 0; i < count; ++i) {
+        uint size = (uint)buf->size();
+        switch (rng_next(r) % 5) {
+            case 0:
+                if (size) (*buf)[rng_next(r) % size] ^= (uchar)(1 << (rng_next(r) % 8));
+                break;
+            case 1:
+                if (size) (*buf)[rng_next(r) % size] = (uchar)rng_next(r);
+                break;
+            case 2:
+                if (size >= 4) {
+                    uint v = interesting[rng_next(r) % (sizeof(interesting) / sizeof(interesting[0]))];
+                    if (rng_next(r) & 1) v += size;
+                    memcpy(&(*buf)[rng_next(r) % (size - 3)], &v, 4);
+                }
+                break;
+            case 3:
+                buf->resize(size ? rng_next(r) % size : 0);
+                break;
+            case 4:
+                buf->push_back((uchar)rng_next(r));
+                break;
+        }
+    }
+}
+
+static bool run_file(const char * filename) {
+    FILE * fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open file: [%s]\n", filename);
+        return false;
+    }
+    std::vector<uchar> buf;
+    uchar chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        buf.insert(buf.end(), chunk, chunk + n);
+    }
+    fclose(fp);
+    LLVMFuzzerTestOneInput(buf.empty() ? NULL : &buf[0], buf.size());
+    return true;
+}
+
+void usage(const char * argv0) {
+    fprintf(stderr, "USAGE:  %s [FILE]... [options]\n\n", argv0);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "--help    | -h    Show this listing and exit.\n");
+    fprintf(stderr, "--runs N          Mutated inputs to run after the files (default 100000).\n");
+    fprintf(stderr, "--seed N          Mutation seed (default 1).\n");
+    fprintf(stderr, "--save FILE       Write each mutated input to FILE before running it, so the\n");
+    fprintf(stderr, "                  one that crashed is left behind.\n");
+}
+
+int main(int argc, char ** argv) {
+    uint runs = 100000;
+    uint seed = 1;
+    const char * save = NULL;
+    std::vector<const char *> files;
+
+    for (int i = 1; i < argc; ++i) {
+        bool has_arg = i + 1 < argc;
+        if (!strcmp(argv[i], "--runs") && has_arg) {
+            runs = (uint)strtoul(argv[++i], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "--seed") && has_arg) {
+            seed = (uint)strtoul(argv[++i], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "--save") && has_arg) {
+            save = argv[++i];
+        }
+        else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            exit(!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h") ? 0 : 1);
+        }
+        else {
+            files.push_back(argv[i]);
+        }
+    }
+
+    for (uint i = 0; i < files.size(); ++i) {
+        if (!run_file(files[i])) exit(1);
+    }
+
+    rng r;
+    r.state = seed ? seed : 1;
+    std::vector<uchar> base;
+    seed_script(&base);
+    std::vector<uchar> input;
+    for (uint i = 0; i < runs; ++i) {
+        // Mostly fresh mutations of the seed, sometimes stacked on the previous input.
+        if (i % 4 == 0 || input.empty()) input = base;
+        mutate(&r, &input);
+
+        if (save) {
+            FILE * fp = fopen(save, "wb");
+            if (fp) {
+                if (!input.empty()) fwrite(&input[0], 1, input.size(), fp);
+                fclose(fp);
+            }
+        }
+        LLVMFuzzerTestOneInput(input.empty() ? NULL : &input[0], input.size());
+    }
+
+    fprintf(stderr, "Ran %u files and %u mutated inputs\n", (uint)files.size(), runs);
+    return 0;
+}
+
+#endif // ESCR1_LIBFUZZER
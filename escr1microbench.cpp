@@ -0,0 +1,493 @@
+// escr1microbench -- microbenchmarks for the string kernels in libescr1.
+//
+// Times the kernels the extractor spends its string time in, each over several input
+// shapes:
+//
+//   htoz_char     escr1_htoz_char on every byte (the half-width table lookup)
+//   convert       escr1_convert_htoz into a fixed buffer
+//   convert_alloc escr1_convert_htoz plus the per-string arena allocation the
+//                 extractor's convert_string_htoz does
+//   lookup        escr1_lookup_string over every id of a synthetic index table
+//
+// Inputs:
+//
+//   ascii         printable ASCII only; nothing converts
+//   double        two-byte Shift-JIS only; nothing converts
+//   kana          mostly half-width kana; nearly every byte converts
+//   escape        dense ESC pairs
+//   long          mixed text, strings of about 1000 bytes
+//
+// Before timing anything, every kernel is checked against the reference copies below,
+// which are the scalar implementations as they were when this benchmark was written.
+// Any faster variant of a kernel must keep producing the same bytes; a mismatch is
+// printed and the benchmark exits with status 1.
+//
+// Results are printed to stdout as one JSON object per kernel and input.  lookup's have
+// no mb_per_s, since it doesn't touch the string bytes.
+//
+// Compile with:
+// $ g++ -O2 ./escr1microbench.cpp ./libescr1.cpp -o escr1microbench.exe -std=c++0x
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "libescr1.h"
+#include "escr1rng.h"
+
+const char * version = "v0.1";
+
+// REFERENCE IMPLEMENTATIONS
+//
+// Frozen copies of libescr1's scalar kernels.  Don't optimize these.
+
+struct ref_htoz_entry {
+    uchar hankaku;
+    uchar zenkaku[2];
+};
+
+static const ref_htoz_entry ref_htoz_table[] = {
+    { 0xa0, { 0x81, 0x40 } }, { 0x21, { 0x81, 0x49 } }, { 0x3f, { 0x81, 0x48 } }, { 0xa5, { 0x81, 0x63 } },
+    { 0xa1, { 0x81, 0x42 } }, { 0xa2, { 0x81, 0x75 } }, { 0xa3, { 0x81, 0x76 } }, { 0xa4, { 0x81, 0x41 } },
+    { 0xa6, { 0x82, 0xf0 } }, { 0xa7, { 0x82, 0x9f } }, { 0xa8, { 0x82, 0xa1 } }, { 0xa9, { 0x82, 0xa3 } },
+    { 0xaa, { 0x82, 0xa5 } }, { 0xab, { 0x82, 0xa7 } }, { 0xac, { 0x82, 0xe1 } }, { 0xad, { 0x82, 0xe3 } },
+    { 0xae, { 0x82, 0xe5 } }, { 0xaf, { 0x82, 0xc1 } }, { 0xb0, { 0x81, 0x5b } }, { 0xb1, { 0x82, 0xa0 } },
+    { 0xb2, { 0x82, 0xa2 } }, { 0xb3, { 0x82, 0xa4 } }, { 0xb4, { 0x82, 0xa6 } }, { 0xb5, { 0x82, 0xa8 } },
+    { 0xb6, { 0x82, 0xa9 } }, { 0xb7, { 0x82, 0xab } }, { 0xb8, { 0x82, 0xad } }, { 0xb9, { 0x82, 0xaf } },
+    { 0xba, { 0x82, 0xb1 } }, { 0xbb, { 0x82, 0xb3 } }, { 0xbc, { 0x82, 0xb5 } }, { 0xbd, { 0x82, 0xb7 } },
+    { 0xbe, { 0x82, 0xb9 } }, { 0xbf, { 0x82, 0xbb } }, { 0xc0, { 0x82, 0xbd } }, { 0xc1, { 0x82, 0xbf } },
+    { 0xc2, { 0x82, 0xc2 } }, { 0xc3, { 0x82, 0xc4 } }, { 0xc4, { 0x82, 0xc6 } }, { 0xc5, { 0x82, 0xc8 } },
+    { 0xc6, { 0x82, 0xc9 } }, { 0xc7, { 0x82, 0xca } }, { 0xc8, { 0x82, 0xcb } }, { 0xc9, { 0x82, 0xcc } },
+    { 0xca, { 0x82, 0xcd } }, { 0xcb, { 0x82, 0xd0 } }, { 0xcc, { 0x82, 0xd3 } }, { 0xcd, { 0x82, 0xd6 } },
+    { 0xce, { 0x82, 0xd9 } }, { 0xcf, { 0x82, 0xdc } }, { 0xd0, { 0x82, 0xdd } }, { 0xd1, { 0x82, 0xde } },
+    { 0xd2, { 0x82, 0xdf } }, { 0xd3, { 0x82, 0xe0 } }, { 0xd4, { 0x82, 0xe2 } }, { 0xd5, { 0x82, 0xe4 } },
+    { 0xd6, { 0x82, 0xe6 } }, { 0xd7, { 0x82, 0xe7 } }, { 0xd8, { 0x82, 0xe8 } }, { 0xd9, { 0x82, 0xe9 } },
+    { 0xda, { 0x82, 0xea } }, { 0xdb, { 0x82, 0xeb } }, { 0xdc, { 0x82, 0xed } }, { 0xdd, { 0x82, 0xf1 } },
+};
+
+static const uint ref_htoz_table_size = sizeof(ref_htoz_table) / sizeof(ref_htoz_table[0]);
+
+static bool ref_htoz_char(uchar c, uchar zenkaku[2]) {
+    for (uint i = 0; i < ref_htoz_table_size; ++i) {
+        if (ref_htoz_table[i].hankaku == c) {
+            zenkaku[0] = ref_htoz_table[i].zenkaku[0];
+            zenkaku[1] = ref_htoz_table[i].zenkaku[1];
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint ref_convert_htoz(const uchar * src, uchar * dest, uint dest_size) {
+    if (dest_size == 0) {
+        return 0;
+    }
+
+    uchar * start = dest;
+    uchar * end = dest + dest_size - 1;
+    while (*src) {
+        if ((*src >= 0x81 && *src <= 0x9f) || (*src >= 0xe0 && *src <= 0xef)) {
+            if (src[1] == 0 || end - dest < 2) break;
+            *dest++ = *src++;
+            *dest++ = *src++;
+        }
+        else if (*src == 0x1b) {
+            if (src[1] == 0 || end - dest < 1) break;
+            src++;
+            *dest++ = *src++;
+        }
+        else {
+            uchar zenkaku[2];
+            if (ref_htoz_char(*src, zenkaku)) {
+                if (end - dest < 2) break;
+                *dest++ = zenkaku[0];
+                *dest++ = zenkaku[1];
+                src++;
+            }
+            else {
+                if (end - dest < 1) break;
+                *dest++ = *src++;
+            }
+        }
+    }
+    *dest = '\0';
+    return (dest - start);
+}
+
+static bool ref_lookup_string(const script_file * script, uint id, const char ** out) {
+    if (id >= script->index_count) {
+        return false;
+    }
+    uint offset = script->index_ptr[id];
+    if (offset >= script->data_size) {
+        return false;
+    }
+    const char * str = (const char *)(script->data_ptr + offset);
+    if (*str == 0) {
+        return false;
+    }
+    *out = str;
+    return true;
+}
+
+// INPUTS
+
+enum {
+    INPUT_ASCII = 0,
+    INPUT_DOUBLE,
+    INPUT_KANA,
+    INPUT_ESCAPE,
+    INPUT_LONG,
+    INPUT_COUNT
+};
+
+static const char * input_names[INPUT_COUNT] = {
+    "ascii", "double", "kana", "escape", "long",
+};
+
+// A set of strings laid out the way a script stores them: a data blob of NUL-terminated
+// strings and an index of offsets into it, so lookup runs on the real structures.
+struct string_set {
+    std::vector<uchar> data;
+    std::vector<uint> index;
+    script_file script;
+    uint64_t bytes;     // Total string bytes, terminators excluded
+};
+
+static void push_double(rng * r, std::vector<uchar> * out) {
+    out->push_back((uchar)(0x88 + rng_range(r, 0x10)));
+    out->push_back((uchar)(0x40 + rng_range(r, 0x3f)));
+}
+
+static void push_kana(rng * r, std::vector<uchar> * out) {
+    out->push_back((uchar)(0xa1 + rng_range(r, 0xdd - 0xa1 + 1)));
+}
+
+static void generate_input(rng * r, uint kind, std::vector<uchar> * out) {
+    uint chars = kind == INPUT_LONG ? 400 + rng_range(r, 200) : 4 + rng_range(r, 40);
+    for (uint i = 0; i < chars; ++i) {
+        uint u = rng_range(r, 100);
+        switch (kind) {
+            case INPUT_ASCII:
+                out->push_back((uchar)(0x20 + rng_range(r, 0x5f)));
+                break;
+            case INPUT_DOUBLE:
+                push_double(r, out);
+                break;
+            case INPUT_KANA:
+                if (u < 90) push_kana(r, out);
+                else push_double(r, out);
+                break;
+            case INPUT_ESCAPE:
+                if (u < 60) {
+                    out->push_back(0x1b);
+                    out->push_back((uchar)(0xa1 + rng_range(r, 0x3d)));
+                }
+                else push_kana(r, out);
+                break;
+            case INPUT_LONG:
+                if (u < 50) push_double(r, out);
+                else if (u < 80) push_kana(r, out);
+                else if (u < 95) out->push_back((uchar)(0x20 + rng_range(r, 0x5f)));
+                else {
+                    out->push_back(0x1b);
+                    out->push_back((uchar)(0xa1 + rng_range(r, 0x3d)));
+                }
+                break;
+        }
+    }
+}
+
+static void generate_set(rng * r, uint kind, uint count, string_set * set) {
+    set->data.clear();
+    set->index.clear();
+    set->bytes = 0;
+    for (uint i = 0; i < count; ++i) {
+        set->index.push_back((uint)set->data.size());
+        uint before = (uint)set->data.size();
+        generate_input(r, kind, &set->data);
+        set->bytes += set->data.size() - before;
+        set->data.push_back(0);
+    }
+
+    memset(&set->script, 0, sizeof(script_file));
+    set->script.index_count = (uint)set->index.size();
+    set->script.index_ptr = &set->index[0];
+    set->script.data_size = (uint)set->data.size();
+    set->script.data_ptr = &set->data[0];
+}
+
+// CROSS-CHECK
+
+static uint check_failures = 0;
+
+static void check_fail(const char * kernel, const char * what, uint detail) {
+    if (check_failures++ < 20) {
+        fprintf(stderr, "MISMATCH %s: %s (%u)\n", kernel, what, detail);
+    }
+}
+
+static void check_convert(const uchar * src, uint dest_size) {
+    uchar expected[4096];
+    uchar actual[4096];
+    memset(expected, 0xcc, sizeof(expected));
+    memset(actual, 0xcc, sizeof(actual));
+    uint n = ref_convert_htoz(src, expected, dest_size);
+    uint m = escr1_convert_htoz(src, actual, dest_size);
+    if (n != m) {
+        check_fail("convert", "length differs", dest_size);
+    }
+    else if (memcmp(expected, actual, sizeof(expected))) {
+        // Compare past the terminator too, so a variant that writes beyond it is caught.
+        check_fail("convert", "bytes differ", dest_size);
+    }
+}
+
+void cross_check(rng * r, string_set * sets) {
+    for (uint c = 0; c < 256; ++c) {
+        uchar expected[2] = {0, 0};
+        uchar actual[2] = {0, 0};
+        bool a = ref_htoz_char((uchar)c, expected);
+        bool b = escr1_htoz_char((uchar)c, actual);
+        if (a != b || memcmp(expected, actual, 2)) {
+            check_fail("htoz_char", "byte", c);
+        }
+    }
+
+    for (uint k = 0; k < INPUT_COUNT; ++k) {
+        string_set * set = &sets[k];
+        for (uint i = 0; i < set->index.size(); ++i) {
+            const uchar * src = &set->data[set->index[i]];
+            check_convert(src, 2048);
+            // Short buffers exercise the truncation paths.
+            check_convert(src, 1 + rng_range(r, 16));
+        }
+    }
+
+    // Edge cases: strings ending on a lead byte or an ESC, and every single byte.
+    static const uchar edges[][4] = {
+        { 0x81, 0 }, { 0x1b, 0 }, { 0xa0, 0xa1, 0 }, { 0xef, 0x40, 0x1b, 0 }, { 0 },
+    };
+    for (uint e = 0; e < sizeof(edges) / sizeof(edges[0]); ++e) {
+        for (uint size = 0; size < 8; ++size) {
+            check_convert(edges[e], size);
+        }
+    }
+    for (uint c = 1; c < 256; ++c) {
+        uchar s[2] = { (uchar)c, 0 };
+        check_convert(s, 8);
+    }
+
+    // Lookup, with ids and offsets out of range and an empty string.
+    string_set * set = &sets[INPUT_ASCII];
+    set->data.push_back(0);
+    set->index.push_back((uint)set->data.size() - 1);
+    set->index.push_back((uint)set->data.size() + 100);
+    script_file s = set->script;
+    s.index_count = (uint)set->index.size();
+    s.index_ptr = &set->index[0];
+    s.data_size = (uint)set->data.size();
+    s.data_ptr = &set->data[0];
+    for (uint id = 0; id < s.index_count + 4; ++id) {
+        const char * expected = NULL;
+        const char * actual = NULL;
+        bool a = ref_lookup_string(&s, id, &expected);
+        bool b = escr1_lookup_string(&s, id, &actual);
+        if (a != b || expected != actual) {
+            check_fail("lookup", "id", id);
+        }
+    }
+    set->index.resize(set->index.size() - 2);
+    set->data.pop_back();
+    set->script.index_ptr = &set->index[0];
+    set->script.data_ptr = &set->data[0];
+}
+
+// KERNELS
+
+enum {
+    KERNEL_HTOZ_CHAR = 0,
+    KERNEL_CONVERT,
+    KERNEL_CONVERT_ALLOC,
+    KERNEL_LOOKUP,
+    KERNEL_COUNT
+};
+
+static const char * kernel_names[KERNEL_COUNT] = {
+    "htoz_char", "convert", "convert_alloc", "lookup",
+};
+
+// A bump allocator shaped like the extractor's arena: 16-byte aligned allocations from
+// 1MB chunks, all released at once.  Chunks are kept after a reset, as the extractor's
+// pool keeps them for the next script.
+struct bench_arena {
+    std::vector<std::vector<uchar> > chunks;
+    size_t current;
+    size_t used;
+};
+
+static bench_arena convert_arena;
+
+static void * bench_arena_alloc(bench_arena * a, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    while (a->current < a->chunks.size() && a->chunks[a->current].size() - a->used < size) {
+        a->current++;
+        a->used = 0;
+    }
+    if (a->current == a->chunks.size()) {
+        a->chunks.push_back(std::vector<uchar>(std::max(size, (size_t)1 << 20)));
+    }
+    void * p = &a->chunks[a->current][a->used];
+    a->used += size;
+    return p;
+}
+
+static void bench_arena_reset(bench_arena * a) {
+    a->current = 0;
+    a->used = 0;
+}
+
+// One pass of a kernel over a whole set.  The return value only exists so the compiler
+// can't drop the work.
+static uint64_t run_kernel(uint kernel, string_set * set) {
+    uint64_t sink = 0;
+    uchar buffer[2048];
+    switch (kernel) {
+        case KERNEL_HTOZ_CHAR:
+            for (uint i = 0; i < set->data.size(); ++i) {
+                uchar z[2];
+                if (escr1_htoz_char(set->data[i], z)) sink += z[1];
+            }
+            break;
+        case KERNEL_CONVERT:
+            for (uint i = 0; i < set->index.size(); ++i) {
+                sink += escr1_convert_htoz(&set->data[set->index[i]], buffer, sizeof(buffer));
+            }
+            break;
+        case KERNEL_CONVERT_ALLOC:
+            // Same shape as convert_string_htoz in escr1extract.cpp, with one pass over
+            // the set standing in for one script's lifetime.
+            for (uint i = 0; i < set->index.size(); ++i) {
+                const uchar * src = &set->data[set->index[i]];
+                uint size = 2 * (uint)strlen((const char *)src) + 1;
+                uchar * str = (uchar *)bench_arena_alloc(&convert_arena, size);
+                escr1_convert_htoz(src, str, size);
+                sink += str[0];
+            }
+            bench_arena_reset(&convert_arena);
+            break;
+        case KERNEL_LOOKUP:
+            for (uint i = 0; i < set->index.size(); ++i) {
+                const char * str;
+                if (escr1_lookup_string(&set->script, i, &str)) sink += (uchar)*str;
+            }
+            break;
+    }
+    return sink;
+}
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct kernel_result {
+    double seconds;
+    uint64_t passes;
+};
+
+// Repeats passes until min_seconds have gone by, after one untimed warm-up pass.
+static kernel_result time_kernel(uint kernel, string_set * set, double min_seconds, uint64_t * sink) {
+    *sink += run_kernel(kernel, set);
+
+    kernel_result r;
+    r.passes = 0;
+    bench_clock::time_point start = bench_clock::now();
+    do {
+        *sink += run_kernel(kernel, set);
+        r.passes++;
+        r.seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+    } while (r.seconds < min_seconds);
+    return r;
+}
+
+// MAIN
+
+void usage(const char * argv0) {
+    fprintf(stderr, "USAGE:  %s [options]\n\n", argv0);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "--help    | -h    Show this listing and exit.\n");
+    fprintf(stderr, "--count N         Strings per input set (default 4096).\n");
+    fprintf(stderr, "--time S          Minimum seconds per kernel and input (default 0.2).\n");
+    fprintf(stderr, "--seed N          Generator seed (default 1).\n");
+    fprintf(stderr, "--check-only      Run the cross-check and exit.\n");
+}
+
+int main(int argc, char ** argv) {
+    uint count = 4096;
+    double min_seconds = 0.2;
+    uint seed = 1;
+    bool check_only = false;
+
+    for (int i = 1; i < argc; ++i) {
+        bool has_arg = i + 1 < argc;
+        if (!strcmp(argv[i], "--count") && has_arg) {
+            count = (uint)strtoul(argv[++i], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "--time") && has_arg) {
+            min_seconds = atof(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--seed") && has_arg) {
+            seed = (uint)strtoul(argv[++i], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "--check-only")) {
+            check_only = true;
+        }
+        else {
+            usage(argv[0]);
+            exit(!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h") ? 0 : 1);
+        }
+    }
+    if (count == 0) count = 1;
+
+    fprintf(stderr, "ESCR1 Microbenchmark %s\n\n", version);
+
+    rng r;
+    r.state = seed ? seed : 1;
+    string_set sets[INPUT_COUNT];
+    for (uint k = 0; k < INPUT_COUNT; ++k) {
+        generate_set(&r, k, count, &sets[k]);
+    }
+
+    cross_check(&r, sets);
+    if (check_failures) {
+        fprintf(stderr, "Cross-check failed: %u mismatches against the reference kernels\n", check_failures);
+        return 1;
+    }
+    fprintf(stderr, "Cross-check passed\n");
+    if (check_only) {
+        return 0;
+    }
+
+    uint64_t sink = 0;
+    for (uint kernel = 0; kernel < KERNEL_COUNT; ++kernel) {
+        for (uint k = 0; k < INPUT_COUNT; ++k) {
+            string_set * set = &sets[k];
+            kernel_result res = time_kernel(kernel, set, min_seconds, &sink);
+            double per_pass = res.seconds / res.passes;
+            printf("{\"version\":\"%s\",\"kernel\":\"%s\",\"input\":\"%s\",\"strings\":%u,\"bytes\":%llu,"
+                   "\"passes\":%llu,\"ns_per_string\":%.2f",
+                   version, kernel_names[kernel], input_names[k], (uint)set->index.size(),
+                   (unsigned long long)set->bytes, (unsigned long long)res.passes,
+                   per_pass * 1e9 / set->index.size());
+            if (kernel != KERNEL_LOOKUP) {
+                printf(",\"mb_per_s\":%.2f", per_pass > 0 ? set->bytes / per_pass / (1024.0 * 1024.0) : 0.0);
+            }
+            printf("}\n");
+        }
+    }
+
+    // Keeps sink live without printing anything that changes between runs.
+    return sink == 1 ? 2 : 0;
+}
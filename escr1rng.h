@@ -0,0 +1,44 @@
+#ifndef ESCR1RNG_H
+#define ESCR1RNG_H
+
+// escr1rng -- helpers for the tools that generate their own inputs: escr1bench,
+// escr1microbench, escr1fuzz's standalone driver and escr1trace's bench.
+//
+// Header only; nothing to build.
+
+#include <cstring>
+#include <vector>
+
+#include "libescr1.h"
+
+// xorshift32, so generated inputs are the same on every platform for a given seed.
+struct rng {
+    uint state;
+};
+
+static inline uint rng_next(rng * r) {
+    uint x = r->state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    r->state = x;
+    return x;
+}
+
+static inline uint rng_range(rng * r, uint n) {
+    return rng_next(r) % n;
+}
+
+// In [0, 1).
+static inline double rng_unit(rng * r) {
+    return (rng_next(r) >> 8) * (1.0 / 16777216.0);
+}
+
+// Little endian, as in script files.
+static inline void append_uint(std::vector<uchar> * out, uint v) {
+    uchar p[4];
+    memcpy(p, &v, 4);
+    out->insert(out->end(), p, p + 4);
+}
+
+#endif // ESCR1RNG_H
@@ -0,0 +1,507 @@
+// escr1trace -- records, replays and dumps escr1vm execution traces.
+//
+//   record SCRIPT TRACE   Runs SCRIPT from the start and writes its trace to TRACE.
+//                         USR_SELECT (if the --profile has one) is answered from
+//                         --select; other user ops push nothing.
+//   replay SCRIPT TRACE   Runs SCRIPT again, answering user ops with the values TRACE
+//                         recorded, and checks that it takes the same path.  Prints
+//                         the first record that differs, if any.  Refuses --ring traces
+//                         that dropped chunks, as they don't start at the start.
+//   dump TRACE [SCRIPT]   Prints TRACE one record per line, with block offsets if
+//                         SCRIPT is given.
+//   bench                 Times escr1vm on a generated script with and without tracing,
+//                         and prints one JSON object per run.
+//
+// See "TRACING" in escr1vm.h for the format.
+//
+// Compile with:
+// $ g++ -O2 ./escr1trace.cpp ./escr1vm.cpp ./libescr1.cpp -o escr1trace.exe -std=c++0x
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include <vector>
+
+#include "libescr1.h"
+#include "escr1vm.h"
+#include "escr1rng.h"
+
+const char * version = "v0.1";
+
+static escr1_opset opset;
+static uint select_op = 0;      // 0 if the opset has no USR_SELECT
+
+static const char * kind_names[] = { "block", "user", "arg", "result" };
+
+// Trimmed, for printing.
+static void print_op_name(uint op) {
+    const char * name = opset.names[op];
+    int len = (int)strlen(name);
+    while (len > 0 && name[len - 1] == ' ') len--;
+    printf("%.*s", len, name);
+}
+
+static const char * status_name(const escr1_vm * vm) {
+    switch (vm->status) {
+        case VM_HALTED: return "ended";
+        case VM_ERROR: return vm->error;
+        default: return "stopped";
+    }
+}
+
+static bool read_file(const char * filename, std::vector<uchar> * out) {
+    FILE * fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open file: [%s]\n", filename);
+        return false;
+    }
+    uchar chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        out->insert(out->end(), chunk, chunk + n);
+    }
+    fclose(fp);
+    return true;
+}
+
+static void open_script(const char * filename, mapped_file * map, script_file * script) {
+    escr1_status status = escr1_open_path(filename, map, script);
+    if (status != ESCR1_OK) {
+        fprintf(stderr, "%s: [%s]\n", escr1_status_string(status), filename);
+        exit(1);
+    }
+}
+
+static void open_trace(const char * filename, std::vector<uchar> * data, escr1_trace_reader * reader) {
+    if (!read_file(filename, data)) exit(1);
+    if (!escr1_trace_open(reader, data->empty() ? NULL : &(*data)[0], data->size())) {
+        fprintf(stderr, "Not a trace file: [%s]\n", filename);
+        exit(1);
+    }
+}
+
+// RECORD
+
+struct select_answers {
+    std::vector<int> choices;
+    uint next;
+};
+
+static void answer_select(escr1_vm * vm, uint op, const int *, uint, void * user) {
+    select_answers * a = (select_answers *)user;
+    if (op != select_op) return;
+    int choice = a->choices.empty() ? 0 : a->choices[a->next++ % a->choices.size()];
+    escr1_vm_push(vm, choice);
+}
+
+static int record(const char * script_name, const char * trace_name, const std::vector<int> & choices,
+                  uint chunk_size, uint ring) {
+    mapped_file map;
+    script_file script;
+    open_script(script_name, &map, &script);
+
+    static escr1_vm vm;
+    escr1_vm_load(&vm, &script, &opset);
+    select_answers answers;
+    answers.choices = choices;
+    answers.next = 0;
+    vm.user_fn = answer_select;
+    vm.user = &answers;
+
+    FILE * fp = fopen(trace_name, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open file: [%s]\n", trace_name);
+        exit(1);
+    }
+    // With --ring, only the newest chunks are kept, and only written at the end.
+    static escr1_trace trace;
+    escr1_trace_init(&trace, &script, chunk_size, ring ? ring : 2, ring ? NULL : fp);
+    escr1_vm_trace(&vm, &trace);
+    escr1_vm_run(&vm);
+    if (ring) escr1_trace_save(&trace, fp);
+    else escr1_trace_flush(&trace);
+    bool ok = !ferror(fp);
+    fclose(fp);
+
+    fprintf(stderr, "%s: %s at %08x after %u selects", script_name, status_name(&vm),
+            vm.insns[vm.pc].offset, answers.next);
+    if (trace.dropped) fprintf(stderr, ", %llu oldest chunks dropped", (unsigned long long)trace.dropped);
+    fprintf(stderr, "\n");
+    escr1_unmap_file(&map);
+    return ok ? 0 : 1;
+}
+
+// REPLAY
+
+// What the host answered each user op with, in order.
+struct recorded_calls {
+    std::vector<uint> ops;
+    std::vector<uint> first_result;     // Index into results; one extra at the end
+    std::vector<int> results;
+    uint next;
+    bool diverged;
+};
+
+static void answer_recorded(escr1_vm * vm, uint op, const int *, uint, void * user) {
+    recorded_calls * r = (recorded_calls *)user;
+    if (r->next >= r->ops.size() || r->ops[r->next] != op) {
+        r->diverged = true;
+        escr1_vm_stop(vm, VM_STOPPED, NULL);
+        return;
+    }
+    for (uint i = r->first_result[r->next]; i < r->first_result[r->next + 1]; ++i) {
+        escr1_vm_push(vm, r->results[i]);
+    }
+    r->next++;
+}
+
+static void print_record(trace_kind kind, uint value) {
+    printf("%s ", kind_names[kind]);
+    if (kind == TRACE_USER) print_op_name(value);
+    else if (kind == TRACE_BLOCK) printf("%u", value);
+    else printf("%d", (int)value);
+}
+
+static int replay(const char * script_name, const char * trace_name) {
+    mapped_file map;
+    script_file script;
+    open_script(script_name, &map, &script);
+
+    std::vector<uchar> data;
+    escr1_trace_reader original;
+    open_trace(trace_name, &data, &original);
+    if (original.code_size != script.code_size || original.code_hash != escr1_trace_script_hash(&script)) {
+        fprintf(stderr, "[%s] was not recorded from [%s]\n", trace_name, script_name);
+        exit(1);
+    }
+    if (original.dropped) {
+        // The answers to the user ops before it are gone, so there's no way to get there.
+        fprintf(stderr, "[%s] starts at record %llu, after %llu chunks its --ring dropped, and can't be replayed.  "
+                "Record it without --ring, or with a bigger one.\n",
+                trace_name, (unsigned long long)original.first_record, (unsigned long long)original.dropped);
+        exit(1);
+    }
+
+    recorded_calls calls;
+    calls.next = 0;
+    calls.diverged = false;
+    trace_kind kind;
+    uint value;
+    while (escr1_trace_next(&original, &kind, &value)) {
+        if (kind == TRACE_USER) {
+            calls.ops.push_back(value);
+            calls.first_result.push_back((uint)calls.results.size());
+        }
+        else if (kind == TRACE_RESULT) {
+            calls.results.push_back((int)value);
+        }
+    }
+    calls.first_result.push_back((uint)calls.results.size());
+    if (original.error) {
+        fprintf(stderr, "%s in [%s]\n", original.error, trace_name);
+        exit(1);
+    }
+
+    // Record the replay too, and compare the two record by record.
+    FILE * tmp = tmpfile();
+    if (tmp == NULL) {
+        fprintf(stderr, "Failed to create a temporary file\n");
+        exit(1);
+    }
+    static escr1_vm vm;
+    escr1_vm_load(&vm, &script, &opset);
+    vm.user_fn = answer_recorded;
+    vm.user = &calls;
+    static escr1_trace trace;
+    escr1_trace_init(&trace, &script, 1 << 16, 2, tmp);
+    escr1_vm_trace(&vm, &trace);
+    escr1_vm_run(&vm);
+    escr1_trace_flush(&trace);
+
+    std::vector<uchar> again;
+    rewind(tmp);
+    uchar chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), tmp)) > 0) {
+        again.insert(again.end(), chunk, chunk + n);
+    }
+    fclose(tmp);
+
+    escr1_trace_reader a, b;
+    escr1_trace_open(&a, &data[0], data.size());
+    escr1_trace_open(&b, &again[0], again.size());
+    for (uint64_t i = 0;; ++i) {
+        trace_kind ka, kb;
+        uint va, vb;
+        bool has_a = escr1_trace_next(&a, &ka, &va);
+        bool has_b = escr1_trace_next(&b, &kb, &vb);
+        if (!has_a && !has_b) break;
+        if (has_a != has_b || ka != kb || va != vb) {
+            printf("Diverged at record %llu: recorded ", (unsigned long long)i);
+            if (has_a) print_record(ka, va);
+            else printf("end");
+            printf(", replayed ");
+            if (has_b) print_record(kb, vb);
+            else printf("end");
+            printf(" (%s at %08x)\n", calls.diverged ? "user op mismatch" : status_name(&vm), vm.insns[vm.pc].offset);
+            escr1_unmap_file(&map);
+            return 1;
+        }
+    }
+    printf("Replayed %u user op calls, same path (%s at %08x)\n", calls.next, status_name(&vm), vm.insns[vm.pc].offset);
+    escr1_unmap_file(&map);
+    return 0;
+}
+
+// DUMP
+
+static int dump(const char * trace_name, const char * script_name) {
+    std::vector<uchar> data;
+    escr1_trace_reader reader;
+    open_trace(trace_name, &data, &reader);
+
+    mapped_file map;
+    script_file script;
+    static escr1_vm vm;
+    if (script_name) {
+        open_script(script_name, &map, &script);
+        if (reader.code_hash != escr1_trace_script_hash(&script)) {
+            fprintf(stderr, "Warning: [%s] was not recorded from [%s]\n", trace_name, script_name);
+        }
+        escr1_vm_load(&vm, &script, &opset);
+    }
+
+    printf("code size %08x, hash %08x\n", reader.code_size, reader.code_hash);
+    if (reader.dropped) {
+        printf("starts at record %llu, after %llu dropped chunks\n",
+               (unsigned long long)reader.first_record, (unsigned long long)reader.dropped);
+    }
+    trace_kind kind;
+    uint value;
+    while (escr1_trace_next(&reader, &kind, &value)) {
+        print_record(kind, value);
+        if (kind == TRACE_BLOCK && script_name && value < vm.count) {
+            printf("\t%08x", vm.insns[value].offset);
+        }
+        printf("\n");
+    }
+    if (script_name) escr1_unmap_file(&map);
+    if (reader.error) {
+        fprintf(stderr, "%s at byte %u\n", reader.error, (uint)reader.pos);
+        return 1;
+    }
+    return 0;
+}
+
+// BENCH
+
+static void append_op(std::vector<uchar> * code, uint op) {
+    code->push_back((uchar)op);
+}
+
+static void append_op(std::vector<uchar> * code, uint op, uint param) {
+    uchar p[4];
+    memcpy(p, &param, 4);
+    code->push_back((uchar)op);
+    code->insert(code->end(), p, p + 4);
+}
+
+// A loop shaped like a scene: a message per pass, some var arithmetic, a conditional
+// flag, a subroutine call.  About 50 instructions and 4 to 5 branches taken per pass.
+static void bench_script(uint iterations, std::vector<uchar> * out) {
+    const uint USR_MES = ROP_COUNT + 8;
+    std::vector<uchar> code;
+    append_op(&code, ROP_PUSH, 1); append_op(&code, ROP_PUSH, 0); append_op(&code, ROP_SETVAR);
+
+    uint loop = (uint)code.size();
+    append_op(&code, ROP_FILELINE, 1);
+    append_op(&code, ROP_STR, 0); append_op(&code, USR_MES);
+    append_op(&code, ROP_PUSH, 2); append_op(&code, ROP_PUSH, 2); append_op(&code, ROP_GETVAR);
+    append_op(&code, ROP_PUSH, 3); append_op(&code, ROP_MUL); append_op(&code, ROP_PUSH, 7);
+    append_op(&code, ROP_ADD); append_op(&code, ROP_PUSH, 1023); append_op(&code, ROP_AND);
+    append_op(&code, ROP_SETVAR);
+    append_op(&code, ROP_PUSH, 2); append_op(&code, ROP_GETVAR); append_op(&code, ROP_PUSH, 500);
+    append_op(&code, ROP_GT);
+    size_t skip_at = code.size();
+    append_op(&code, ROP_JUMPZ, 0);
+    append_op(&code, ROP_PUSH, 3); append_op(&code, ROP_PUSH, 1); append_op(&code, ROP_SETFLAG);
+    uint skip = (uint)code.size();
+    size_t sub_at = code.size();
+    append_op(&code, ROP_CALL, 0);
+    append_op(&code, ROP_PUSH, 1); append_op(&code, ROP_PUSH, 1); append_op(&code, ROP_GETVAR);
+    append_op(&code, ROP_PUSH, 1); append_op(&code, ROP_ADD); append_op(&code, ROP_SETVAR);
+    append_op(&code, ROP_PUSH, 1); append_op(&code, ROP_GETVAR); append_op(&code, ROP_PUSH, iterations);
+    append_op(&code, ROP_LT);
+    size_t end_at = code.size();
+    append_op(&code, ROP_JUMPZ, 0);
+    append_op(&code, ROP_JUMP, loop);
+
+    uint sub = (uint)code.size();
+    append_op(&code, ROP_PUSH, 4); append_op(&code, ROP_PUSH, 4); append_op(&code, ROP_GETFLAG);
+    append_op(&code, ROP_PUSH, 3); append_op(&code, ROP_GETFLAG); append_op(&code, ROP_LOR);
+    append_op(&code, ROP_SETVAR); append_op(&code, ROP_RET);
+    uint end = (uint)code.size();
+    append_op(&code, ROP_END);
+
+    memcpy(&code[skip_at + 1], &skip, 4);
+    memcpy(&code[sub_at + 1], &sub, 4);
+    memcpy(&code[end_at + 1], &end, 4);
+
+    static const char text[] = "\x82\xa0\x82\xa2";
+    out->assign(magic, magic + 8);
+    append_uint(out, 1);
+    append_uint(out, 0);
+    append_uint(out, (uint)code.size());
+    out->insert(out->end(), code.begin(), code.end());
+    append_uint(out, sizeof(text));
+    out->insert(out->end(), text, text + sizeof(text));
+}
+
+static double time_run(escr1_vm * vm, escr1_trace * trace) {
+    escr1_vm_reset(vm);
+    escr1_vm_trace(vm, trace);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    escr1_vm_run(vm);
+    if (trace) escr1_trace_flush(trace);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    escr1_vm_trace(vm, NULL);
+    if (vm->status != VM_HALTED) {
+        fprintf(stderr, "Bench script failed: %s\n", status_name(vm));
+        exit(1);
+    }
+    return seconds;
+}
+
+static int bench(uint iterations, uint runs) {
+    std::vector<uchar> buf;
+    bench_script(iterations, &buf);
+    script_file script;
+    if (escr1_open_memory(&buf[0], buf.size(), &script) != ESCR1_OK) {
+        fprintf(stderr, "Bench script failed to parse\n");
+        exit(1);
+    }
+    // The script is generated with SENSUIBU's op numbers, whatever --profile says.
+    static escr1_opset sensuibu;
+    escr1_opset_init(&sensuibu, SENSUIBU_OPS, SENSUIBU_OP_COUNT);
+    static escr1_vm vm;
+    escr1_vm_load(&vm, &script, &sensuibu);
+
+    FILE * sink = tmpfile();
+    if (sink == NULL) {
+        fprintf(stderr, "Failed to create a temporary file\n");
+        exit(1);
+    }
+    static escr1_trace trace;
+
+    // Interleaved, best of runs, so drift hits both the same.
+    double best[2] = { 1e30, 1e30 };
+    for (uint i = 0; i < runs; ++i) {
+        best[0] = std::min(best[0], time_run(&vm, NULL));
+        rewind(sink);
+        escr1_trace_init(&trace, &script, 1 << 16, 2, sink);
+        best[1] = std::min(best[1], time_run(&vm, &trace));
+    }
+    long trace_bytes = ftell(sink);
+    fclose(sink);
+
+    printf("{\"name\": \"untraced\", \"iterations\": %u, \"seconds\": %.6f}\n", iterations, best[0]);
+    printf("{\"name\": \"traced\", \"iterations\": %u, \"seconds\": %.6f, \"trace_bytes\": %ld, \"overhead\": %.4f}\n",
+           iterations, best[1], trace_bytes, best[1] / best[0] - 1);
+    return 0;
+}
+
+// MAIN
+
+void usage(const char * argv0) {
+    fprintf(stderr, "escr1trace %s\n", version);
+    fprintf(stderr, "USAGE:  %s record SCRIPT TRACE [options]\n", argv0);
+    fprintf(stderr, "        %s replay SCRIPT TRACE\n", argv0);
+    fprintf(stderr, "        %s dump TRACE [SCRIPT]\n", argv0);
+    fprintf(stderr, "        %s bench [options]\n\n", argv0);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "--help    | -h    Show this listing and exit.\n");
+    fprintf(stderr, "--profile P       User opcode profile: sensuibu (the default), or a profile file.\n");
+    fprintf(stderr, "--select N,...    Answers to USR_SELECT, in order, repeating (default 0).\n");
+    fprintf(stderr, "--chunk BYTES     Trace chunk size (default 65536).\n");
+    fprintf(stderr, "--ring N          Keep only the newest N chunks, and write them at the end.\n");
+    fprintf(stderr, "--iterations N    Bench loop passes (default 2000000).\n");
+    fprintf(stderr, "--runs N          Bench runs of each kind; the best counts (default 5).\n");
+}
+
+int main(int argc, char ** argv) {
+    std::vector<const char *> args;
+    std::vector<int> choices;
+    uint chunk_size = 1 << 16;
+    uint ring = 0;
+    uint iterations = 2000000;
+    uint runs = 5;
+    const char * profile_arg = "sensuibu";
+
+    for (int i = 1; i < argc; ++i) {
+        bool has_arg = i + 1 < argc;
+        if (!strcmp(argv[i], "--profile") && has_arg) {
+            profile_arg = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--select") && has_arg) {
+            for (char * p = argv[++i]; *p;) {
+                choices.push_back((int)strtol(p, &p, 10));
+                if (*p == ',') p++;
+                else if (*p) {
+                    fprintf(stderr, "Bad --select [%s], expected N,N,...\n", argv[i]);
+                    exit(1);
+                }
+            }
+        }
+        else if (!strcmp(argv[i], "--chunk") && has_arg) {
+            chunk_size = (uint)strtoul(argv[++i], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "--ring") && has_arg) {
+            ring = (uint)strtoul(argv[++i], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "--iterations") && has_arg) {
+            iterations = (uint)strtoul(argv[++i], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "--runs") && has_arg) {
+            runs = (uint)strtoul(argv[++i], NULL, 10);
+        }
+        else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            exit(!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h") ? 0 : 1);
+        }
+        else {
+            args.push_back(argv[i]);
+        }
+    }
+
+    static escr1_profile profile;
+    escr1_status status = escr1_select_profile(profile_arg, &profile);
+    if (status != ESCR1_OK) {
+        fprintf(stderr, "%s: [%s]", escr1_status_string(status), profile_arg);
+        if (profile.error_line) fprintf(stderr, " line %u", profile.error_line);
+        fprintf(stderr, "\n");
+        exit(1);
+    }
+    escr1_opset_init(&opset, profile.ops, profile.count);
+    for (uint op = ROP_COUNT; op < 256; ++op) {
+        if (!strncmp(opset.names[op], "USR_SELECT", 10)) select_op = op;
+    }
+
+    const char * mode = args.empty() ? "" : args[0];
+    if (!strcmp(mode, "record") && args.size() == 3) {
+        return record(args[1], args[2], choices, chunk_size, ring);
+    }
+    if (!strcmp(mode, "replay") && args.size() == 3) {
+        return replay(args[1], args[2]);
+    }
+    if (!strcmp(mode, "dump") && (args.size() == 2 || args.size() == 3)) {
+        return dump(args[1], args.size() == 3 ? args[2] : NULL);
+    }
+    if (!strcmp(mode, "bench") && args.size() == 1) {
+        return bench(iterations, runs ? runs : 1);
+    }
+    usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,586 @@
+#include "escr1vm.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Deep enough for any real script; past it the script is assumed to be runaway.
+static const size_t VM_MAX_STACK = 1 << 20;
+static const size_t VM_MAX_CALLS = 1 << 16;
+
+bool escr1_vm_stop(escr1_vm * vm, vm_status status, const char * error) {
+    vm->status = status;
+    vm->error = error;
+    return false;
+}
+
+// HANDLERS
+
+static inline bool vm_pop(escr1_vm * vm, int * v) {
+    if (vm->stack.empty()) return false;
+    *v = vm->stack.back();
+    vm->stack.pop_back();
+    return true;
+}
+
+static inline bool vm_pop2(escr1_vm * vm, int * a, int * b) {
+    size_t n = vm->stack.size();
+    if (n < 2) return false;
+    *a = vm->stack[n - 2];
+    *b = vm->stack[n - 1];
+    vm->stack.resize(n - 2);
+    return true;
+}
+
+static inline bool vm_pushed(escr1_vm * vm, int v) {
+    if (vm->stack.size() >= VM_MAX_STACK) return escr1_vm_stop(vm, VM_ERROR, "Stack overflow");
+    vm->stack.push_back(v);
+    vm->pc++;
+    return true;
+}
+
+static bool vm_underflow(escr1_vm * vm) {
+    return escr1_vm_stop(vm, VM_ERROR, "Stack underflow");
+}
+
+static bool op_end(escr1_vm * vm, const vm_insn *) {
+    return escr1_vm_stop(vm, VM_HALTED, NULL);
+}
+
+static bool op_jump(escr1_vm * vm, const vm_insn * in) {
+    vm->pc = in->param;
+    return true;
+}
+
+static bool op_jumpz(escr1_vm * vm, const vm_insn * in) {
+    int v;
+    if (!vm_pop(vm, &v)) return vm_underflow(vm);
+    vm->pc = v == 0 ? in->param : vm->pc + 1;
+    return true;
+}
+
+static bool op_call(escr1_vm * vm, const vm_insn * in) {
+    if (vm->calls.size() >= VM_MAX_CALLS) return escr1_vm_stop(vm, VM_ERROR, "Call stack overflow");
+    vm->calls.push_back(vm->pc + 1);
+    vm->pc = in->param;
+    return true;
+}
+
+static bool op_ret(escr1_vm * vm, const vm_insn *) {
+    if (vm->calls.empty()) return escr1_vm_stop(vm, VM_HALTED, NULL);
+    vm->pc = vm->calls.back();
+    vm->calls.pop_back();
+    return true;
+}
+
+static bool op_push(escr1_vm * vm, const vm_insn * in) {
+    return vm_pushed(vm, (int)in->param);
+}
+
+static bool op_pop(escr1_vm * vm, const vm_insn *) {
+    int v;
+    if (!vm_pop(vm, &v)) return vm_underflow(vm);
+    vm->pc++;
+    return true;
+}
+
+static bool op_setvar(escr1_vm * vm, const vm_insn *) {
+    int id, v;
+    if (!vm_pop2(vm, &id, &v)) return vm_underflow(vm);
+    vm->vars[(uint)id] = v;
+    vm->pc++;
+    return true;
+}
+
+static bool op_getvar(escr1_vm * vm, const vm_insn *) {
+    int id;
+    if (!vm_pop(vm, &id)) return vm_underflow(vm);
+    std::unordered_map<uint, int>::const_iterator it = vm->vars.find((uint)id);
+    return vm_pushed(vm, it == vm->vars.end() ? 0 : it->second);
+}
+
+static bool op_setflag(escr1_vm * vm, const vm_insn *) {
+    int id, v;
+    if (!vm_pop2(vm, &id, &v)) return vm_underflow(vm);
+    vm->flags[(uint)id] = v;
+    vm->pc++;
+    return true;
+}
+
+static bool op_getflag(escr1_vm * vm, const vm_insn *) {
+    int id;
+    if (!vm_pop(vm, &id)) return vm_underflow(vm);
+    std::unordered_map<uint, int>::const_iterator it = vm->flags.find((uint)id);
+    return vm_pushed(vm, it == vm->flags.end() ? 0 : it->second);
+}
+
+#define VM_UNARY(name, expr) \
+    static bool name(escr1_vm * vm, const vm_insn *) { \
+        if (vm->stack.empty()) return vm_underflow(vm); \
+        int a = vm->stack.back(); \
+        vm->stack.back() = (expr); \
+        vm->pc++; \
+        return true; \
+    }
+
+// Arithmetic wraps like the engine's 32-bit registers would, not like signed C++.
+#define VM_BINARY(name, expr) \
+    static bool name(escr1_vm * vm, const vm_insn *) { \
+        int a, b; \
+        if (!vm_pop2(vm, &a, &b)) return vm_underflow(vm); \
+        vm->stack.push_back(expr); \
+        vm->pc++; \
+        return true; \
+    }
+
+VM_UNARY(op_neg, (int)(0u - (uint)a))
+VM_UNARY(op_not, ~a)
+VM_UNARY(op_lnot, !a)
+
+VM_BINARY(op_add, (int)((uint)a + (uint)b))
+VM_BINARY(op_sub, (int)((uint)a - (uint)b))
+VM_BINARY(op_mul, (int)((uint)a * (uint)b))
+VM_BINARY(op_and, a & b)
+VM_BINARY(op_or, a | b)
+VM_BINARY(op_shr, a >> (b & 31))
+VM_BINARY(op_shl, (int)((uint)a << (b & 31)))
+VM_BINARY(op_eq, a == b)
+VM_BINARY(op_ne, a != b)
+VM_BINARY(op_gt, a > b)
+VM_BINARY(op_ge, a >= b)
+VM_BINARY(op_lt, a < b)
+VM_BINARY(op_le, a <= b)
+VM_BINARY(op_land, a && b)
+VM_BINARY(op_lor, a || b)
+
+static bool op_div(escr1_vm * vm, const vm_insn *) {
+    int a, b;
+    if (!vm_pop2(vm, &a, &b)) return vm_underflow(vm);
+    if (b == 0) return escr1_vm_stop(vm, VM_ERROR, "Division by zero");
+    vm->stack.push_back(b == -1 ? (int)(0u - (uint)a) : a / b);
+    vm->pc++;
+    return true;
+}
+
+static bool op_mod(escr1_vm * vm, const vm_insn *) {
+    int a, b;
+    if (!vm_pop2(vm, &a, &b)) return vm_underflow(vm);
+    if (b == 0) return escr1_vm_stop(vm, VM_ERROR, "Division by zero");
+    vm->stack.push_back(b == -1 ? 0 : a % b);
+    vm->pc++;
+    return true;
+}
+
+static bool op_fileline(escr1_vm * vm, const vm_insn * in) {
+    vm->fileline = in->param;
+    vm->has_fileline = true;
+    vm->pc++;
+    return true;
+}
+
+static bool op_user(escr1_vm * vm, const vm_insn * in) {
+    int count = vm->opset->param_counts[in->op];
+    uint n = count < 0 ? in->param : (uint)count;
+    if (vm->stack.size() < n) return vm_underflow(vm);
+
+    // Copied out first, since user_fn may push.
+    size_t base = vm->stack.size() - n;
+    vm->args.assign(vm->stack.begin() + base, vm->stack.end());
+    vm->stack.resize(base);
+    vm->pc++;
+    if (vm->user_fn) {
+        vm->user_fn(vm, in->op, vm->args.empty() ? NULL : &vm->args[0], n, vm->user);
+        if (vm->stack.size() > VM_MAX_STACK) return escr1_vm_stop(vm, VM_ERROR, "Stack overflow");
+        return vm->status == VM_READY;
+    }
+    return true;
+}
+
+static bool op_unknown(escr1_vm * vm, const vm_insn *) {
+    return escr1_vm_stop(vm, VM_ERROR, "Undefined opcode");
+}
+
+static bool op_past_end(escr1_vm * vm, const vm_insn *) {
+    return escr1_vm_stop(vm, VM_ERROR, "Ran past the end of the code block");
+}
+
+static const vm_handler rop_handlers[ROP_COUNT] = {
+    op_end, op_jump, op_jumpz, op_call, op_ret, op_push, op_pop, op_push,
+    op_setvar, op_getvar, op_setflag, op_getflag,
+    op_neg, op_add, op_sub, op_mul, op_div, op_mod, op_and, op_or, op_not, op_shr, op_shl,
+    op_eq, op_ne, op_gt, op_ge, op_lt, op_le, op_lnot, op_land, op_lor,
+    op_fileline,
+};
+
+vm_handler escr1_vm_base_handler(uint op) {
+    if (op < ROP_COUNT) return rop_handlers[op];
+    if (op == VM_SLOT_END) return op_past_end;
+    return op < 256 ? op_user : op_unknown;
+}
+
+// LOADING AND RUNNING
+
+bool escr1_vm_load(escr1_vm * vm, const script_file * script, const escr1_opset * opset) {
+    vm->script = script;
+    vm->opset = opset;
+    vm->insns.clear();
+    vm->insns.reserve(script->code_size / 3 + 1);
+
+    escr1_iterator it;
+    escr1_iter_init(&it, script, opset);
+    opcode op;
+    while (escr1_iter_next(&it, &op)) {
+        vm_insn in;
+        in.offset = op.offset;
+        in.param = op.param;
+        in.op = (uchar)op.op;
+        in.pad = 0;
+        in.slot = (uint16_t)op.op;
+        vm->insns.push_back(in);
+    }
+    vm->count = (uint)vm->insns.size();
+
+    vm_insn end;
+    end.offset = script->code_size;
+    end.param = (uint)-1;
+    end.op = ROP_END;
+    end.pad = 0;
+    end.slot = (uint16_t)VM_SLOT_END;
+    vm->insns.push_back(end);
+
+    // Branches that don't land on an instruction go past the end, which stops the run there.
+    for (uint i = 0; i < vm->count; ++i) {
+        vm_insn * in = &vm->insns[i];
+        if (in->op == ROP_JUMP || in->op == ROP_JUMPZ || in->op == ROP_CALL) {
+            uint target = escr1_vm_find(vm, in->param);
+            in->param = (target < vm->count && vm->insns[target].offset == in->param) ? target : vm->count;
+        }
+    }
+
+    for (uint slot = 0; slot < VM_SLOTS; ++slot) {
+        vm->table[slot] = (slot < 256 && slot >= ROP_COUNT && !opset->defined[slot]) ? op_unknown : escr1_vm_base_handler(slot);
+    }
+
+    vm->user_fn = NULL;
+    vm->user = NULL;
+    vm->tool = NULL;
+    vm->trace = NULL;
+    escr1_vm_reset(vm);
+    return !escr1_iter_truncated(&it);
+}
+
+void escr1_vm_reset(escr1_vm * vm) {
+    vm->pc = 0;
+    vm->stack.clear();
+    vm->calls.clear();
+    vm->vars.clear();
+    vm->flags.clear();
+    vm->fileline = 0;
+    vm->has_fileline = false;
+    vm->status = VM_READY;
+    vm->error = NULL;
+}
+
+vm_status escr1_vm_run(escr1_vm * vm) {
+    if (vm->status != VM_READY && vm->status != VM_STOPPED) return vm->status;
+    vm->status = VM_READY;
+    const vm_insn * insns = &vm->insns[0];
+    const vm_handler * table = vm->table;
+    while (table[insns[vm->pc].slot](vm, &insns[vm->pc])) {}
+    return vm->status;
+}
+
+vm_status escr1_vm_step(escr1_vm * vm) {
+    if (vm->status != VM_READY && vm->status != VM_STOPPED) return vm->status;
+    vm->status = VM_READY;
+    const vm_insn * in = &vm->insns[vm->pc];
+    vm->table[in->slot](vm, in);
+    return vm->status;
+}
+
+struct vm_by_offset {
+    bool operator()(uint offset, const vm_insn & in) const { return offset < in.offset; }
+};
+
+uint escr1_vm_find(const escr1_vm * vm, uint offset) {
+    if (vm->count == 0 || offset < vm->insns[0].offset || offset >= vm->script->code_size) return vm->count;
+    std::vector<vm_insn>::const_iterator it =
+        std::upper_bound(vm->insns.begin(), vm->insns.begin() + vm->count, offset, vm_by_offset());
+    return (uint)(it - vm->insns.begin()) - 1;
+}
+
+// TRACING
+
+static const uchar trace_magic[8] = { 'E', 'S', 'C', 'R', 'T', 'R', '0', '0' };
+static const uint TRACE_MAX_RECORD = 5;     // 34 bits of varint
+
+static inline uint zigzag(int v) {
+    return ((uint)v << 1) ^ (uint)(v >> 31);
+}
+
+static inline int unzigzag(uint v) {
+    return (int)(v >> 1) ^ -(int)(v & 1);
+}
+
+static void write_uint(FILE * fp, uint v) {
+    uchar p[4];
+    memcpy(p, &v, 4);
+    fwrite(p, 1, 4, fp);
+}
+
+static void write_uint64(FILE * fp, uint64_t v) {
+    uchar p[8];
+    memcpy(p, &v, 8);
+    fwrite(p, 1, 8, fp);
+}
+
+static const uint TRACE_HEADER_SIZE = 32;
+
+static void write_trace_header(const escr1_trace * t, FILE * fp) {
+    fwrite(trace_magic, 1, sizeof(trace_magic), fp);
+    write_uint(fp, t->code_size);
+    write_uint(fp, t->code_hash);
+    write_uint64(fp, t->dropped);
+    write_uint64(fp, t->dropped_records);
+}
+
+static void write_chunk(FILE * fp, const uchar * data, uint size) {
+    write_uint(fp, size);
+    fwrite(data, 1, size, fp);
+}
+
+uint escr1_trace_script_hash(const script_file * script) {
+    uint h = 2166136261u;
+    for (uint i = 0; i < script->code_size; ++i) {
+        h = (h ^ script->code_ptr[i]) * 16777619u;
+    }
+    return h;
+}
+
+void escr1_trace_init(escr1_trace * t, const script_file * script, uint chunk_size, uint chunk_count, FILE * sink) {
+    t->chunk_size = chunk_size < 16 ? 16 : chunk_size;
+    t->chunk_count = chunk_count < 2 ? 2 : chunk_count;
+    t->ring.assign((size_t)t->chunk_size * t->chunk_count, 0);
+    t->lengths.assign(t->chunk_count, 0);
+    t->chunk = 0;
+    t->base = &t->ring[0];
+    t->pos = 0;
+    t->limit = t->chunk_size - TRACE_MAX_RECORD;
+    t->held = 0;
+    t->prev_block = 0;
+    t->sink = sink;
+    t->code_size = script->code_size;
+    t->code_hash = escr1_trace_script_hash(script);
+    t->dropped = 0;
+    t->dropped_records = 0;
+    for (uint op = 0; op < 256; ++op) t->next[op] = NULL;
+    if (sink) write_trace_header(t, sink);
+}
+
+// Closes the chunk being written and starts the next one.
+static void trace_seal(escr1_trace * t) {
+    if (t->pos == 0) return;
+    if (t->sink) {
+        write_chunk(t->sink, t->base, t->pos);
+    }
+    else {
+        t->lengths[t->chunk] = t->pos;
+        t->chunk = (t->chunk + 1) % t->chunk_count;
+        if (t->held == t->chunk_count - 1) {
+            // Counted here rather than as they're written: every record ends in the one
+            // byte of it below 0x80.
+            const uchar * p = &t->ring[(size_t)t->chunk * t->chunk_size];
+            for (uint i = 0; i < t->lengths[t->chunk]; ++i) t->dropped_records += p[i] < 0x80;
+            t->dropped++;
+        }
+        else {
+            t->held++;
+        }
+    }
+    t->base = &t->ring[(size_t)t->chunk * t->chunk_size];
+    t->pos = 0;
+    t->prev_block = 0;
+}
+
+static inline void trace_write(escr1_trace * t, uint kind, uint value) {
+    uint64_t v = ((uint64_t)value << 2) | kind;
+    uchar * p = t->base + t->pos;
+    while (v >= 0x80) {
+        *p++ = (uchar)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uchar)v;
+    t->pos = (uint)(p - t->base);
+}
+
+static inline void trace_put(escr1_trace * t, uint kind, uint value) {
+    if (t->pos > t->limit) trace_seal(t);
+    trace_write(t, kind, value);
+}
+
+static inline void trace_block(escr1_trace * t, uint block) {
+    if (t->pos > t->limit) trace_seal(t);
+    int delta = (int)(block - t->prev_block);
+    t->prev_block = block;
+    trace_write(t, TRACE_BLOCK, zigzag(delta));
+}
+
+// Branches that fall through to the next instruction, and ones that stop the run,
+// aren't recorded: replaying the same script gets them right on its own.
+static bool trace_branch(escr1_vm * vm, const vm_insn * in) {
+    uint next = vm->pc + 1;
+    if (!vm->trace->next[in->op](vm, in)) return false;
+    if (vm->pc != next) trace_block(vm->trace, vm->pc);
+    return true;
+}
+
+// The same, for when nothing else has patched the branch ops.  They run the branch
+// themselves rather than pay for a second indirect call on every one.
+static bool trace_jump(escr1_vm * vm, const vm_insn * in) {
+    uint next = vm->pc + 1;
+    vm->pc = in->param;
+    if (vm->pc != next) trace_block(vm->trace, vm->pc);
+    return true;
+}
+
+static bool trace_jumpz(escr1_vm * vm, const vm_insn * in) {
+    int v;
+    if (!vm_pop(vm, &v)) return vm_underflow(vm);
+    uint next = vm->pc + 1;
+    vm->pc = v == 0 ? in->param : next;
+    if (vm->pc != next) trace_block(vm->trace, vm->pc);
+    return true;
+}
+
+static bool trace_call(escr1_vm * vm, const vm_insn * in) {
+    if (!op_call(vm, in)) return false;
+    if (vm->pc != vm->calls.back()) trace_block(vm->trace, vm->pc);
+    return true;
+}
+
+static bool trace_ret(escr1_vm * vm, const vm_insn * in) {
+    uint next = vm->pc + 1;
+    if (!op_ret(vm, in)) return false;
+    if (vm->pc != next) trace_block(vm->trace, vm->pc);
+    return true;
+}
+
+static bool trace_user(escr1_vm * vm, const vm_insn * in) {
+    escr1_trace * t = vm->trace;
+    int count = vm->opset->param_counts[in->op];
+    uint n = count < 0 ? in->param : (uint)count;
+    size_t size = vm->stack.size();
+    if (size < n) return t->next[in->op](vm, in);
+
+    trace_put(t, TRACE_USER, in->op);
+    for (size_t i = size - n; i < size; ++i) {
+        trace_put(t, TRACE_ARG, zigzag(vm->stack[i]));
+    }
+    bool ok = t->next[in->op](vm, in);
+    for (size_t i = size - n; i < vm->stack.size(); ++i) {
+        trace_put(t, TRACE_RESULT, zigzag(vm->stack[i]));
+    }
+    return ok;
+}
+
+void escr1_vm_trace(escr1_vm * vm, escr1_trace * trace) {
+    static const uint branches[] = { ROP_JUMP, ROP_JUMPZ, ROP_CALL, ROP_RET };
+    if (vm->trace) {
+        for (uint i = 0; i < 4; ++i) vm->table[branches[i]] = vm->trace->next[branches[i]];
+        for (uint op = ROP_COUNT; op < 256; ++op) {
+            if (vm->trace->next[op]) vm->table[op] = vm->trace->next[op];
+        }
+    }
+    vm->trace = trace;
+    if (trace == NULL) return;
+
+    static const vm_handler direct[] = { trace_jump, trace_jumpz, trace_call, trace_ret };
+    for (uint i = 0; i < 4; ++i) {
+        uint op = branches[i];
+        trace->next[op] = vm->table[op];
+        vm->table[op] = vm->table[op] == escr1_vm_base_handler(op) ? direct[i] : trace_branch;
+    }
+    for (uint op = ROP_COUNT; op < 256; ++op) {
+        trace->next[op] = NULL;
+        if (vm->opset->defined[op]) {
+            trace->next[op] = vm->table[op];
+            vm->table[op] = trace_user;
+        }
+    }
+}
+
+void escr1_trace_flush(escr1_trace * t) {
+    trace_seal(t);
+    if (t->sink) fflush(t->sink);
+}
+
+bool escr1_trace_save(escr1_trace * t, FILE * fp) {
+    write_trace_header(t, fp);
+    for (uint i = 0; i < t->held; ++i) {
+        uint chunk = (t->chunk + t->chunk_count - t->held + i) % t->chunk_count;
+        write_chunk(fp, &t->ring[(size_t)chunk * t->chunk_size], t->lengths[chunk]);
+    }
+    if (t->pos) write_chunk(fp, t->base, t->pos);
+    return !ferror(fp);
+}
+
+static uint read_uint(const uchar * p) {
+    uint v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+bool escr1_trace_open(escr1_trace_reader * r, const uchar * data, size_t size) {
+    r->data = data;
+    r->size = size;
+    r->error = NULL;
+    if (size < TRACE_HEADER_SIZE || memcmp(data, trace_magic, sizeof(trace_magic))) return false;
+    r->code_size = read_uint(data + 8);
+    r->code_hash = read_uint(data + 12);
+    memcpy(&r->dropped, data + 16, 8);
+    memcpy(&r->first_record, data + 24, 8);
+    r->pos = TRACE_HEADER_SIZE;
+    r->chunk_end = TRACE_HEADER_SIZE;
+    r->prev_block = 0;
+    return true;
+}
+
+bool escr1_trace_next(escr1_trace_reader * r, trace_kind * kind, uint * value) {
+    while (r->pos == r->chunk_end) {
+        if (r->pos == r->size) return false;
+        if (r->size - r->pos < 4 || read_uint(r->data + r->pos) > r->size - r->pos - 4) {
+            r->error = "Truncated chunk";
+            return false;
+        }
+        r->chunk_end = r->pos + 4 + read_uint(r->data + r->pos);
+        r->pos += 4;
+        r->prev_block = 0;
+    }
+
+    uint64_t v = 0;
+    for (uint shift = 0;; shift += 7) {
+        if (r->pos == r->chunk_end || shift > 28) {
+            r->error = "Malformed record";
+            return false;
+        }
+        uchar b = r->data[r->pos++];
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) break;
+    }
+
+    *kind = (trace_kind)(v & 3);
+    *value = (uint)(v >> 2);
+    if (*kind == TRACE_BLOCK) {
+        r->prev_block += (uint)unzigzag(*value);
+        *value = r->prev_block;
+    }
+    else if (*kind == TRACE_USER) {
+        if (*value < ROP_COUNT || *value > 255) {
+            r->error = "Malformed record";
+            return false;
+        }
+    }
+    else {
+        *value = (uint)unzigzag(*value);
+    }
+    return true;
+}
@@ -0,0 +1,203 @@
+#ifndef ESCR1VM_H
+#define ESCR1VM_H
+
+// escr1vm -- a minimal interpreter for ESCR1_00 scripts, for running them outside the
+// engine under a debugger or tracer.
+//
+// A script is decoded once into an instruction array, with branch params resolved to
+// instruction indices.  Execution is a loop over a dispatch table: each instruction
+// names a table slot, and the loop calls whatever handler is in it, with no other
+// checks.  Tools change behavior by patching the table -- replacing the ROP_SETVAR
+// handler to watch writes, say -- or by pointing single instructions at one of their
+// own slots, which is how a debugger breaks at an offset.  Until something is patched
+// that costs nothing.
+//
+// Semantics are inferred from the bytecode, not taken from the engine:
+// - push and str push their param (str pushes the string id).
+// - setvar and setflag pop a value, then an id.  getvar and getflag pop an id and push
+//   the value; vars and flags that were never set read as 0.
+// - Binary ops pop b, then a, and push a OP b.  Comparisons and logic ops push 0 or 1.
+// - jumpz pops and jumps if the value is 0.  call pushes the return point on the call
+//   stack, ret pops it, and end (or ret with an empty call stack) stops.
+// - fileline records the current source mark.
+// - User ops pop their params (param_count of them, or as many as the immediate says
+//   for variadic ones) and pass them to the host's user_fn, which may push a result.
+//
+// Build along with libescr1:
+// $ g++ -c -O2 ./escr1vm.cpp -o escr1vm.o -std=c++0x
+
+#include <cstdio>
+#include <vector>
+#include <unordered_map>
+
+#include "libescr1.h"
+
+struct escr1_vm;
+struct escr1_trace;
+
+struct vm_insn {
+    uint offset;
+    uint param;         // For branches, the target instruction index.
+    uchar op;
+    uchar pad;
+    uint16_t slot;      // Dispatch table slot.  Normally op.
+};
+
+// Runs one instruction and advances vm->pc.  Returns false to stop the run loop, after
+// setting vm->status.
+typedef bool (*vm_handler)(escr1_vm * vm, const vm_insn * in);
+
+// Called for user ops.  args are in push order.
+typedef void (*vm_user_fn)(escr1_vm * vm, uint op, const int * args, uint count, void * user);
+
+// Slots 0-255 are the ops; the rest are for tools.
+static const uint VM_SLOT_END = 256;            // Past the last instruction
+static const uint VM_SLOT_TOOL = 257;
+static const uint VM_SLOTS = VM_SLOT_TOOL + 16;
+
+enum vm_status {
+    VM_READY = 0,
+    VM_HALTED,          // end, or ret from the top level
+    VM_STOPPED,         // A tool stopped the run
+    VM_ERROR,           // See vm->error
+};
+
+struct escr1_vm {
+    const script_file * script;
+    const escr1_opset * opset;
+    std::vector<vm_insn> insns;         // Followed by one VM_SLOT_END instruction
+    uint count;                         // Instructions, not counting that one
+    vm_handler table[VM_SLOTS];
+
+    uint pc;                            // Instruction index
+    std::vector<int> stack;
+    std::vector<uint> calls;            // Return points
+    std::vector<int> args;              // Scratch for user ops
+    std::unordered_map<uint, int> vars;
+    std::unordered_map<uint, int> flags;
+    uint fileline;                      // Param of the last fileline executed
+    bool has_fileline;
+
+    vm_status status;
+    const char * error;
+
+    vm_user_fn user_fn;
+    void * user;                        // For user_fn
+    void * tool;                        // For handlers a tool installs
+    escr1_trace * trace;                // See escr1_vm_trace
+};
+
+// Decodes script into vm and resets it.  Returns false if the code block ends in a
+// truncated instruction; the instructions before it still run.
+bool escr1_vm_load(escr1_vm * vm, const script_file * script, const escr1_opset * opset);
+
+// Back to the first instruction, with empty stacks, vars and flags.  The table and
+// any patched slots are left as they are.
+void escr1_vm_reset(escr1_vm * vm);
+
+// Runs until a handler stops it.
+vm_status escr1_vm_run(escr1_vm * vm);
+
+// Runs one instruction, through its slot.
+vm_status escr1_vm_step(escr1_vm * vm);
+
+// The handler the table starts with for op.
+vm_handler escr1_vm_base_handler(uint op);
+
+// Index of the instruction containing offset, or vm->count if there is none.
+uint escr1_vm_find(const escr1_vm * vm, uint offset);
+
+// For handlers and user_fn.
+bool escr1_vm_stop(escr1_vm * vm, vm_status status, const char * error);
+
+inline void escr1_vm_push(escr1_vm * vm, int v) {
+    vm->stack.push_back(v);
+}
+
+// TRACING
+//
+// A trace records what a run did, cheaply enough to leave on in playtest builds, so a
+// reported bug can be replayed.  It holds every non-sequential transfer of control (as
+// the block it lands in, which is that instruction's index), every user op call with its
+// args, and every value the host pushed in answer.  Those values -- USR_SELECT choices
+// among them -- are the only input the script doesn't determine itself.
+//
+// Each record is one varint: the value shifted left 2, with its trace_kind in the low
+// bits.  Block ids are zigzag deltas from the previous block, args and results zigzag
+// values.  Records go into fixed-size chunks kept in a ring.  Deltas restart at 0 in
+// each chunk, so chunks decode on their own.  A full chunk is flushed to the sink if
+// there is one; without one the ring keeps the newest chunks, overwriting the oldest,
+// and escr1_trace_save writes out what's left.
+//
+// Trace files are "ESCRTR00", the code block's size and escr1_trace_script_hash (a uint
+// each), the number of chunks the ring dropped before the first one in the file and the
+// number of records in them (a uint64_t each), then chunks, each a uint byte count
+// followed by its records.  A trace that dropped chunks starts mid-run, without the
+// answers to the user ops before it, so it can be read but not replayed.
+
+enum trace_kind {
+    TRACE_BLOCK = 0,    // Block id
+    TRACE_USER,         // User op
+    TRACE_ARG,          // One per arg, after TRACE_USER
+    TRACE_RESULT,       // One per value the host pushed, after the args
+};
+
+struct escr1_trace {
+    std::vector<uchar> ring;            // chunk_count chunks of chunk_size bytes
+    std::vector<uint> lengths;          // Bytes used in each chunk
+    uint chunk_size;
+    uint chunk_count;
+    uchar * base;                       // Chunk being written
+    uint chunk;                         // Its index in the ring
+    uint pos;                           // Write position in it
+    uint limit;                         // Past this there may not be room for a record
+    uint held;                          // Full chunks held in the ring
+    uint prev_block;
+    FILE * sink;
+    uint code_size;
+    uint code_hash;
+    uint64_t dropped;                   // Chunks overwritten without being saved
+    uint64_t dropped_records;           // Records in them
+    vm_handler next[256];               // What the tracing handlers hand off to
+};
+
+// FNV-1a of the code block, so a trace can be matched to its script.
+uint escr1_trace_script_hash(const script_file * script);
+
+// chunk_size is at least 16; chunk_count at least 2.  With a sink the header is written
+// to it now, and chunks as they fill; with NULL the trace stays in the ring.
+void escr1_trace_init(escr1_trace * trace, const script_file * script, uint chunk_size, uint chunk_count, FILE * sink);
+
+// Starts recording vm into trace, by patching the branch and user op entries of its table
+// over whatever is there.  With NULL, puts those entries back.  Patch the table for
+// anything else first.
+void escr1_vm_trace(escr1_vm * vm, escr1_trace * trace);
+
+// Ends the chunk being written early, so the sink has everything so far.
+void escr1_trace_flush(escr1_trace * trace);
+
+// For traces without a sink: writes a whole trace file of what the ring holds, the chunk
+// being written included, to fp.  Recording can go on afterwards.
+bool escr1_trace_save(escr1_trace * trace, FILE * fp);
+
+struct escr1_trace_reader {
+    const uchar * data;
+    size_t size;
+    size_t pos;
+    size_t chunk_end;
+    uint prev_block;
+    uint code_size;
+    uint code_hash;
+    uint64_t dropped;                   // Chunks recorded before the first in the file
+    uint64_t first_record;              // Records in them: the run's index of the first
+    const char * error;                 // Set if a read stopped on a malformed trace
+};
+
+// Returns false if data doesn't start with a trace header.
+bool escr1_trace_open(escr1_trace_reader * reader, const uchar * data, size_t size);
+
+// The next record.  Blocks come back as absolute ids; args and results as ints cast to
+// uint.  Returns false at the end of the trace, or with reader->error set on bad data.
+bool escr1_trace_next(escr1_trace_reader * reader, trace_kind * kind, uint * value);
+
+#endif // ESCR1VM_H
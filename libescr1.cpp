@@ -0,0 +1,609 @@
+#include "libescr1.h"
+
+#include <cstdlib>
+#include <cstdio>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+const uchar magic[9] = "ESCR1_00";
+
+const char * const ROP_NAMES[ROP_COUNT] = {
+    "end     ",
+    "jump    ",
+    "jumpz   ",
+    "call    ",
+    "ret     ",
+    "push    ",
+    "pop     ",
+    "str     ",
+    "setvar  ",
+    "getvar  ",
+    "setflag ",
+    "getflag ",
+    "neg     ",
+    "add     ",
+    "sub     ",
+    "mul     ",
+    "div     ",
+    "mod     ",
+    "and     ",
+    "or      ",
+    "not     ",
+    "shr     ",
+    "shl     ",
+    "eq      ",
+    "ne      ",
+    "gt      ",
+    "ge      ",
+    "lt      ",
+    "le      ",
+    "lnot    ",
+    "land    ",
+    "lor     ",
+    "fileline",
+};
+
+// SENSUIBU
+const usr_op SENSUIBU_OPS[] = {
+    { "USR_END      ", 1 },     // Ends current script, ???saves game state???
+    { "USR_JUMP     ", 1 },     // Jump into a different script
+    { "USR_CALL     ", 1 },     // Call into a different script
+    { "USR_AUTOPLAY ", 1 },     // Enable/disable auto mode
+    { "USR_FRAME    ", 1 },     // Update text frame (?what does this actually mean?)
+    { "USR_TEXT     ", 2 },     // Show or hide text frame, with optional time
+    { "USR_CLEAR    ", 1 },     // Clear message window
+    { "USR_GAP      ", 2 },     // Message windo whitespace??
+    { "USR_MES      ", 1 },     // Display text/name in message window.
+    { "USR_TLK      ", -1 },    // Sets character name/face in message window, setup for voice playback??
+    { "USR_MENU     ", 3 },     // Sets a menu option.  Params: menu id, option string, option enabled flag
+    { "USR_SELECT   ", 1 },     // Runs the actual selection task for a menu.
+    { "USR_LSF_INIT ", 1 },     // Initialize a sprite layer
+    { "USR_LSF_SET  ", -1 },    // Set flags for sprite layer (??)
+    { "USR_CG       ", -1 },    // Set up CG (sprites *AND* BG/EV)
+    { "USR_EM       ", 5 },     // Set character sprite expression (?)
+    { "USR_CLR      ", 1 },     // Clear flagged sprite layer(s)
+    { "USR_DISP     ", 3 },     // Screen transition
+    { "USR_PATH     ", -1 },    // Sets up interpolation for sprites (???)
+    { "USR_TRANS    ", 0 },     // Fade out layer (?)  TRANSITION, duh.
+    { "USR_BGMPLAY  ", 3 },     // Start BGM.  Params: id, fade time (for previous BGM?), start time
+    { "USR_BGMSTOP  ", 1 },     // Stop BGM.  Param: fade time
+    { "USR_BGMVOLUME", 2 },     // Set BGM volume, with optional fade
+    { "USR_BGMFX    ", 1 },     // Apply effect to BGM
+    { "USR_AMBPLAY  ", 3 },     //
+    { "USR_AMBSTOP  ", 1 },
+    { "USR_AMBVOLUME", 2 },
+    { "USR_AMBFX    ", 1 },
+    { "USR_SEPLAY   ", 5 },
+    { "USR_SESTOP   ", 2 },
+    { "USR_SEWAIT   ", 1 },
+    { "USR_SEVOLUME ", 3 },
+    { "USR_SEFX     ", 1 },
+    { "USR_VOCPLAY  ", 4 },
+    { "USR_VOCSTOP  ", 2 },
+    { "USR_VOCWAIT  ", 1 },
+    { "USR_VOCVOLUME", 3 },
+    { "USR_VOCFX    ", 1 },
+    { "USR_QUAKE    ", 4 },     // Screenshake effect
+    { "USR_FLASH    ", 2 },     // Flash effect
+    { "USR_FILTER   ", 2 },     // Image filter
+    { "USR_EFFECT   ", 1 },     // Particle effect
+    { "USR_SYNC     ", 2 },     // Wait for / cancel screen effects (disolve, quake, flash, trans).
+    { "USR_WAIT     ", 1 },     // Pause text ???
+    { "USR_MOVIE    ", 1 },     // Stop ADV mode, play movie (returns to ADV afterwards).
+    { "USR_CREDIT   ", 1 },     // Stop ADV mode, play credits
+    { "USR_EVENT    ", 1 },     // Unlock event CG
+    { "USR_SCENE    ", 1 },     // Unlock event scene
+    { "USR_TITLE    ", 1 },     // Display scene title
+    { "USR_NOTICE   ", 3 },     // Popup notices (?)
+    { "USR_SET_PASS ", 2 },     // Record progress???
+    { "USR_IS_PASS  ", 1 },
+    { "USR_AUTO_SAVE", 0 },     // Autosave
+    { "USR_PLACE    ", 1 },     // Display place name
+    { "USR_OPEN_NAME", 1 },
+    { "USR_NAME     ", 2 },
+    { "USR_DATE     ", 0 },     // Display (in-game) date
+    { "USR_HELP     ", -1 },    // Enable/disable help items
+
+    { "USR_PLATY_GAME", 1 },    // Run mini-game mode
+    { "USR_TRAINING", 0 },      // Run training mode
+    { "USR_SPECIAL_TRAINING", 0 },  // Run special training mode
+
+    { "USR_SET_GAME", 3 },
+    { "USR_WHATDAY", 0 },
+    { "USR_SET_UNIT", 4 },
+    { "USR_GET_UNIT", 3 },
+    { "USR_BTS_RESULT", 0 },
+    { "USR_GAME_SETTING", 1 },
+    { "USR_WATCH_ENEMY", 1 },
+    { "USR_RND_RT", 1 },
+};
+
+const uint SENSUIBU_OP_COUNT = sizeof(SENSUIBU_OPS) / sizeof(SENSUIBU_OPS[0]);
+
+static const char * unknown_op_name = "USR_UNKNOWN  ";
+
+void escr1_opset_init(escr1_opset * opset, const usr_op * usr_ops, uint usr_count) {
+    for (uint op = 0; op < 256; ++op) {
+        if (op < ROP_COUNT) {
+            bool param = op == ROP_JUMP  ||
+                         op == ROP_JUMPZ ||
+                         op == ROP_CALL  ||
+                         op == ROP_PUSH  ||
+                         op == ROP_STR   ||
+                         op == ROP_FILELINE;
+            opset->names[op] = ROP_NAMES[op];
+            opset->param_counts[op] = param ? 1 : 0;
+            opset->has_param[op] = param;
+            opset->defined[op] = 1;
+        }
+        else if (op - ROP_COUNT < usr_count) {
+            // User opcodes take an immediate param if param_count is negative.
+            const usr_op * u = &usr_ops[op - ROP_COUNT];
+            opset->names[op] = u->name;
+            opset->param_counts[op] = u->param_count;
+            opset->has_param[op] = u->param_count < 0;
+            opset->defined[op] = 1;
+        }
+        else {
+            opset->names[op] = unknown_op_name;
+            opset->param_counts[op] = 0;
+            opset->has_param[op] = 0;
+            opset->defined[op] = 0;
+        }
+    }
+}
+
+const char * escr1_status_string(escr1_status status) {
+    switch (status) {
+        case ESCR1_OK:              return "ok";
+        case ESCR1_ERR_OPEN:        return "could not open file";
+        case ESCR1_ERR_MAGIC:       return "not an ESCR1_00 file";
+        case ESCR1_ERR_TRUNCATED:   return "truncated file";
+        case ESCR1_ERR_PROFILE:     return "bad profile";
+    }
+    return "unknown error";
+}
+
+static uint read_uint(const uchar * p) {
+    uint v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+escr1_status escr1_open_memory(uchar * data, size_t size, script_file * script) {
+    memset(script, 0, sizeof(script_file));
+    if (size < 8 || memcmp(magic, data, 8)) {
+        return ESCR1_ERR_MAGIC;
+    }
+    if (size > 0xffffffff) {
+        return ESCR1_ERR_TRUNCATED;
+    }
+
+    // Every section is preceded by its size/count, so walk them checking as we go.
+    uint64_t pos = 8;
+    if (pos + sizeof(uint) > size) return ESCR1_ERR_TRUNCATED;
+    uint index_count = read_uint(data + pos);
+    pos += sizeof(uint);
+
+    uint64_t index_pos = pos;
+    pos += (uint64_t)index_count * sizeof(uint);
+    if (pos + sizeof(uint) > size) return ESCR1_ERR_TRUNCATED;
+    uint code_size = read_uint(data + pos);
+    pos += sizeof(uint);
+
+    uint64_t code_pos = pos;
+    pos += code_size;
+    if (pos + sizeof(uint) > size) return ESCR1_ERR_TRUNCATED;
+    uint data_size = read_uint(data + pos);
+    pos += sizeof(uint);
+
+    uint64_t data_pos = pos;
+    if (pos + data_size > size) return ESCR1_ERR_TRUNCATED;
+
+    // Usually a single step: the last string's terminator is the last byte.
+    while (data_size > 0 && data[data_pos + data_size - 1] != 0) {
+        data_size--;
+    }
+
+    script->contents = data;
+    script->file_size = (uint)size;
+    script->index_ptr = (uint *)(data + index_pos);
+    script->index_count = index_count;
+    script->code_ptr = data + code_pos;
+    script->code_size = code_size;
+    script->data_ptr = data + data_pos;
+    script->data_size = data_size;
+    return ESCR1_OK;
+}
+
+bool escr1_map_file(const char * filename, mapped_file * out) {
+    memset(out, 0, sizeof(mapped_file));
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER size;
+    GetFileSizeEx(file, &size);
+    HANDLE mapping = size.QuadPart ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    void * view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (view == NULL) {
+        if (mapping) CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    out->file = file;
+    out->mapping = mapping;
+    out->data = (uchar *)view;
+    out->size = (size_t)size.QuadPart;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void * view = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED) {
+        return false;
+    }
+    out->data = (uchar *)view;
+    out->size = (size_t)st.st_size;
+#endif
+    return true;
+}
+
+void escr1_unmap_file(mapped_file * file) {
+    if (file->data == NULL) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(file->data);
+    CloseHandle((HANDLE)file->mapping);
+    CloseHandle((HANDLE)file->file);
+#else
+    munmap(file->data, file->size);
+#endif
+    memset(file, 0, sizeof(mapped_file));
+}
+
+escr1_status escr1_open_path(const char * filename, mapped_file * map, script_file * script) {
+    if (!escr1_map_file(filename, map)) {
+        return ESCR1_ERR_OPEN;
+    }
+    escr1_status status = escr1_open_memory(map->data, map->size, script);
+    if (status != ESCR1_OK) {
+        escr1_unmap_file(map);
+    }
+    return status;
+}
+
+escr1_status escr1_load_profile(const char * filename, escr1_profile * profile) {
+    profile->title[0] = '\0';
+    profile->count = 0;
+    profile->error_line = 0;
+    FILE * fp = fopen(filename, "r");
+    if (fp == NULL) {
+        return ESCR1_ERR_OPEN;
+    }
+
+    char line[256];
+    uint line_number = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line_number++;
+        char * hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+
+        char name[128];
+        int param_count;
+        if (sscanf(line, " title %127s", name) == 1) {
+            strcpy(profile->title, name);
+        }
+        else if (sscanf(line, " %127s %d", name, &param_count) == 2) {
+            if (profile->count == ESCR1_MAX_USR_OPS) {
+                profile->error_line = line_number;
+                break;
+            }
+            strcpy(profile->names[profile->count], name);
+            profile->ops[profile->count].name = profile->names[profile->count];
+            profile->ops[profile->count].param_count = param_count;
+            profile->count++;
+        }
+        else if (sscanf(line, " %127s", name) == 1) {
+            profile->error_line = line_number;
+            break;
+        }
+    }
+    fclose(fp);
+    return profile->error_line ? ESCR1_ERR_PROFILE : ESCR1_OK;
+}
+
+escr1_status escr1_select_profile(const char * arg, escr1_profile * profile) {
+    if (strcmp(arg, "sensuibu")) {
+        return escr1_load_profile(arg, profile);
+    }
+    strcpy(profile->title, "sensuibu");
+    memcpy(profile->ops, SENSUIBU_OPS, SENSUIBU_OP_COUNT * sizeof(usr_op));
+    profile->count = SENSUIBU_OP_COUNT;
+    profile->error_line = 0;
+    return ESCR1_OK;
+}
+
+uint escr1_build_checkpoints(const script_file * script, const escr1_opset * opset, uint interval,
+                             uint * checkpoints, uint capacity) {
+    if (interval == 0) interval = 1;
+    escr1_iterator it;
+    escr1_iter_init(&it, script, opset);
+    opcode op;
+    uint count = 0;
+    uint until_next = 0;
+    while (escr1_iter_next(&it, &op)) {
+        if (until_next == 0 || op.op == ROP_FILELINE) {
+            if (count < capacity) checkpoints[count] = op.offset;
+            count++;
+        }
+        until_next = until_next == 0 ? interval - 1 : until_next - 1;
+    }
+    return count;
+}
+
+bool escr1_iter_seek(escr1_iterator * it, const uint * checkpoints, uint count, uint offset) {
+    // Last checkpoint at or before offset.
+    uint lo = 0, hi = count;
+    while (lo < hi) {
+        uint mid = lo + (hi - lo) / 2;
+        if (checkpoints[mid] <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+    it->offset = lo ? checkpoints[lo - 1] : 0;
+
+    opcode op;
+    for (;;) {
+        uint start = it->offset;
+        if (!escr1_iter_next(it, &op)) {
+            it->offset = it->code_size;
+            return false;
+        }
+        if (it->offset > offset) {
+            it->offset = start;
+            return true;
+        }
+    }
+}
+
+uint escr1_build_line_map(const script_file * script, const escr1_opset * opset,
+                          escr1_line_range * ranges, uint capacity) {
+    escr1_iterator it;
+    escr1_iter_init(&it, script, opset);
+    opcode op;
+    uint count = 0;
+    uint last = 0;
+    while (escr1_iter_next(&it, &op)) {
+        if (op.op == ROP_FILELINE && (count == 0 || op.param != last)) {
+            if (count < capacity) {
+                ranges[count].offset = op.offset;
+                ranges[count].param = op.param;
+            }
+            count++;
+            last = op.param;
+        }
+    }
+    return count;
+}
+
+const escr1_line_range * escr1_find_line(const escr1_line_range * ranges, uint count, uint offset) {
+    // Last range starting at or before offset.
+    uint lo = 0, hi = count;
+    while (lo < hi) {
+        uint mid = lo + (hi - lo) / 2;
+        if (ranges[mid].offset <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo ? &ranges[lo - 1] : NULL;
+}
+
+bool escr1_parse_fileline_format(const char * arg, escr1_fileline_format * format) {
+    const char * digits;
+    if (!strncmp(arg, "low:", 4)) digits = arg + 4;
+    else if (!strncmp(arg, "high:", 5)) digits = arg + 5;
+    else return false;
+
+    char * end;
+    unsigned long n = strtoul(digits, &end, 10);
+    if (*digits < '0' || *digits > '9' || *end != '\0' || n > 32) {
+        return false;
+    }
+    format->file_bits = (uint)n;
+    format->file_high = arg[0] == 'h';
+    return true;
+}
+
+void escr1_split_fileline(const escr1_fileline_format * format, uint param, uint * file, uint * line) {
+    uint n = format->file_bits;
+    if (n == 0) {
+        *file = 0;
+        *line = param;
+    }
+    else if (n >= 32) {
+        *file = param;
+        *line = 0;
+    }
+    else if (format->file_high) {
+        *file = param >> (32 - n);
+        *line = param & ((1u << (32 - n)) - 1);
+    }
+    else {
+        *file = param & ((1u << n) - 1);
+        *line = param >> n;
+    }
+}
+
+uint escr1_join_fileline(const escr1_fileline_format * format, uint file, uint line) {
+    uint n = format->file_bits;
+    if (n == 0) return line;
+    if (n >= 32) return file;
+    if (format->file_high) return (file << (32 - n)) | (line & ((1u << (32 - n)) - 1));
+    return (line << n) | (file & ((1u << n) - 1));
+}
+
+bool escr1_lookup_string(const script_file * script, uint id, const char ** out) {
+    if (id >= script->index_count) {
+        return false;
+    }
+    uint offset = script->index_ptr[id];
+    if (offset >= script->data_size) {
+        return false;
+    }
+
+    const char * str = (const char *)(script->data_ptr + offset);
+    if (*str == 0) {
+        return false;
+    }
+    *out = str;
+    return true;
+}
+
+struct htoz_table_entry {
+    uchar hankaku;
+    uchar zenkaku[2];
+};
+
+static const uint htoz_table_size = 64;
+
+static const htoz_table_entry htoz_table[htoz_table_size] = {
+    { 0xa0, { 0x81, 0x40 } },
+    { 0x21, { 0x81, 0x49 } },
+    { 0x3f, { 0x81, 0x48 } },
+    { 0xa5, { 0x81, 0x63 } },
+    { 0xa1, { 0x81, 0x42 } },
+    { 0xa2, { 0x81, 0x75 } },
+    { 0xa3, { 0x81, 0x76 } },
+    { 0xa4, { 0x81, 0x41 } },
+    { 0xa6, { 0x82, 0xf0 } },
+    { 0xa7, { 0x82, 0x9f } },
+    { 0xa8, { 0x82, 0xa1 } },
+    { 0xa9, { 0x82, 0xa3 } },
+    { 0xaa, { 0x82, 0xa5 } },
+    { 0xab, { 0x82, 0xa7 } },
+    { 0xac, { 0x82, 0xe1 } },
+    { 0xad, { 0x82, 0xe3 } },
+    { 0xae, { 0x82, 0xe5 } },
+    { 0xaf, { 0x82, 0xc1 } },
+    { 0xb0, { 0x81, 0x5b } },
+    { 0xb1, { 0x82, 0xa0 } },
+    { 0xb2, { 0x82, 0xa2 } },
+    { 0xb3, { 0x82, 0xa4 } },
+    { 0xb4, { 0x82, 0xa6 } },
+    { 0xb5, { 0x82, 0xa8 } },
+    { 0xb6, { 0x82, 0xa9 } },
+    { 0xb7, { 0x82, 0xab } },
+    { 0xb8, { 0x82, 0xad } },
+    { 0xb9, { 0x82, 0xaf } },
+    { 0xba, { 0x82, 0xb1 } },
+    { 0xbb, { 0x82, 0xb3 } },
+    { 0xbc, { 0x82, 0xb5 } },
+    { 0xbd, { 0x82, 0xb7 } },
+    { 0xbe, { 0x82, 0xb9 } },
+    { 0xbf, { 0x82, 0xbb } },
+    { 0xc0, { 0x82, 0xbd } },
+    { 0xc1, { 0x82, 0xbf } },
+    { 0xc2, { 0x82, 0xc2 } },
+    { 0xc3, { 0x82, 0xc4 } },
+    { 0xc4, { 0x82, 0xc6 } },
+    { 0xc5, { 0x82, 0xc8 } },
+    { 0xc6, { 0x82, 0xc9 } },
+    { 0xc7, { 0x82, 0xca } },
+    { 0xc8, { 0x82, 0xcb } },
+    { 0xc9, { 0x82, 0xcc } },
+    { 0xca, { 0x82, 0xcd } },
+    { 0xcb, { 0x82, 0xd0 } },
+    { 0xcc, { 0x82, 0xd3 } },
+    { 0xcd, { 0x82, 0xd6 } },
+    { 0xce, { 0x82, 0xd9 } },
+    { 0xcf, { 0x82, 0xdc } },
+    { 0xd0, { 0x82, 0xdd } },
+    { 0xd1, { 0x82, 0xde } },
+    { 0xd2, { 0x82, 0xdf } },
+    { 0xd3, { 0x82, 0xe0 } },
+    { 0xd4, { 0x82, 0xe2 } },
+    { 0xd5, { 0x82, 0xe4 } },
+    { 0xd6, { 0x82, 0xe6 } },
+    { 0xd7, { 0x82, 0xe7 } },
+    { 0xd8, { 0x82, 0xe8 } },
+    { 0xd9, { 0x82, 0xe9 } },
+    { 0xda, { 0x82, 0xea } },
+    { 0xdb, { 0x82, 0xeb } },
+    { 0xdc, { 0x82, 0xed } },
+    { 0xdd, { 0x82, 0xf1 } },
+};
+
+static int htoz_table_lookup(uchar hk) {
+    for (uint i = 0; i < htoz_table_size; ++i) {
+        const htoz_table_entry * e = &htoz_table[i];
+        if (e->hankaku == hk) {
+            return i;
+        } 
+    }
+    return -1;
+}
+
+bool escr1_htoz_char(uchar c, uchar zenkaku[2]) {
+    // 0xa0 is an invalid lead byte, but is used by the engine to encode a full-width space.
+    int idx = htoz_table_lookup(c);
+    if (idx < 0) {
+        return false;
+    }
+    zenkaku[0] = htoz_table[idx].zenkaku[0];
+    zenkaku[1] = htoz_table[idx].zenkaku[1];
+    return true;
+}
+
+uint escr1_convert_htoz(const uchar * src, uchar * dest, uint dest_size) {
+    if (dest_size == 0) {
+        return 0;
+    }
+
+    uchar * start = dest;
+    uchar * end = dest + dest_size - 1;     // Leave room for the terminator.
+    while (*src) {
+        if ((*src >= 0x81 && *src <= 0x9f) || (*src >= 0xe0 && *src <= 0xef)) {
+            // Two byte character.
+            if (src[1] == 0 || end - dest < 2) break;
+            *dest++ = *src++;
+            *dest++ = *src++;
+        }
+        else if (*src == 0x1b) {
+            // ESC, used to excape following character.
+            if (src[1] == 0 || end - dest < 1) break;
+            src++;
+            *dest++ = *src++;
+        }
+        else {
+            uchar zenkaku[2];
+            if (escr1_htoz_char(*src, zenkaku)) {
+                if (end - dest < 2) break;
+                *dest++ = zenkaku[0];
+                *dest++ = zenkaku[1];
+                src++;
+            }
+            else {
+                // Single byte character.
+                if (end - dest < 1) break;
+                *dest++ = *src++;
+            }
+        }
+    }
+    *dest = '\0';
+    return (dest - start);
+}
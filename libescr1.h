@@ -0,0 +1,483 @@
+#ifndef LIBESCR1_H
+#define LIBESCR1_H
+
+// libescr1 -- decoding ESCR1_00 scripts, for tools that want to embed the extractor's
+// logic instead of shelling out to it.
+//
+// Nothing in here allocates or keeps global state.  Scripts are opened in place over a
+// caller-owned buffer or a read-only file mapping, instructions are decoded by a
+// header-only iterator, and string conversion writes into caller-provided buffers.  Any
+// number of threads can use the library at once as long as they don't share iterators.
+//
+// Build as a static library:
+// $ g++ -c -O2 ./libescr1.cpp -o libescr1.o -std=c++0x
+// $ ar rcs libescr1.a libescr1.o
+//
+// Or as a shared library (define ESCR1_BUILD_DLL on Windows, ESCR1_DLL for its users):
+// $ g++ -shared -fPIC -O2 ./libescr1.cpp -o libescr1.so -std=c++0x
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(_WIN32) && defined(ESCR1_BUILD_DLL)
+#define ESCR1_API __declspec(dllexport)
+#elif defined(_WIN32) && defined(ESCR1_DLL)
+#define ESCR1_API __declspec(dllimport)
+#else
+#define ESCR1_API
+#endif
+
+typedef unsigned char uchar;
+typedef uint32_t uint;
+
+
+//  FORMAT NOTES:
+//
+// File magic is 'ESCR1_00' (0x45 0x53 0x43 0x52 0x31 0x5f 0x30 0x30).
+//
+// Multibyte integers are stored in little endian order.
+//
+// Files are split into three sections:
+// - An index table
+//   - Offsets into data section to the start of string literals.
+// - Bytecode
+// - Data (null-terminated Shift-JIS(?) encoded strings).
+
+ESCR1_API extern const uchar magic[9];
+
+struct script_file {
+    uchar * contents;   // Raw contents of file.  All other pointers point into this buffer.
+    uint file_size;     // Size of entire file.
+    uint * index_ptr;   // Pointer to indices
+    uint index_count;   // Number of indices
+    uchar * code_ptr;   // Pointer to bytecode
+    uint code_size;     // Size of code block
+    uchar * data_ptr;   // Pointer to data
+    uint data_size;     // Size of data block
+};
+
+// BYTECODE NOTES:
+
+// VM is largely stack based, but also provides globally-scoped variables and flags.
+//
+// Opcodes are one byte.  Parameters are 4 bytes (one uint).
+// The VM declares 33 'reserved' opcodes.  The rest (up to 255) are left open, and the
+// client code can declare an opcode by providing a function pointer.
+//
+// Parameters for client-defined opcodes are pushed to the stack prior to the call.  The 
+// VM pops the params off the stack and passes them through a param array (maximum of 32 
+// params).
+//
+// Several reserved opcodes (and, optionally, any user-defined opcode) take an immediate
+// param -- i.e., the next 4 byte integer in the code. 
+// UPDATE (2014-11-21):  Immediate param for user-defined opcodes is *not* a parameter for
+// the function call, but rather a parameter *count* for opcodes that can accept a variable
+// argument count.  (This doesn't effect parsing, but is important for execution.)
+
+// RESERVED OPCODES
+enum {
+    ROP_END = 0,
+    ROP_JUMP,       // param
+    ROP_JUMPZ,      // param
+    ROP_CALL,       // param
+    ROP_RET,
+    ROP_PUSH,       // param
+    ROP_POP,
+    ROP_STR,        // param
+    ROP_SETVAR,
+    ROP_GETVAR,
+    ROP_SETFLAG,
+    ROP_GETFLAG,
+    ROP_NEG,
+    ROP_ADD,
+    ROP_SUB,
+    ROP_MUL,
+    ROP_DIV,
+    ROP_MOD,
+    ROP_AND,
+    ROP_OR,
+    ROP_NOT,
+    ROP_SHR,
+    ROP_SHL,
+    ROP_EQ,
+    ROP_NE,
+    ROP_GT,
+    ROP_GE,
+    ROP_LT,
+    ROP_LE,
+    ROP_LNOT,
+    ROP_LAND,
+    ROP_LOR,
+    ROP_FILELINE,   // param
+
+    ROP_COUNT
+};
+
+// Display names, padded to line up in the listing.
+ESCR1_API extern const char * const ROP_NAMES[ROP_COUNT];
+
+struct opcode {
+    uint offset;
+    uint op;
+    uint param;
+};
+
+struct usr_op {
+    const char * name;
+    int param_count;
+};
+
+// USER DEFINED OPCODES
+//
+// Each title declares its own.  The table for SENSUIBU is built in.
+
+ESCR1_API extern const usr_op SENSUIBU_OPS[];
+ESCR1_API extern const uint SENSUIBU_OP_COUNT;
+
+// Per-opcode decode information for all 256 byte values, built once from a title's
+// user opcode table so decoding is a single lookup per instruction.  Opcodes the title
+// doesn't define are named "USR_UNKNOWN" and take no param.
+struct escr1_opset {
+    const char * names[256];
+    int param_counts[256];      // Reserved opcodes: 1 if they take an immediate, else 0.
+    uchar has_param[256];
+    uchar defined[256];         // 0 for the USR_UNKNOWN filler.
+};
+
+ESCR1_API void escr1_opset_init(escr1_opset * opset, const usr_op * usr_ops, uint usr_count);
+
+// OPENING SCRIPTS
+
+enum escr1_status {
+    ESCR1_OK = 0,
+    ESCR1_ERR_OPEN,         // File could not be opened or mapped.
+    ESCR1_ERR_MAGIC,        // Not an ESCR1_00 file.
+    ESCR1_ERR_TRUNCATED,    // A section runs past the end of the file.
+    ESCR1_ERR_PROFILE,      // A bad line in a profile, or too many opcodes.
+};
+
+ESCR1_API const char * escr1_status_string(escr1_status status);
+
+// Parses the section table of a script already in memory.  The script points into data,
+// which must outlive it.
+//
+// Every section is bounds checked here, once, so nothing downstream has to be:
+// - index, code and data all lie inside the buffer, and the code block is always
+//   followed by at least the 4-byte data size;
+// - data_size is cut back to just past the last NUL, so any string that starts inside
+//   the data section is terminated inside it.  Bytes after the last terminator can't be
+//   part of a valid string and are left out.
+ESCR1_API escr1_status escr1_open_memory(uchar * data, size_t size, script_file * script);
+
+// A read-only file mapping.
+struct mapped_file {
+    uchar * data;
+    size_t size;
+    void * file;        // Windows only: file and mapping handles.
+    void * mapping;
+};
+
+ESCR1_API bool escr1_map_file(const char * filename, mapped_file * out);
+ESCR1_API void escr1_unmap_file(mapped_file * file);
+
+// Maps a script file and parses it.  Close with escr1_unmap_file(map).
+ESCR1_API escr1_status escr1_open_path(const char * filename, mapped_file * map, script_file * script);
+
+// PROFILES
+//
+// A profile is a title's user opcode table, for titles that aren't built in, in a text
+// file:
+//
+//   # Comments start with '#'.
+//   title EXAMPLE
+//   USR_END         1
+//   USR_TLK        -1
+//
+// One opcode per line, in opcode order starting at ROP_COUNT.  As in SENSUIBU_OPS, a
+// negative param count marks ops that take an immediate (variadic) param.  Without a
+// title line the title is left empty, for the caller to name the profile after the file.
+//
+// A loaded profile holds its own strings; ops[i].name points into it, so don't copy one.
+
+static const uint ESCR1_MAX_USR_OPS = 256 - ROP_COUNT;
+
+struct escr1_profile {
+    char title[128];
+    usr_op ops[ESCR1_MAX_USR_OPS];
+    uint count;
+    uint error_line;                    // With ESCR1_ERR_PROFILE, the line at fault
+    char names[ESCR1_MAX_USR_OPS][128];
+};
+
+ESCR1_API escr1_status escr1_load_profile(const char * filename, escr1_profile * profile);
+
+// "sensuibu", or the path of a profile file.
+ESCR1_API escr1_status escr1_select_profile(const char * arg, escr1_profile * profile);
+
+// DECODING
+
+struct escr1_iterator {
+    const uchar * code;
+    uint code_size;
+    uint fast_end;      // Any instruction starting before this fits in the block.
+    uint offset;
+    const uchar * has_param;
+};
+
+inline void escr1_iter_init(escr1_iterator * it, const script_file * script, const escr1_opset * opset) {
+    it->code = script->code_ptr;
+    it->code_size = script->code_size;
+    it->fast_end = script->code_size > sizeof(uint) ? script->code_size - (uint)sizeof(uint) : 0;
+    it->offset = 0;
+    it->has_param = opset->has_param;
+}
+
+// Checked decode for the last few bytes of the block, where a param may not fit.
+inline bool escr1_iter_next_tail(escr1_iterator * it, opcode * op) {
+    uint offset = it->offset;
+    if (offset >= it->code_size) {
+        return false;
+    }
+
+    uint o = it->code[offset];
+    op->offset = offset;
+    op->op = o;
+    if (it->has_param[o]) {
+        if (it->code_size - offset < 1 + sizeof(uint)) {
+            return false;
+        }
+        memcpy(&op->param, it->code + offset + 1, sizeof(uint));
+        it->offset = offset + 1 + sizeof(uint);
+    }
+    else {
+        op->param = (uint)-1;
+        it->offset = offset + 1;
+    }
+    return true;
+}
+
+// Decodes the instruction at the iterator and advances past it.  Returns false at the
+// end of the code block, or if the last instruction's param runs past it (check
+// escr1_iter_truncated to tell the two apart).  Ops without a param get param -1.
+//
+// Up to fast_end there are at least 5 bytes left, so the param is read unconditionally
+// and the only check per instruction is the one against fast_end.
+inline bool escr1_iter_next(escr1_iterator * it, opcode * op) {
+    uint offset = it->offset;
+    if (offset >= it->fast_end) {
+        return escr1_iter_next_tail(it, op);
+    }
+
+    uint o = it->code[offset];
+    uint param;
+    memcpy(&param, it->code + offset + 1, sizeof(uint));
+    uint has_param = it->has_param[o];
+    op->offset = offset;
+    op->op = o;
+    op->param = has_param ? param : (uint)-1;
+    it->offset = offset + 1 + (has_param ? (uint)sizeof(uint) : 0);
+    return true;
+}
+
+inline bool escr1_iter_truncated(const escr1_iterator * it) {
+    return it->offset < it->code_size;
+}
+
+// RANDOM ACCESS
+//
+// Instructions are 1 or 5 bytes, so where one starts depends on every byte before it, and
+// decoding around an arbitrary offset means decoding from the start of the block.  A
+// checkpoint list is a sorted array of known instruction starts: every interval-th
+// instruction, plus every ROP_FILELINE.  Seeking from it costs a binary search and at most
+// interval instructions of decoding.
+
+// Writes up to capacity checkpoints and returns how many there are, so a call with
+// capacity 0 sizes the array.
+ESCR1_API uint escr1_build_checkpoints(const script_file * script, const escr1_opset * opset, uint interval,
+                                       uint * checkpoints, uint capacity);
+
+// Moves the iterator to the instruction containing offset, decoding forward from the last
+// checkpoint at or before it.  Returns false, leaving the iterator at the end, if no
+// instruction contains offset: it's past the code block or in a truncated last
+// instruction.  Checkpoints that aren't instruction starts give wrong boundaries but
+// never read out of bounds.
+ESCR1_API bool escr1_iter_seek(escr1_iterator * it, const uint * checkpoints, uint count, uint offset);
+
+// SOURCE LINES
+//
+// ROP_FILELINE marks where the code for a source line starts, and its param names the
+// file and line.  A line map is the list of those marks as ranges: each runs from its
+// offset to the next one's (the last to the end of the block).  Consecutive marks with
+// the same param make one range.  How file and line are packed into the param differs
+// between titles, so the caller says, with an escr1_fileline_format.
+
+struct escr1_line_range {
+    uint offset;
+    uint param;
+};
+
+// Writes up to capacity ranges and returns how many there are, so a call with capacity 0
+// sizes the array.
+ESCR1_API uint escr1_build_line_map(const script_file * script, const escr1_opset * opset,
+                                    escr1_line_range * ranges, uint capacity);
+
+// The range containing offset, or NULL if offset is before the first ROP_FILELINE.
+ESCR1_API const escr1_line_range * escr1_find_line(const escr1_line_range * ranges, uint count, uint offset);
+
+// The file number is in the low or high file_bits bits of the param, and the line in the
+// rest.  With file_bits 0 (the zeroed default) the whole param is the line, in file 0.
+struct escr1_fileline_format {
+    uint file_bits;
+    bool file_high;
+};
+
+// Parses the tools' --fileline argument, "low:N" or "high:N" with N up to 32.
+ESCR1_API bool escr1_parse_fileline_format(const char * arg, escr1_fileline_format * format);
+
+ESCR1_API void escr1_split_fileline(const escr1_fileline_format * format, uint param, uint * file, uint * line);
+
+// The inverse, for breaking on a file and line.  Bits that don't fit are dropped.
+ESCR1_API uint escr1_join_fileline(const escr1_fileline_format * format, uint file, uint line);
+
+// VISITORS
+//
+// Static dispatch over decoded instructions.  Derive from escr1_visitor<YourType> and
+// declare only the handlers you care about; name hiding picks yours over the defaults at
+// compile time, and the defaults are empty inline functions that compile away.
+//
+// Each specific handler falls back to a group handler (on_branch, on_unary, on_binary),
+// and the groups and remaining ops fall back to on_default.  on_op runs first for every
+// instruction, on_user for every op at or above ROP_COUNT.
+//
+//   struct push_counter : escr1_visitor<push_counter> {
+//       uint count;
+//       void on_push(const opcode &) { count++; }
+//   };
+//
+//   push_counter pc;
+//   pc.count = 0;
+//   escr1_visit(&script, &opset, pc);
+
+template <class Derived>
+struct escr1_visitor {
+    Derived & self() { return static_cast<Derived &>(*this); }
+
+    void on_op(const opcode &) {}
+    void on_default(const opcode &) {}
+    void on_truncated(uint) {}
+
+    void on_branch(const opcode & op) { self().on_default(op); }
+    void on_unary(const opcode & op) { self().on_default(op); }
+    void on_binary(const opcode & op) { self().on_default(op); }
+    void on_user(const opcode & op) { self().on_default(op); }
+
+    void on_end(const opcode & op) { self().on_branch(op); }
+    void on_jump(const opcode & op) { self().on_branch(op); }
+    void on_jumpz(const opcode & op) { self().on_branch(op); }
+    void on_call(const opcode & op) { self().on_branch(op); }
+    void on_ret(const opcode & op) { self().on_branch(op); }
+    void on_push(const opcode & op) { self().on_default(op); }
+    void on_pop(const opcode & op) { self().on_default(op); }
+    void on_str(const opcode & op) { self().on_default(op); }
+    void on_setvar(const opcode & op) { self().on_default(op); }
+    void on_getvar(const opcode & op) { self().on_default(op); }
+    void on_setflag(const opcode & op) { self().on_default(op); }
+    void on_getflag(const opcode & op) { self().on_default(op); }
+    void on_neg(const opcode & op) { self().on_unary(op); }
+    void on_add(const opcode & op) { self().on_binary(op); }
+    void on_sub(const opcode & op) { self().on_binary(op); }
+    void on_mul(const opcode & op) { self().on_binary(op); }
+    void on_div(const opcode & op) { self().on_binary(op); }
+    void on_mod(const opcode & op) { self().on_binary(op); }
+    void on_and(const opcode & op) { self().on_binary(op); }
+    void on_or(const opcode & op) { self().on_binary(op); }
+    void on_not(const opcode & op) { self().on_unary(op); }
+    void on_shr(const opcode & op) { self().on_binary(op); }
+    void on_shl(const opcode & op) { self().on_binary(op); }
+    void on_eq(const opcode & op) { self().on_binary(op); }
+    void on_ne(const opcode & op) { self().on_binary(op); }
+    void on_gt(const opcode & op) { self().on_binary(op); }
+    void on_ge(const opcode & op) { self().on_binary(op); }
+    void on_lt(const opcode & op) { self().on_binary(op); }
+    void on_le(const opcode & op) { self().on_binary(op); }
+    void on_lnot(const opcode & op) { self().on_unary(op); }
+    void on_land(const opcode & op) { self().on_binary(op); }
+    void on_lor(const opcode & op) { self().on_binary(op); }
+    void on_fileline(const opcode & op) { self().on_default(op); }
+};
+
+// Dispatches a single instruction.
+template <class V>
+inline void escr1_visit_op(V & v, const opcode & op) {
+    v.on_op(op);
+    switch (op.op) {
+        case ROP_END:       v.on_end(op); break;
+        case ROP_JUMP:      v.on_jump(op); break;
+        case ROP_JUMPZ:     v.on_jumpz(op); break;
+        case ROP_CALL:      v.on_call(op); break;
+        case ROP_RET:       v.on_ret(op); break;
+        case ROP_PUSH:      v.on_push(op); break;
+        case ROP_POP:       v.on_pop(op); break;
+        case ROP_STR:       v.on_str(op); break;
+        case ROP_SETVAR:    v.on_setvar(op); break;
+        case ROP_GETVAR:    v.on_getvar(op); break;
+        case ROP_SETFLAG:   v.on_setflag(op); break;
+        case ROP_GETFLAG:   v.on_getflag(op); break;
+        case ROP_NEG:       v.on_neg(op); break;
+        case ROP_ADD:       v.on_add(op); break;
+        case ROP_SUB:       v.on_sub(op); break;
+        case ROP_MUL:       v.on_mul(op); break;
+        case ROP_DIV:       v.on_div(op); break;
+        case ROP_MOD:       v.on_mod(op); break;
+        case ROP_AND:       v.on_and(op); break;
+        case ROP_OR:        v.on_or(op); break;
+        case ROP_NOT:       v.on_not(op); break;
+        case ROP_SHR:       v.on_shr(op); break;
+        case ROP_SHL:       v.on_shl(op); break;
+        case ROP_EQ:        v.on_eq(op); break;
+        case ROP_NE:        v.on_ne(op); break;
+        case ROP_GT:        v.on_gt(op); break;
+        case ROP_GE:        v.on_ge(op); break;
+        case ROP_LT:        v.on_lt(op); break;
+        case ROP_LE:        v.on_le(op); break;
+        case ROP_LNOT:      v.on_lnot(op); break;
+        case ROP_LAND:      v.on_land(op); break;
+        case ROP_LOR:       v.on_lor(op); break;
+        case ROP_FILELINE:  v.on_fileline(op); break;
+        default:            v.on_user(op); break;
+    }
+}
+
+// Decodes a whole code block, feeding each instruction to v.  Calls v.on_truncated with
+// the offset of the last instruction if its param runs past the end of the block.
+template <class V>
+inline void escr1_visit(const script_file * script, const escr1_opset * opset, V & v) {
+    escr1_iterator it;
+    escr1_iter_init(&it, script, opset);
+    opcode op;
+    while (escr1_iter_next(&it, &op)) {
+        escr1_visit_op(v, op);
+    }
+    if (escr1_iter_truncated(&it)) {
+        v.on_truncated(it.offset);
+    }
+}
+
+// STRINGS
+
+// Looks up string literal `id`.  Returns false if the id is out of range, the offset
+// points outside the data section, or the string is empty.
+ESCR1_API bool escr1_lookup_string(const script_file * script, uint id, const char ** out);
+
+// Full-width replacement for a half-width katakana (or the few punctuation marks the
+// engine remaps).  Returns false if c isn't one of them.
+ESCR1_API bool escr1_htoz_char(uchar c, uchar zenkaku[2]);
+
+// Converts half-width katakana in src to full-width hiragana, writing at most dest_size
+// bytes (including the terminator) to dest.  Two-byte characters pass through and ESC
+// (0x1b) escapes the byte after it.  Output is truncated at a character boundary if
+// dest is too small.  Returns the length written, not counting the terminator.
+ESCR1_API uint escr1_convert_htoz(const uchar * src, uchar * dest, uint dest_size);
+
+#endif // LIBESCR1_H
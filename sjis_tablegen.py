@@ -0,0 +1,43 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+# Generates sjis_table.h, the Shift-JIS -> Unicode table used for JSON output.
+#
+# Only the two-byte ranges the extractor treats as lead bytes are covered (0x81-0x9f,
+# 0xe0-0xef), with trail bytes 0x40-0xfc.  Decoding uses cp932, which is what the
+# engine (a Windows title) actually renders with.  Unmapped pairs become U+FFFD.
+#
+# $ python sjis_tablegen.py > sjis_table.h
+
+from __future__ import print_function
+
+LEADS = list(range(0x81, 0xa0)) + list(range(0xe0, 0xf0))
+TRAILS = list(range(0x40, 0xfd))
+
+def decode(lead, trail):
+    try:
+        c = bytearray([lead, trail]).decode('cp932')
+    except UnicodeDecodeError:
+        return 0xfffd
+    if len(c) != 1:
+        return 0xfffd
+    return ord(c)
+
+def output():
+    print("// Generated by sjis_tablegen.py.  Do not edit.")
+    print("")
+    print("static const uint32_t sjis_trail_first = 0x%02x;" % TRAILS[0])
+    print("static const uint32_t sjis_trail_count = %d;" % len(TRAILS))
+    print("")
+    print("// Indexed by [lead index][trail - sjis_trail_first], see sjis_lead_index().")
+    print("static const uint16_t sjis_table[%d][%d] = {" % (len(LEADS), len(TRAILS)))
+    for lead in LEADS:
+        print("    { // 0x%02x" % lead)
+        row = [decode(lead, t) for t in TRAILS]
+        for i in range(0, len(row), 12):
+            print("        " + " ".join("0x%04x," % c for c in row[i:i + 12]))
+        print("    },")
+    print("};")
+
+if __name__ == '__main__':
+    output()